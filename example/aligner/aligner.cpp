@@ -7,6 +7,10 @@
 #include <atomic>
 #include <cstdint>
 #include <chrono>
+#include <memory>
+
+// Read compressed FASTA and FASTQ files. This needs zlib.
+#define BOOST_GENETICS_HAS_ZLIB 1
 
 #include <boost/genetics/fasta.hpp>
 #include <boost/genetics/utils.hpp>
@@ -35,6 +39,15 @@ public:
             ("fasta-files", value<std::vector<std::string> >(), "input filename(s)")
             ("output-file,o", value<std::string>()->default_value("index.bin"), "output filename")
             ("num-index-chars,n", value<int>()->default_value(12), "number of chars in first stage index")
+            ("num-threads,t", value<int>()->default_value(1), "number of threads to use.")
+            ("radix-partition", "partition addresses before storing them (faster for large -n)")
+            ("max-memory,m", value<size_t>()->default_value(0), "stream the index to the file using at most this many megabytes (0 builds it in memory)")
+            ("temp-directory", value<std::string>()->default_value(""), "directory for temporary files when using --max-memory")
+            ("compress", "delta code the index addresses (smaller, slower to search)")
+            ("large", "use 64 bit addresses for references of more than 4G bases")
+            ("seed-mask", value<std::string>()->default_value(""), "index spaced seeds, eg. 110110110 (sets -n to the number of 1s)")
+            ("engine", value<std::string>()->default_value("tsi"), "index to build: tsi (two stage index) or fm (FM index, smaller)")
+            ("sa-sample-rate", value<size_t>()->default_value(32), "FM index suffix array sample rate (larger is smaller, slower)")
         ;
 
         positional_options_description pod;
@@ -54,49 +67,14 @@ public:
             return;
         }
 
-        // Append the fasta files to the reference.
-        fasta_file builder;
-        auto fa_files = vm["fasta-files"].as<std::vector<std::string> >();
-        for (auto &f : fa_files) {
-            std::cerr << f << "\n";
-            builder.append(f);
-        }
-
-        if (builder.get_string().size() == 0) {
-            throw std::runtime_error("no fa files or empty reference");
-        }
-
-        // Build the index. This will take some time.
-        builder.make_index(vm["num-index-chars"].as<int>());
-
-        // Find the size of the reference file.
-        writer sizer(nullptr, nullptr);
-        builder.write_binary(sizer);
-        size_t size = (size_t)sizer.get_ptr();
-
-        // Get the file name to write to (defaults to index.bin).
-        std::string filename = vm["output-file"].as<std::string>();
-
-        // there may be a better way of creating a pre-sized writable file!
-        {
-            std::ofstream os(filename, std::ios_base::binary);
-            if (os.bad()) {
-                throw std::runtime_error("unable to write index file");
-            }
-            os.seekp(size-1);
-            os.write("", 1);
-        }
-
-        // Use file mapping to write the index file directly to buffers.
-        try {
-            file_mapping fm(filename.c_str(), read_write);
-            mapped_region region(fm, read_write, 0, size);
-            char *p = (char*)region.get_address();
-            char *end = p + region.get_size();
-            writer w(p, end);
-            builder.write_binary(w);
-        } catch(interprocess_exception &) {
-            throw std::runtime_error("unable to write to the index file");
+        if (vm.count("compress") && vm.count("large")) {
+            throw std::runtime_error("--compress and --large can not be used together");
+        } else if (vm.count("compress")) {
+            write_index_file<compressed_fasta_file>(vm);
+        } else if (vm.count("large")) {
+            write_index_file<large_fasta_file>(vm);
+        } else {
+            write_index_file<fasta_file>(vm);
         }
     }
 
@@ -114,6 +92,15 @@ public:
             ("fastq-files,q", value<std::vector<std::string> >(), "fastq files (2 max)")
             ("output-file,o", value<std::string>()->default_value("out.sam"), "output filename")
             ("num-threads,t", value<int>()->default_value(1), "number of threads to use.")
+            ("compressed", "the index was built with --compress")
+            ("large", "the index was built with --large")
+            ("batch-size,b", value<int>()->default_value(32), "number of reads to search for at once")
+            ("max-bucket-size", value<size_t>()->default_value(100), "ignore seeds with more hits than this")
+            ("seed-shifts", value<size_t>()->default_value(0), "shift seeds this far along repetitive reads")
+            ("seed-stride", value<size_t>()->default_value(0), "distance between seeds in each read (0 places them end to end)")
+            ("max-gap", value<size_t>()->default_value(0), "allow this many bases to be inserted or deleted in each read")
+            ("max-distance,d", value<size_t>()->default_value(5), "maximum number of errors in each read")
+            ("engine", value<std::string>()->default_value("tsi"), "search with this --engine (tsi or fm); an index built with fm alone is searched with fm")
         ;
 
         positional_options_description pod;
@@ -142,7 +129,15 @@ public:
         char *p = (char*)region.get_address();
         char *end = p + region.get_size();
         mapper m(p, end);
-        mapped_fasta_file ref(m);
+        std::unique_ptr<fasta_file_interface> ref_ptr;
+        if (vm.count("compressed")) {
+            ref_ptr.reset(new compressed_mapped_fasta_file(m));
+        } else if (vm.count("large")) {
+            ref_ptr.reset(new large_mapped_fasta_file(m));
+        } else {
+            ref_ptr.reset(new mapped_fasta_file(m));
+        }
+        fasta_file_interface &ref = *ref_ptr;
 
         // Get the fastq filenames (max of 2).
         // These contain sequences we want to align.
@@ -152,16 +147,19 @@ public:
             throw std::runtime_error("expected one or two FASTQ files");
         }
 
+        // Run on multiple threads.
+        int num_threads = vm["num-threads"].as<int>();
+
         // Build a vector of input files.
-        std::vector<std::ifstream> read_files(fq_filenames.size());
+        // Compressed files are decoded on background threads while we align.
+        std::vector<fastq_input> read_files;
         for (size_t i = 0; i != fq_filenames.size(); ++i) {
             auto &f = fq_filenames[i];
             std::cerr << f << "\n";
-            read_files[i].open(f, std::ios_base::binary);
+            read_files.emplace_back(f, (size_t)num_threads);
         }
 
-        // Run on multiple threads.
-        int num_threads = vm["num-threads"].as<int>();
+        size_t batch_size = (size_t)std::max(vm["batch-size"].as<int>(), 1);
         std::vector<std::thread> align_threads;
         std::mutex read_mutex;
         std::atomic<size_t> num_reads;
@@ -170,12 +168,16 @@ public:
         std::atomic<size_t> num_matches;
 
         search_params params;
-        params.max_distance = 5;
-        params.max_gap = 0;
+        params.max_distance = vm["max-distance"].as<size_t>();
+        params.max_gap = vm["max-gap"].as<size_t>();
         params.max_results = 100;
         params.always_brute_force = false;
         params.never_brute_force = true;
         params.search_rev_comp = true;
+        params.max_bucket_size = vm["max-bucket-size"].as<size_t>();
+        params.max_seed_shifts = vm["seed-shifts"].as<size_t>();
+        params.seed_stride = vm["seed-stride"].as<size_t>();
+        params.engine = parse_engine(vm["engine"].as<std::string>());
 
         for (size_t i = 0; i != ref.get_num_chromosomes(); ++i) {
             const chromosome &c = ref.get_chromosome(i);
@@ -207,16 +209,15 @@ public:
 
                             if (max_reads == 0) break;
 
-                            // If we have read too much, seek back to allow the next thread
+                            // If we have read too much, put back the rest to allow the next thread
                             // to read the whole entry.
                             for (size_t i = 0; i != read_files.size(); ++i)  {
                                 auto &buffer = at.buffers[i];
                                 auto &stream = read_files[i];
                                 auto &names = at.namess[i];
-                                size_t bytes = (size_t)stream.gcount();
-                                const char *end = buffer.data() + bytes;
+                                const char *end = buffer.data() + at.sizes[i];
                                 if (names[max_reads] != end) {
-                                    stream.seekg(names[max_reads] - end, std::ios_base::cur);
+                                    stream.unread(names[max_reads], end - names[max_reads]);
                                 }
                             }
                         }
@@ -224,18 +225,22 @@ public:
                         at.stats.merges_done = 0;
                         at.stats.compares_done = 0;
                         size_t matches = 0;
+
+                        // align the whole block, batch_size reads at a time.
+                        for (size_t i = 0; i != read_files.size(); ++i)  {
+                            at.align_reads(i, max_reads, params, batch_size, ref);
+                        }
+
                         for (size_t read_idx = 0; read_idx != max_reads; ++read_idx) {
-                            // read and align a pair of reads or a single read
                             for (size_t i = 0; i != read_files.size(); ++i)  {
-                                at.align_read(i, read_idx, params, ref);
-                                matches += at.resultss[i].size() != 0;
+                                matches += at.resultss[i][read_idx].size() != 0;
                             }
 
                             // Todo: add pair matching.
 
                             // Write the results for each input read.
                             for (size_t i = 0; i != read_files.size(); ++i)  {
-                                at.write_sam(i, sam_file, ref);
+                                at.write_sam(i, read_idx, sam_file, ref);
                             }
                         }
                         num_merges += at.stats.merges_done;
@@ -264,7 +269,147 @@ public:
     }
 
 private:
+    // Get the index engine for the --engine option.
+    static boost::genetics::index_engine parse_engine(const std::string &name) {
+        if (name == "tsi") {
+            return boost::genetics::two_stage_engine;
+        } else if (name == "fm") {
+            return boost::genetics::fm_engine;
+        }
+        throw std::runtime_error("--engine must be tsi or fm");
+    }
+
+    // Build the index for the "aligner index" mode and write it to the output file.
+    template <class FastaFile>
+    void write_index_file(boost::program_options::variables_map &vm) {
+        using namespace boost::genetics;
+        using namespace boost::interprocess;
+
+        // Append the fasta files to the reference, packing chromosomes in parallel.
+        FastaFile builder;
+        auto fa_files = vm["fasta-files"].as<std::vector<std::string> >();
+        for (auto &f : fa_files) {
+            std::cerr << f << "\n";
+        }
+        builder.append(fa_files, (size_t)vm["num-threads"].as<int>());
+
+        if (builder.get_string().size() == 0) {
+            throw std::runtime_error("no fa files or empty reference");
+        }
+
+        // Build the index. This will take some time.
+        index_params params;
+        params.num_threads = (size_t)vm["num-threads"].as<int>();
+        params.strategy = vm.count("radix-partition") ? radix_partition : direct_scatter;
+        params.max_memory = vm["max-memory"].as<size_t>() << 20;
+        params.temp_directory = vm["temp-directory"].as<std::string>();
+        params.seed_mask = parse_seed_mask(vm["seed-mask"].as<std::string>());
+        params.engine = parse_engine(vm["engine"].as<std::string>());
+        params.sa_sample_rate = vm["sa-sample-rate"].as<size_t>();
+        size_t num_indexed_chars = (size_t)vm["num-index-chars"].as<int>();
+        if (params.seed_mask) {
+            num_indexed_chars = seed_mask_chars(params.seed_mask);
+        }
+
+        // With a memory limit, the index is built as it is written to the file.
+        // Compressed indices and FM indices are always built in memory,
+        // FM indices a few chromosomes at a time.
+        bool is_streamed = params.max_memory && !vm.count("compress") && params.engine != fm_engine;
+        auto write_index = [&](writer &wr) {
+            if (is_streamed) {
+                builder.write_binary(wr, num_indexed_chars, params);
+            } else {
+                builder.write_binary(wr);
+            }
+        };
+
+        if (!is_streamed) {
+            builder.make_index(num_indexed_chars, params);
+        }
+
+        // Find the size of the reference file.
+        writer sizer(nullptr, nullptr);
+        write_index(sizer);
+        size_t size = (size_t)sizer.get_ptr();
+
+        // Get the file name to write to (defaults to index.bin).
+        std::string filename = vm["output-file"].as<std::string>();
+
+        // there may be a better way of creating a pre-sized writable file!
+        {
+            std::ofstream os(filename, std::ios_base::binary);
+            if (os.bad()) {
+                throw std::runtime_error("unable to write index file");
+            }
+            os.seekp(size-1);
+            os.write("", 1);
+        }
+
+        // Use file mapping to write the index file directly to buffers.
+        try {
+            file_mapping fm(filename.c_str(), read_write);
+            mapped_region region(fm, read_write, 0, size);
+            char *p = (char*)region.get_address();
+            char *end = p + region.get_size();
+            writer w(p, end);
+            write_index(w);
+        } catch(interprocess_exception &) {
+            throw std::runtime_error("unable to write to the index file");
+        }
+    }
+
     static const size_t buffer_size = 0x100000;
+
+    //! A FASTQ file, which may be compressed with gzip or bgzip.
+    class fastq_input {
+    public:
+        fastq_input(const std::string &filename, size_t num_threads) {
+            using namespace boost::genetics;
+            file.open(filename, std::ios_base::binary);
+            if (!file) {
+                throw std::runtime_error("unable to open " + filename);
+            }
+            char magic[2];
+            file.read(magic, 2);
+            if (gzip_reader::is_gzip(magic, magic + file.gcount())) {
+                file.close();
+                gz.reset(new gzip_reader(filename, num_threads));
+            } else {
+                file.clear();
+                file.seekg(0);
+            }
+        }
+
+        //! Read up to size bytes, starting with any text put back by unread().
+        size_t read(char *dest, size_t size) {
+            size_t bytes = std::min(size, pending.size());
+            memcpy(dest, pending.data(), bytes);
+            pending.erase(0, bytes);
+            if (gz) {
+                bytes += gz->read(dest + bytes, size - bytes);
+            } else {
+                file.read(dest + bytes, size - bytes);
+                bytes += (size_t)file.gcount();
+            }
+            at_end = bytes != size;
+            return bytes;
+        }
+
+        //! True if the last read reached the end of the file.
+        bool eof() const {
+            return at_end;
+        }
+
+        //! Put back text to be read again, such as a partial entry.
+        void unread(const char *p, size_t size) {
+            pending.insert(0, p, size);
+        }
+    private:
+        std::ifstream file;
+        std::unique_ptr<boost::genetics::gzip_reader> gz;
+        std::string pending;
+        bool at_end = false;
+    };
     size_t num_multiple = 0;
     size_t num_unmatched = 0;
     size_t num_reads = 0;
@@ -272,13 +417,14 @@ private:
 
     struct aligner_thread {
         std::vector<std::array<char, buffer_size> > buffers;
+        std::vector<size_t> sizes;
         std::vector<std::vector<const char*> > keyss;
         std::vector<std::vector<const char*> > namess;
 
-        std::vector<std::string> name_strs;
-        std::vector<std::string> key_strs;
-        std::vector<std::string> phred_strs;
-        std::vector< std::vector<boost::genetics::fasta_result> > resultss;
+        std::vector<std::vector<std::string> > name_strs;
+        std::vector<std::vector<std::string> > key_strs;
+        std::vector<std::vector<std::string> > phred_strs;
+        std::vector<std::vector<std::vector<boost::genetics::fasta_result> > > resultss;
 
         std::string out_buf;
 
@@ -286,6 +432,7 @@ private:
 
         aligner_thread(size_t num_files) {
             buffers.resize(num_files);
+            sizes.resize(num_files);
             keyss.resize(num_files);
             namess.resize(num_files);
             name_strs.resize(num_files);
@@ -294,15 +441,15 @@ private:
             resultss.resize(num_files);
         }
 
-        void read_components(std::vector<std::ifstream> &read_files) {
+        void read_components(std::vector<fastq_input> &read_files) {
             for (size_t i = 0; i != read_files.size(); ++i)  {
                 auto &buffer = buffers[i];
                 auto &stream = read_files[i];
                 auto &keys = keyss[i];
                 auto &names = namess[i];
-                stream.read(buffer.data(), buffer_size);
-                size_t bytes = (size_t)stream.gcount();
+                size_t bytes = stream.read(buffer.data(), buffer_size);
                 bool is_last_block = stream.eof();
+                sizes[i] = bytes;
                 const char *p = buffer.data();
                 const char *end = buffer.data() + bytes;
                 keys.resize(0);
@@ -328,15 +475,17 @@ private:
             }
         }
 
-        void align_read(size_t file_idx, size_t read_idx, boost::genetics::search_params &params, boost::genetics::mapped_fasta_file &ref) {
+        void align_reads(size_t file_idx, size_t num_reads, boost::genetics::search_params &params, size_t batch_size, boost::genetics::fasta_file_interface &ref) {
             using namespace boost::genetics;
 
-            auto &results = resultss[file_idx];
             auto &keys = keyss[file_idx];
             auto &names = namess[file_idx];
-            std::string &name_str = name_strs[file_idx];
-            std::string &key_str = key_strs[file_idx];
-            std::string &phred_str = phred_strs[file_idx];
+            auto &name_str = name_strs[file_idx];
+            auto &key_str = key_strs[file_idx];
+            auto &phred_str = phred_strs[file_idx];
+            name_str.resize(num_reads);
+            key_str.resize(num_reads);
+            phred_str.resize(num_reads);
 
             // FASTQ reads have the form:
             // @name          name of this read
@@ -344,34 +493,73 @@ private:
             // +
             // JJC#DDGGGH     log-scale quality (Phred).
 
-            const char *p = names[read_idx]+1, *q = p;
-            while (*p != ' ' && *p != '\n') ++p;
-            name_str.assign(q, p);
+            for (size_t read_idx = 0; read_idx != num_reads; ++read_idx) {
+                const char *p = names[read_idx]+1, *q = p;
+                while (*p != ' ' && *p != '\n') ++p;
+                name_str[read_idx].assign(q, p);
 
-            p = keys[read_idx], q = p;
-            while (*p != '\n') ++p;
-            key_str.assign(q, p);
+                p = keys[read_idx], q = p;
+                while (*p != '\n') ++p;
+                key_str[read_idx].assign(q, p);
 
-            ++p;
-            while (*p != '\n') ++p;
+                ++p;
+                while (*p != '\n') ++p;
 
-            ++p;
-            q = p;
-            while (*p != '\n') ++p;
-            phred_str.assign(q, p);
+                ++p;
+                q = p;
+                while (*p != '\n') ++p;
+                phred_str[read_idx].assign(q, p);
+            }
 
-            ref.find_inexact(results, key_str, params, stats);
+            ref.find_inexact_batch(resultss[file_idx], key_str, params, stats, batch_size);
         }
 
-        void write_sam(size_t file_idx, std::ofstream &sam_file, boost::genetics::mapped_fasta_file &ref) {
+        // Write the NM, XM, XO, XG and MD fields for an alignment with gaps.
+        template <class OutIter>
+        OutIter write_gapped_fields(OutIter dest, const boost::genetics::fasta_result &r, const std::string &key_str, boost::genetics::fasta_file_interface &ref) {
             using namespace boost::genetics;
 
-            auto &results = resultss[file_idx];
-            auto &keys = keyss[file_idx];
-            auto &names = namess[file_idx];
-            std::string &name_str = name_strs[file_idx];
-            std::string &key_str = key_strs[file_idx];
-            std::string &phred_str = phred_strs[file_idx];
+            // Count the gaps and the reference bases aligned.
+            size_t ref_length = 0, num_indels = 0, gap_opens = 0, run = 0;
+            for (char c : r.cigar) {
+                if (c >= '0' && c <= '9') {
+                    run = run * 10 + (c - '0');
+                    continue;
+                }
+                if (c != 'I') ref_length += run;
+                if (c != 'M') {
+                    num_indels += run;
+                    gap_opens++;
+                }
+                run = 0;
+            }
+
+            // The read was matched in the reference direction.
+            std::string read_str = key_str;
+            if (r.reverse_complement) {
+                make_rev_comp(read_str.begin(), key_str);
+            }
+            std::string ref_str = ref.substr(r.location, ref_length);
+
+            dest = make_str(dest, "\tXT:A:U\tNM:i:");
+            dest = make_int(dest, r.distance);
+            dest = make_str(dest, "\tX0:i:1\tX1:i:0\tXM:i:");
+            dest = make_int(dest, r.distance - std::min(r.distance, num_indels));
+            dest = make_str(dest, "\tXO:i:");
+            dest = make_int(dest, gap_opens);
+            dest = make_str(dest, "\tXG:i:");
+            dest = make_int(dest, num_indels);
+            dest = make_str(dest, "\tMD:Z:");
+            return make_gapped_MD_field(dest, ref_str, read_str, r.cigar);
+        }
+
+        void write_sam(size_t file_idx, size_t read_idx, std::ofstream &sam_file, boost::genetics::fasta_file_interface &ref) {
+            using namespace boost::genetics;
+
+            auto &results = resultss[file_idx][read_idx];
+            std::string &name_str = name_strs[file_idx][read_idx];
+            std::string &key_str = key_strs[file_idx][read_idx];
+            std::string &phred_str = phred_strs[file_idx][read_idx];
 
             // No alignment, write a null record.
             if (results.size() == 0) {
@@ -409,8 +597,13 @@ private:
                     dest = make_str(dest, "\t");
                     dest = make_int(dest, qual);
                     dest = make_str(dest, "\t");
-                    dest = make_int(dest, key_str.size());
-                    dest = make_str(dest, "M\t*\t0\t0\t");
+                    if (r.cigar.empty()) {
+                        dest = make_int(dest, key_str.size());
+                        dest = make_str(dest, "M\t*\t0\t0\t");
+                    } else {
+                        dest = make_str(dest, r.cigar.c_str());
+                        dest = make_str(dest, "\t*\t0\t0\t");
+                    }
                     if (r.reverse_complement) {
                         dest = make_rev_comp(dest, key_str);
                         dest = make_str(dest, "\t");
@@ -420,13 +613,17 @@ private:
                         dest = make_str(dest, "\t");
                         dest = make_str(dest, phred_str.c_str());
                     }
-                    dest = make_str(dest, "\tXT:A:U\tNM:i:");
-                    dest = make_int(dest, r.distance);
-                    dest = make_str(dest, "\tX0:i:1\tX1:i:0\tXM:i:");
-                    dest = make_int(dest, r.distance);
-                    dest = make_str(dest, "\tXO:i:0\tXG:i:0\tMD:Z:");
-                    std::string ref_str = ref.get_string().substr(r.location, key_str.length(), r.reverse_complement);
-                    dest = make_MD_field(dest, ref_str, key_str);
+                    if (r.cigar.empty()) {
+                        dest = make_str(dest, "\tXT:A:U\tNM:i:");
+                        dest = make_int(dest, r.distance);
+                        dest = make_str(dest, "\tX0:i:1\tX1:i:0\tXM:i:");
+                        dest = make_int(dest, r.distance);
+                        dest = make_str(dest, "\tXO:i:0\tXG:i:0\tMD:Z:");
+                        std::string ref_str = ref.substr(r.location, key_str.length(), r.reverse_complement);
+                        dest = make_MD_field(dest, ref_str, key_str);
+                    } else {
+                        dest = write_gapped_fields(dest, r, key_str, ref);
+                    }
                     dest = make_str(dest, "\n");
                     sam_file.write(out_buf.c_str(), dest - out_buf.begin());
                 }
@@ -0,0 +1,525 @@
+#include <fstream>
+#include <cstdint>
+#include <chrono>
+#include <random>
+
+#include <boost/genetics/fasta.hpp>
+#include <boost/genetics/fm_index.hpp>
+#include <boost/genetics/utils.hpp>
+
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/variables_map.hpp>
+#include <boost/program_options/parsers.hpp>
+
+//! Benchmarks for the genetics library.
+//! Each function compares alternative implementations on the same reference.
+class benchmark {
+public:
+    //! Implement the "benchmark build" mode.
+    void build(int argc, char **argv) {
+        using namespace boost::program_options;
+        using namespace boost::genetics;
+
+        options_description desc("benchmark build <file1.fa> <file2.fa> ... {-n 12 14 16} {-t 1}");
+        add_reference_options(desc);
+        desc.add_options()
+            ("num-index-chars,n", value<std::vector<int> >()->multitoken()->default_value(std::vector<int>{12, 14, 16}, "12 14 16"), "number of chars in first stage index")
+            ("num-threads,t", value<int>()->default_value(1), "number of threads to use.")
+        ;
+
+        variables_map vm;
+        if (!parse(desc, vm, argc, argv)) return;
+
+        fasta_file ref;
+        make_reference(ref, vm);
+
+        // Build the index with each strategy and report the time per base.
+        index_params params;
+        params.num_threads = (size_t)vm["num-threads"].as<int>();
+        std::cout << "n\tstrategy\tseconds\tns/base\n";
+        for (int n : vm["num-index-chars"].as<std::vector<int> >()) {
+            for (int strategy = direct_scatter; strategy <= radix_partition; ++strategy) {
+                params.strategy = (index_build_strategy)strategy;
+                auto start_time = std::chrono::system_clock::now();
+                ref.make_index((size_t)n, params);
+                auto end_time = std::chrono::system_clock::now();
+                double seconds = std::chrono::nanoseconds(end_time - start_time).count() * 1e-9;
+                std::cout << n << "\t" << (strategy == direct_scatter ? "direct" : "radix") << "\t";
+                std::cout << seconds << "\t" << seconds * 1e9 / ref.size() << "\n";
+            }
+        }
+    }
+
+    //! Implement the "benchmark search" mode.
+    void search(int argc, char **argv) {
+        using namespace boost::program_options;
+        using namespace boost::genetics;
+
+        options_description desc("benchmark search <file1.fa> <file2.fa> ... {-n 12} {-r 100000}");
+        add_search_options(desc);
+
+        variables_map vm;
+        if (!parse(desc, vm, argc, argv)) return;
+
+        // Compare the memory used by each address type with search speed.
+        std::cout << "addr\tindex MB\treads/s\tmatches/read\n";
+        search_index<fasta_file>("32-bit", vm);
+        search_index<compressed_fasta_file>("compressed", vm);
+        search_index<large_fasta_file>("64-bit", vm);
+    }
+
+    //! Implement the "benchmark prefetch" mode.
+    void prefetch(int argc, char **argv) {
+        using namespace boost::program_options;
+        using namespace boost::genetics;
+
+        options_description desc("benchmark prefetch <file1.fa> <file2.fa> ... {-n 12} {-r 100000}");
+        add_search_options(desc);
+
+        variables_map vm;
+        if (!parse(desc, vm, argc, argv)) return;
+
+        // Compare search speed with and without prefetching.
+        std::cout << "prefetch\tindex MB\treads/s\tmatches/read\n";
+        search_params params;
+        params.prefetch = false;
+        search_index<fasta_file>("off", vm, params);
+        params.prefetch = true;
+        search_index<fasta_file>("on", vm, params);
+    }
+
+    //! Implement the "benchmark merge" mode.
+    void merge(int argc, char **argv) {
+        using namespace boost::program_options;
+        using namespace boost::genetics;
+
+        options_description desc("benchmark merge <file1.fa> <file2.fa> ... {-n 12} {-r 100000}");
+        add_search_options(desc);
+
+        variables_map vm;
+        if (!parse(desc, vm, argc, argv)) return;
+
+        // Compare the ways of combining seed hits.
+        std::cout << "merge\tindex MB\treads/s\tmatches/read\n";
+        search_params params;
+        params.merge = heap_merge;
+        search_index<fasta_file>("heap", vm, params);
+        params.merge = sort_merge;
+        search_index<fasta_file>("sort", vm, params);
+    }
+
+    //! Implement the "benchmark repeats" mode.
+    void repeats(int argc, char **argv) {
+        using namespace boost::program_options;
+        using namespace boost::genetics;
+
+        options_description desc("benchmark repeats <file1.fa> <file2.fa> ... {-n 12} {-r 100000}");
+        add_search_options(desc);
+
+        variables_map vm;
+        if (!parse(desc, vm, argc, argv)) return;
+
+        // Show how many index buckets there are of each size.
+        size_t num_indexed_chars = (size_t)vm["num-index-chars"].as<int>();
+        {
+            fasta_file ref;
+            make_reference(ref, vm);
+            ref.make_index(num_indexed_chars);
+            std::vector<size_t> hist;
+            ref.get_index().occupancy_histogram(hist);
+            std::cout << "bucket size\tbuckets\n";
+            for (size_t i = 0; i != hist.size(); ++i) {
+                std::cout << (i == 0 ? 0 : (size_t)1 << (i-1)) << "+\t" << hist[i] << "\n";
+            }
+        }
+
+        // Trade search time for sensitivity in repeats.
+        std::cout << "cutoff/shifts\tindex MB\treads/s\tmatches/read\n";
+        search_params params;
+        for (size_t max_bucket_size : {100, 1000}) {
+            for (size_t max_seed_shifts : {(size_t)0, num_indexed_chars - 1}) {
+                params.max_bucket_size = max_bucket_size;
+                params.max_seed_shifts = max_seed_shifts;
+                std::string name = std::to_string(max_bucket_size) + "/" + std::to_string(max_seed_shifts);
+                search_index<fasta_file>(name.c_str(), vm, params);
+            }
+        }
+    }
+
+    //! Implement the "benchmark scan" mode.
+    void scan(int argc, char **argv) {
+        using namespace boost::program_options;
+        using namespace boost::genetics;
+
+        options_description desc("benchmark scan <file1.fa> <file2.fa> ... {-r 10} {-d 0 2}");
+        add_reference_options(desc);
+        desc.add_options()
+            ("num-reads,r", value<size_t>()->default_value(10), "number of reads to scan for")
+            ("read-length,l", value<size_t>()->default_value(100), "length of each read")
+            ("max-distance,d", value<std::vector<size_t> >()->multitoken()->default_value(std::vector<size_t>{0, 2}, "0 2"), "errors allowed in each scan")
+        ;
+
+        variables_map vm;
+        if (!parse(desc, vm, argc, argv)) return;
+
+        fasta_file ref;
+        make_reference(ref, vm);
+
+        // Random reads are unlikely to be found, so each scan reads the whole reference.
+        size_t read_length = vm["read-length"].as<size_t>();
+        std::mt19937_64 rng(0x9bac7615);
+        std::vector<std::string> reads(vm["num-reads"].as<size_t>());
+        for (auto &read : reads) {
+            for (size_t i = 0; i != read_length; ++i) {
+                read.push_back("ACGT"[rng() % 4]);
+            }
+        }
+
+        // Compare brute force scans with each instruction set and with one scan for all the reads.
+        const char *names[] = { "scalar", "avx2", "avx512" };
+        std::cout << "distance\tsimd\tGB/s\tGbases/s\n";
+        const auto &str = ref.get_string();
+        for (size_t max_distance : vm["max-distance"].as<std::vector<size_t> >()) {
+            for (int simd = simd_none; simd <= std::min(simd_best, cpu_simd_level()); ++simd) {
+                size_t num_found = 0;
+                auto start_time = std::chrono::system_clock::now();
+                for (auto &read : reads) {
+                    num_found += str.find_inexact(read, 0, ~(size_t)0, max_distance, (simd_level)simd) != dna_string::npos;
+                }
+                auto end_time = std::chrono::system_clock::now();
+                double seconds = std::chrono::nanoseconds(end_time - start_time).count() * 1e-9;
+                double bases = (double)str.size() * reads.size();
+                std::cout << max_distance << "\t" << names[simd] << "\t" << bases / 4 / seconds * 1e-9 << "\t" << bases / seconds * 1e-9 << "\n";
+            }
+
+            // Scan for all the reads in one pass.
+            std::vector<std::vector<size_t> > hits;
+            auto start_time = std::chrono::system_clock::now();
+            str.find_inexact_multi(hits, reads, max_distance);
+            auto end_time = std::chrono::system_clock::now();
+            double seconds = std::chrono::nanoseconds(end_time - start_time).count() * 1e-9;
+            double bases = (double)str.size() * reads.size();
+            std::cout << max_distance << "\tmulti\t" << bases / 4 / seconds * 1e-9 << "\t" << bases / seconds * 1e-9 << "\n";
+        }
+    }
+
+    //! Implement the "benchmark threads" mode.
+    void threads(int argc, char **argv) {
+        using namespace boost::program_options;
+        using namespace boost::genetics;
+
+        options_description desc("benchmark threads <file1.fa> <file2.fa> ... {-t 1 2 4 8 16 32 64} {-r 10} {-d 2}");
+        add_reference_options(desc);
+        desc.add_options()
+            ("num-threads,t", value<std::vector<size_t> >()->multitoken()->default_value(std::vector<size_t>{1, 2, 4, 8, 16, 32, 64}, "1 2 4 8 16 32 64"), "numbers of threads to scan with")
+            ("num-reads,r", value<size_t>()->default_value(10), "number of reads to scan for")
+            ("read-length,l", value<size_t>()->default_value(100), "length of each read")
+            ("max-distance,d", value<size_t>()->default_value(2), "errors allowed in each scan")
+        ;
+
+        variables_map vm;
+        if (!parse(desc, vm, argc, argv)) return;
+
+        fasta_file ref;
+        make_reference(ref, vm);
+
+        // Take reads from the reference so that every scan has matches to merge.
+        size_t read_length = vm["read-length"].as<size_t>();
+        size_t max_distance = vm["max-distance"].as<size_t>();
+        const auto &str = ref.get_string();
+        if (str.size() < read_length) {
+            throw std::runtime_error("reference is shorter than the reads");
+        }
+        std::mt19937_64 rng(0x9bac7615);
+        std::vector<std::string> reads(vm["num-reads"].as<size_t>());
+        for (auto &read : reads) {
+            read = std::string(str.substr(rng() % (str.size() - read_length + 1), read_length));
+        }
+
+        // Scan for all matches of each read, reporting the speedup over one thread.
+        std::cout << "threads\tseconds\tGbases/s\tspeedup\tmatches\n";
+        double base_seconds = 0;
+        for (size_t num_threads : vm["num-threads"].as<std::vector<size_t> >()) {
+            size_t num_matches = 0;
+            std::vector<size_t> hits;
+            auto start_time = std::chrono::system_clock::now();
+            for (auto &read : reads) {
+                str.find_inexact_all(hits, read, max_distance, num_threads);
+                num_matches += hits.size();
+            }
+            auto end_time = std::chrono::system_clock::now();
+            double seconds = std::chrono::nanoseconds(end_time - start_time).count() * 1e-9;
+            if (base_seconds == 0) base_seconds = seconds;
+            double bases = (double)str.size() * reads.size();
+            std::cout << num_threads << "\t" << seconds << "\t" << bases / seconds * 1e-9 << "\t";
+            std::cout << base_seconds / seconds << "\t" << num_matches << "\n";
+        }
+    }
+
+    //! Implement the "benchmark fm" mode.
+    void fm(int argc, char **argv) {
+        using namespace boost::program_options;
+        using namespace boost::genetics;
+
+        options_description desc("benchmark fm <file1.fa> <file2.fa> ... {-n 12} {-r 100000} {-e 2} {-k 4 32 128}");
+        add_reference_options(desc);
+        desc.add_options()
+            ("num-index-chars,n", value<int>()->default_value(12), "number of chars in first stage index")
+            ("num-reads,r", value<size_t>()->default_value(100000), "number of reads to search for")
+            ("read-length,l", value<size_t>()->default_value(100), "length of each read")
+            ("num-errors,e", value<size_t>()->default_value(2), "number of substitutions in each read (and errors allowed)")
+            ("sa-sample-rate,k", value<std::vector<size_t> >()->multitoken()->default_value(std::vector<size_t>{4, 32, 128}, "4 32 128"), "FM index suffix array sample rates")
+        ;
+
+        variables_map vm;
+        if (!parse(desc, vm, argc, argv)) return;
+
+        fasta_file ref;
+        make_reference(ref, vm);
+
+        // Reads from the reference with some substitutions.
+        size_t read_length = vm["read-length"].as<size_t>();
+        size_t num_errors = vm["num-errors"].as<size_t>();
+        std::mt19937_64 rng(0x9bac7615);
+        std::vector<std::string> reads(vm["num-reads"].as<size_t>());
+        for (auto &read : reads) {
+            read = std::string(ref.get_string().substr(rng() % (ref.size() - read_length), read_length));
+            for (size_t i = 0; i != num_errors; ++i) {
+                read[rng() % read_length] = "ACGT"[rng() % 4];
+            }
+        }
+
+        std::cout << "index\tbuild s\tindex MB\treads/s\tmatches/read\n";
+
+        // Two stage index: the index size is the image size less the reference.
+        {
+            auto start_time = std::chrono::system_clock::now();
+            ref.make_index((size_t)vm["num-index-chars"].as<int>());
+            auto end_time = std::chrono::system_clock::now();
+            double build_seconds = std::chrono::nanoseconds(end_time - start_time).count() * 1e-9;
+
+            writer image_sizer(nullptr, nullptr);
+            ref.write_binary(image_sizer);
+            writer str_sizer(nullptr, nullptr);
+            ref.get_string().write_binary(str_sizer);
+            double index_mb = (image_sizer.get_size() - str_sizer.get_size()) * (1.0 / 0x100000);
+
+            search_params params;
+            params.max_distance = num_errors;
+            params.max_results = 1000;
+            params.never_brute_force = true;
+            search_stats stats;
+            std::vector<fasta_result> results;
+            size_t num_matches = 0;
+            start_time = std::chrono::system_clock::now();
+            for (auto &read : reads) {
+                ref.find_inexact(results, read, params, stats);
+                num_matches += results.size();
+            }
+            end_time = std::chrono::system_clock::now();
+            double seconds = std::chrono::nanoseconds(end_time - start_time).count() * 1e-9;
+            std::cout << "tsi\t" << build_seconds << "\t" << index_mb << "\t" << reads.size() / seconds << "\t";
+            std::cout << (double)num_matches / reads.size() << "\n";
+        }
+
+        // FM index: the BWT, the occurrence table and the sampled suffix array.
+        // Searches locate their seeds, so the sample rate trades memory for speed.
+        dna_string str = ref.get_string();
+        for (size_t sa_sample_rate : vm["sa-sample-rate"].as<std::vector<size_t> >()) {
+            auto start_time = std::chrono::system_clock::now();
+            fm_index fm(str, sa_sample_rate);
+            auto end_time = std::chrono::system_clock::now();
+            double build_seconds = std::chrono::nanoseconds(end_time - start_time).count() * 1e-9;
+
+            writer sizer(nullptr, nullptr);
+            fm.write_binary(sizer);
+            double index_mb = sizer.get_size() * (1.0 / 0x100000);
+
+            size_t num_matches = 0;
+            std::vector<size_t> positions;
+            start_time = std::chrono::system_clock::now();
+            for (auto &read : reads) {
+                fm.find_inexact(positions, read, num_errors, 1000);
+                num_matches += positions.size();
+            }
+            end_time = std::chrono::system_clock::now();
+            double seconds = std::chrono::nanoseconds(end_time - start_time).count() * 1e-9;
+            std::cout << "fm/" << sa_sample_rate << "\t" << build_seconds << "\t" << index_mb << "\t" << reads.size() / seconds << "\t";
+            std::cout << (double)num_matches / reads.size() << "\n";
+        }
+    }
+
+private:
+    // Build a reference with one index type and time searches for random reads.
+    template <class FastaFile>
+    void search_index(const char *name, boost::program_options::variables_map &vm, boost::genetics::search_params params = boost::genetics::search_params()) {
+        using namespace boost::genetics;
+
+        FastaFile ref;
+        make_reference(ref, vm);
+        ref.make_index((size_t)vm["num-index-chars"].as<int>());
+
+        // The index size is the image size less the reference.
+        writer image_sizer(nullptr, nullptr);
+        ref.write_binary(image_sizer);
+        writer str_sizer(nullptr, nullptr);
+        ref.get_string().write_binary(str_sizer);
+        double index_mb = (image_sizer.get_size() - str_sizer.get_size()) * (1.0 / 0x100000);
+
+        // Make the same reads for each index, with some substitutions.
+        size_t read_length = vm["read-length"].as<size_t>();
+        std::mt19937_64 rng(0x9bac7615);
+        std::vector<std::string> reads(vm["num-reads"].as<size_t>());
+        for (auto &read : reads) {
+            read = ref.get_string().substr(rng() % (ref.size() - read_length), read_length);
+            for (size_t i = 0; i != vm["num-errors"].as<size_t>(); ++i) {
+                read[rng() % read_length] = "ACGT"[rng() % 4];
+            }
+        }
+
+        // Search as the aligner does.
+        params.max_distance = 5;
+        params.max_results = 100;
+        params.never_brute_force = true;
+        search_stats stats;
+        size_t batch_size = vm["batch-size"].as<size_t>();
+        size_t num_matches = 0;
+        auto start_time = std::chrono::system_clock::now();
+        if (batch_size == 0) {
+            std::vector<fasta_result> results;
+            for (auto &read : reads) {
+                ref.find_inexact(results, read, params, stats);
+                num_matches += results.size();
+            }
+        } else {
+            std::vector<std::vector<fasta_result> > results;
+            ref.find_inexact_batch(results, reads, params, stats, batch_size);
+            for (auto &r : results) {
+                num_matches += r.size();
+            }
+        }
+        auto end_time = std::chrono::system_clock::now();
+        double seconds = std::chrono::nanoseconds(end_time - start_time).count() * 1e-9;
+        std::cout << name << "\t" << index_mb << "\t" << reads.size() / seconds << "\t";
+        std::cout << (double)num_matches / reads.size() << "\n";
+    }
+
+    // Options for loading or generating a reference.
+    void add_reference_options(boost::program_options::options_description &desc) {
+        using namespace boost::program_options;
+        desc.add_options()
+            ("help", "produce help message")
+            ("fasta-files", value<std::vector<std::string> >(), "input filename(s)")
+            ("size,s", value<size_t>()->default_value(100000000), "size of random reference if there are no fasta files")
+        ;
+    }
+
+    // Options for searching for random reads.
+    void add_search_options(boost::program_options::options_description &desc) {
+        using namespace boost::program_options;
+        add_reference_options(desc);
+        desc.add_options()
+            ("num-index-chars,n", value<int>()->default_value(12), "number of chars in first stage index")
+            ("num-reads,r", value<size_t>()->default_value(100000), "number of reads to search for")
+            ("read-length,l", value<size_t>()->default_value(100), "length of each read")
+            ("num-errors,e", value<size_t>()->default_value(2), "number of substitutions in each read")
+            ("batch-size,b", value<size_t>()->default_value(0), "search for reads in batches (0 searches one at a time)")
+        ;
+    }
+
+    // Parse the command line, returning false if we only need help.
+    bool parse(boost::program_options::options_description &desc, boost::program_options::variables_map &vm, int argc, char **argv) {
+        using namespace boost::program_options;
+        positional_options_description pod;
+        pod.add("fasta-files", -1);
+
+        command_line_parser clp(argc, argv);
+        store(
+            clp.options(desc).positional(pod).run(),
+            vm
+        );
+        notify(vm);
+
+        if (vm.count("help")) {
+            std::cout << desc << "\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Load the fasta files or make a random reference.
+    template <class FastaFile>
+    void make_reference(FastaFile &ref, boost::program_options::variables_map &vm) {
+        if (vm.count("fasta-files")) {
+            for (auto &f : vm["fasta-files"].as<std::vector<std::string> >()) {
+                std::cerr << f << "\n";
+                ref.append(f);
+            }
+        } else {
+            ref.append_random("random", vm["size"].as<size_t>(), 0x9bac7615);
+        }
+
+        if (ref.size() == 0) {
+            throw std::runtime_error("no fa files or empty reference");
+        }
+        std::cerr << ref.size() << " bases\n";
+    }
+};
+
+
+int main(int argc, char **argv) {
+    benchmark bm;
+
+    try {
+        if (argc >= 2) {
+            if (!strcmp(argv[1], "build")) {
+                bm.build(argc-1, argv+1);
+                return 0;
+            } else if (!strcmp(argv[1], "search")) {
+                bm.search(argc-1, argv+1);
+                return 0;
+            } else if (!strcmp(argv[1], "prefetch")) {
+                bm.prefetch(argc-1, argv+1);
+                return 0;
+            } else if (!strcmp(argv[1], "merge")) {
+                bm.merge(argc-1, argv+1);
+                return 0;
+            } else if (!strcmp(argv[1], "repeats")) {
+                bm.repeats(argc-1, argv+1);
+                return 0;
+            } else if (!strcmp(argv[1], "scan")) {
+                bm.scan(argc-1, argv+1);
+                return 0;
+            } else if (!strcmp(argv[1], "threads")) {
+                bm.threads(argc-1, argv+1);
+                return 0;
+            } else if (!strcmp(argv[1], "fm")) {
+                bm.fm(argc-1, argv+1);
+                return 0;
+            } else {
+                std::cerr << "unknown function " << argv[1] << "\n";
+                return 1;
+            }
+        } else {
+            std::cerr << "Usage:\n";
+            std::cerr << "  benchmark build <file1.fa> ... {-n 12 14 16}         (Index build strategies)\n";
+            std::cerr << "  benchmark search <file1.fa> ... {-n 12}              (Index address types)\n";
+            std::cerr << "  benchmark prefetch <file1.fa> ... {-n 12}            (Search with and without prefetch)\n";
+            std::cerr << "  benchmark merge <file1.fa> ... {-n 12}               (Heap and sort merges of seed hits)\n";
+            std::cerr << "  benchmark repeats <file1.fa> ... {-n 12}             (Repetitive seed cutoffs and shifts)\n";
+            std::cerr << "  benchmark scan <file1.fa> ... {-d 0 2}               (Brute force scans, one or many reads at a time)\n";
+            std::cerr << "  benchmark threads <file1.fa> ... {-t 1 2 4}          (Brute force scans for all matches on several threads)\n";
+            std::cerr << "  benchmark fm <file1.fa> ... {-n 12}                  (FM index and two stage index searches)\n";
+            std::cerr << "  benchmark <build|...|threads> --help               (Get help for each function)\n";
+            return 1;
+        }
+    } catch (boost::program_options::error &e) {
+        std::cerr << "error: " << e.what() << "\n";
+        return 1;
+    } catch(std::exception &e) {
+        std::cerr << "error: " << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
@@ -87,9 +87,7 @@ namespace boost { namespace genetics {
         operator std::string() const {
             std::string res;
             res.resize(parent::size());
-            for (size_t i = 0; i != parent::size(); ++i) {
-                res[i] = (*this)[i];
-            }
+            extract(&res[0], 0, parent::size());
             return res;
         }
 
@@ -98,17 +96,68 @@ namespace boost { namespace genetics {
         ) const {
             length = std::min(length, parent::size() - offset);
             std::string result(length, ' ');
-            if (!rev_comp) {
-                for (size_t i = 0; i != length; ++i) {
-                    result[i] = (*this)[offset+i];
+            extract(&result[0], offset, length, rev_comp);
+            return result;
+        }
+
+        //! Copy the chars [offset, offset + length) to dest, or their reverse complement.
+        //! The bases are decoded a word at a time and then the runs of 'N' and
+        //! other letters are written over them in one pass over the RLE entries.
+        void extract(char *dest, size_t offset, size_t length, bool rev_comp=false) const {
+            typedef typename parent::word_type word_type;
+            const size_t bpv = parent::bases_per_value;
+            for (size_t i = 0; i < length; i += bpv) {
+                size_t n = std::min(bpv, length - i);
+                if (!rev_comp) {
+                    word_type w = parent::window(offset + i);
+                    for (size_t j = 0; j != n; ++j) {
+                        dest[i + j] = "ACGT"[(w >> (bpv * 2 - 2 - j * 2)) & 3];
+                    }
+                } else {
+                    word_type w = ~parent::window(offset + length - i - n);
+                    for (size_t j = 0; j != n; ++j) {
+                        dest[i + n - 1 - j] = "ACGT"[(w >> (bpv * 2 - 2 - j * 2)) & 3];
+                    }
                 }
-            } else {
-                for (size_t i = 0; i != length; ++i) {
-                    char chr = (*this)[offset + length - 1 - i];
-                    result[i] = is_base(chr) ? code_to_base(3-base_to_code(chr)) : chr;
+            }
+
+            size_t end = offset + length;
+            for (size_t block = offset / bases_per_index; block < index.size() && block * bases_per_index < end; ++block) {
+                size_t i0 = (size_t)index[block];
+                size_t i1 = block + 1 >= index.size() ? rle.size() : (size_t)index[block + 1];
+
+                // Most blocks are a single run of bases, which we leave alone.
+                if (i1 - i0 == 1 && (rle[i0] & 0xff) == 0) {
+                    continue;
+                }
+
+                // Skip the runs ending before the offset.
+                size_t block_start = block * bases_per_index;
+                const rle_type *b = rle.data() + i0;
+                const rle_type *e = rle.data() + i1;
+                const rle_type *p = b;
+                if (offset > block_start) {
+                    rle_type search = (rle_type)((offset - block_start) << 8) | 0xff;
+                    p = std::lower_bound(b, e, search);
+                    if (p != b) --p;
+                }
+
+                for (; p != e; ++p) {
+                    size_t run_start = block_start + (*p >> 8);
+                    if (run_start >= end) break;
+                    size_t run_end = p + 1 != e ? block_start + (p[1] >> 8) : block_start + bases_per_index;
+                    char chr = (char)(*p & 0xff);
+                    if (chr) {
+                        size_t from = std::max(run_start, offset);
+                        size_t to = std::min(run_end, end);
+                        if (from < to && !rev_comp) {
+                            std::fill(dest + (from - offset), dest + (to - offset), chr);
+                        } else if (from < to) {
+                            std::fill(dest + (end - to), dest + (end - from), chr);
+                        }
+                    }
                 }
             }
-            return result;
         }
 
         template<class InIter>
@@ -118,6 +167,53 @@ namespace boost { namespace genetics {
             internal_append(num_bases, b, e);
         }
 
+        //! Append ascii characters from memory, such as a mapped FASTA file.
+        //! The bases and the runs of other letters are found in one pass.
+        void append(const char *b, const char *e, bool randomise=true) {
+            piece_state state = begin_pieces();
+            parent::append_ascii(b, e, randomise, [&](size_t pos, size_t n, int val) {
+                append_run(pos, n, val, state.prev_val);
+            }, state.random_acc);
+        }
+
+        //! The state carried between the pieces of a sequence appended with append_piece().
+        struct piece_state {
+            std::int32_t random_acc;
+            int prev_val;
+        };
+
+        //! Start a sequence to be appended in pieces with append_piece().
+        piece_state begin_pieces() {
+            piece_state state = { parent::random_seed, rle.empty() ? 0 : (int)rle.back() };
+            return state;
+        }
+
+        //! Append a piece of ascii text, such as a chunk of a decompressed FASTA file.
+        //! The pieces give the same result as one append() of all their text.
+        void append_piece(const char *b, const char *e, piece_state &state) {
+            parent::append_ascii(b, e, true, [&](size_t pos, size_t n, int val) {
+                append_run(pos, n, val, state.prev_val);
+            }, state.random_acc);
+        }
+
+        //! Append a piece packed in rhs on another thread. rhs must be started with
+        //! its random_acc advanced by skip_random() past the letters of the pieces before it.
+        //! Only state.prev_val is updated.
+        void append_piece(const basic_augmented_string &rhs, piece_state &state) {
+            size_t offset = parent::size();
+            parent::append(rhs);
+            append_runs(offset, rhs, state.prev_val);
+        }
+
+        //! Append another augmented string, such as a chromosome packed on another thread.
+        //! The result is the same as appending the text of both.
+        void append(const basic_augmented_string &rhs) {
+            size_t offset = parent::size();
+            parent::append(rhs);
+            int prev_val = rle.empty() ? 0 : rle.back();
+            append_runs(offset, rhs, prev_val);
+        }
+
         void swap(basic_augmented_string &rhs) {
             parent::swap(rhs);
             index.swap(rhs.index);
@@ -130,6 +226,22 @@ namespace boost { namespace genetics {
             wr.write(rle);
         }
     private:
+        // Replay the runs of rhs at their new positions from offset.
+        void append_runs(size_t offset, const basic_augmented_string &rhs, int &prev_val) {
+            for (size_t block = 0; block != rhs.index.size(); ++block) {
+                size_t i0 = (size_t)rhs.index[block];
+                size_t i1 = block + 1 >= rhs.index.size() ? rhs.rle.size() : (size_t)rhs.index[block + 1];
+                size_t block_start = block * bases_per_index;
+                size_t block_end = std::min(rhs.size(), block_start + bases_per_index);
+                for (size_t i = i0; i != i1; ++i) {
+                    size_t run_start = block_start + (rhs.rle[i] >> 8);
+                    size_t run_end = i + 1 != i1 ? block_start + (rhs.rle[i + 1] >> 8) : block_end;
+                    int val = (int)(rhs.rle[i] & 0xff);
+                    append_run(offset + run_start, run_end - run_start, val, prev_val);
+                }
+            }
+        }
+
         template<class InIter>
         void internal_append(size_t num_bases, InIter b, InIter e) {
             int prev_val = rle.empty() ? 0 : rle.back();
@@ -137,18 +249,27 @@ namespace boost { namespace genetics {
                 int chr = (int)*b++;
                 if (!is_whitespace(chr)) {
                     int val = (is_base(chr)) ? 0 : chr;
-                    if (num_bases % bases_per_index == 0 || val != prev_val) {
-                        if (num_bases % bases_per_index == 0) {
-                            index.push_back((index_type)rle.size());
-                        }
-                        rle.push_back((rle_type)((num_bases % bases_per_index) * 256 + val));
-                        prev_val = val;
-                    }
+                    append_run(num_bases, 1, val, prev_val);
                     num_bases++;
                 }
             }
         }
 
+        // Add the RLE entries for n chars of val starting at base pos.
+        // There is an entry at the start of each index block and where the value changes.
+        void append_run(size_t pos, size_t n, int val, int &prev_val) {
+            for (size_t end = pos + n; pos != end; ) {
+                if (pos % bases_per_index == 0 || val != prev_val) {
+                    if (pos % bases_per_index == 0) {
+                        index.push_back((index_type)rle.size());
+                    }
+                    rle.push_back((rle_type)((pos % bases_per_index) * 256 + val));
+                    prev_val = val;
+                }
+                pos = std::min(end, (pos / bases_per_index + 1) * bases_per_index);
+            }
+        }
+
         // Note: order matters
         typename Traits::IndexArrayType index;
         typename Traits::RleArrayType rle;
@@ -158,10 +279,19 @@ namespace boost { namespace genetics {
 
     typedef basic_augmented_string<mapped_traits> mapped_augmented_string;
 
+    typedef basic_augmented_string<large_unmapped_traits> large_augmented_string;
+
+    typedef basic_augmented_string<large_mapped_traits> large_mapped_augmented_string;
+
     template <>
     inline int get_code<augmented_string>(const augmented_string &str, size_t index) {
         return str.get_code(index);
     }
+
+    template <>
+    inline uint64_t get_index<augmented_string>(const augmented_string &str, size_t pos, size_t num_index_chars) {
+        return str.get_index(pos, num_index_chars);
+    }
 } }
 
 
@@ -36,14 +36,64 @@ namespace boost { namespace genetics {
         typedef typename Traits::SuffixArrayType addr_array_type;
         typedef typename Traits::SuffixArrayType::value_type addr_type;
 
-        struct bwt_sort_type { addr_type group, next_group, addr; };
-        struct ibwt_sort_type { addr_type addr, chr; };
 
         static_assert(
             sizeof(word_type) >= sizeof(addr_type),
             "suffix array address type must be smaller than the string word type"
         );
 
+        //! \brief Iterate over the k-mers of a string, reading it a word at a time.
+
+        //! *i is the k-mer of num_chars bases starting at the current position,
+        //! right-justified as in get_index(). Bases beyond the end read as 'A'.
+        //! Each step shifts one base from the current word into the k-mer,
+        //! so the string is only indexed once every bases_per_value steps.
+        class kmer_iterator {
+        public:
+            kmer_iterator(const basic_dna_string &str, size_t pos, size_t num_chars) :
+                data(str.values.data()),
+                num_values(str.values.size()),
+                mask(~(word_type)0 >> (bases_per_value - num_chars) * 2),
+                pos(pos)
+            {
+                size_t next = pos + num_chars;
+                acc = str.get_index(pos, num_chars);
+                offset = next / bases_per_value;
+                left = bases_per_value - next % bases_per_value;
+                cur = offset < num_values ? data[offset] << (next % bases_per_value) * 2 : 0;
+            }
+
+            word_type operator*() const {
+                return acc;
+            }
+
+            kmer_iterator &operator++() {
+                acc = ((acc << 2) | (cur >> (bases_per_value * 2 - 2))) & mask;
+                cur <<= 2;
+                if (--left == 0) {
+                    ++offset;
+                    cur = offset < num_values ? data[offset] : 0;
+                    left = bases_per_value;
+                }
+                ++pos;
+                return *this;
+            }
+
+            //! \brief Position of the first base of the current k-mer.
+            size_t position() const {
+                return pos;
+            }
+        private:
+            const word_type *data;
+            size_t num_values;
+            word_type mask;
+            word_type acc;
+            word_type cur;
+            size_t offset;
+            size_t left;
+            size_t pos;
+        };
+
     public:
         //! \brief Default constructor.
         basic_dna_string() {
@@ -165,6 +215,61 @@ namespace boost { namespace genetics {
             append(str, e, randomise);
         }
 
+        //! \brief Append another dna_string, shifting its words into place.
+        void append(const basic_dna_string &rhs) {
+            size_t used = num_bases % bases_per_value;
+            size_t new_size = num_bases + rhs.num_bases;
+            size_t num_values = (new_size + bases_per_value - 1) / bases_per_value;
+            if (used == 0) {
+                size_t dest = num_bases / bases_per_value;
+                values.resize(num_values);
+                for (size_t i = 0; i != num_values - dest; ++i) {
+                    values[dest + i] = rhs.values[i];
+                }
+            } else {
+                // The words of rhs straddle ours.
+                size_t sh = used * 2;
+                size_t dest = num_bases / bases_per_value;
+                values.resize(std::max(num_values, dest + 1 + rhs.values.size()));
+                for (size_t i = 0; i != rhs.values.size(); ++i) {
+                    values[dest + i] |= rhs.values[i] >> sh;
+                    values[dest + i + 1] = rhs.values[i] << (bases_per_value * 2 - sh);
+                }
+                values.resize(num_values);
+            }
+            num_bases = new_size;
+        }
+
+        //! \brief Append ascii characters (A, C, G, T) from memory, such as a mapped FASTA file.
+        //! This gives the same result as the iterator version but packs
+        //! lines of bases sixteen at a time.
+        void append(const char *b, const char *e, bool randomise) {
+            std::int32_t random_acc = random_seed;
+            append_ascii(b, e, randomise, [](size_t, size_t, int) {}, random_acc);
+        }
+
+        //! The state of the random codes given to N and other letters
+        //! at the start of each append.
+        static const std::int32_t random_seed = (std::int32_t)0xd3ac6435;
+
+        //! The state of the random codes after n more letters that are not bases.
+        static std::int32_t skip_random(std::int32_t random_acc, size_t n) {
+            const std::int32_t random_xor = 0xa9831bc5;
+            for (size_t i = 0; i != n; ++i) {
+                random_acc = ((random_acc >> 31) & random_xor ) ^ (random_acc << 1);
+            }
+            return random_acc;
+        }
+
+        //! The number of letters in [b, e) that are neither bases nor whitespace.
+        static size_t count_non_bases(const char *b, const char *e) {
+            size_t n = 0;
+            for (; b != e; ++b) {
+                n += !is_base((unsigned char)*b) && !is_whitespace(*b);
+            }
+            return n;
+        }
+
         //! \brief Append ascii characters (A, C, G, T) to the string.
         //! Whitespace will be ignored and other characters (eg. N) may be mapped to a random value.
         template<class InIter>
@@ -257,11 +362,13 @@ namespace boost { namespace genetics {
         //! \param start_pos Zero-based offset to start the search.
         //! \param max_bases maxiumum number of bases to search.
         //! \param max_distance number of allowable errors in the search.
+        //! \param simd vector instructions to scan with, if the CPU has them.
         size_t find_inexact(
             const std::string &search_str,
             size_t start_pos = 0,
             size_t max_bases = ~(size_t)0,
-            size_t max_distance = 0
+            size_t max_distance = 0,
+            simd_level simd = simd_best
         ) const {
             basic_dna_string<unmapped_traits> dna_str(search_str);
             size_t pos = start_pos;
@@ -304,6 +411,10 @@ namespace boost { namespace genetics {
                 word_type rep2 = ~(((s0 >> (bpv*2-6)) & 3) * r1c);
                 word_type rep3 = ~(((s0 >> (bpv*2-8)) & 3) * r1c);
                 for (size_t i = pos/bpv; i < nv; ++i) {
+                    // Skip words without the first four characters, several at a time.
+                    i = scan_prefix4(simd, values.data(), i, nv, rep0, rep1, rep2, rep3);
+                    if (i == nv) break;
+
                     // do this every bpv characters (usually 32)
                     word_type v0 = values[i];
                     word_type v1 = values[i+1];
@@ -353,9 +464,9 @@ namespace boost { namespace genetics {
                 pos = nv * bpv;
             } else {
                 if (cpu_has_popcnt) {
-                    pos = inexact_search<unmapped_traits, true>(dna_str, pos, nv, s0, s0mask, max_distance, ssz, last);
+                    pos = inexact_search<unmapped_traits, true>(dna_str, pos, nv, s0, s0mask, max_distance, ssz, last, simd);
                 } else {
-                    pos = inexact_search<unmapped_traits, false>(dna_str, pos, nv, s0, s0mask, max_distance, ssz, last);
+                    pos = inexact_search<unmapped_traits, false>(dna_str, pos, nv, s0, s0mask, max_distance, ssz, last, simd);
                 }
                 if (pos != basic_dna_string::npos) {
                     return pos;
@@ -376,6 +487,175 @@ namespace boost { namespace genetics {
         }
 
 
+        //! \brief Brute force search for every match of a string, on several threads.
+        //! The range is split into chunks of whole cache lines which overlap by the
+        //! length of the search string minus one, so matches across chunk boundaries
+        //! are found exactly once. Threads take chunks in turn and the sorted
+        //! positions from each chunk are joined in order.
+        //! \param results set to the sorted positions of the matches.
+        //! \param search_str DNA string to search.
+        //! \param max_distance number of allowable errors in the search.
+        //! \param num_threads number of threads to scan with, at least one.
+        //! \param start_pos Zero-based offset to start the search.
+        //! \param max_bases maxiumum number of bases to search.
+        //! \param simd vector instructions to scan with, if the CPU has them.
+        void find_inexact_all(
+            std::vector<size_t> &results,
+            const std::string &search_str,
+            size_t max_distance = 0,
+            size_t num_threads = 1,
+            size_t start_pos = 0,
+            size_t max_bases = ~(size_t)0,
+            simd_level simd = simd_best
+        ) const {
+            results.clear();
+            num_threads = std::max((size_t)1, num_threads);
+            size_t ssz = search_str.size();
+            size_t last = std::min(size(), start_pos + std::min(max_bases, size()));
+            if (ssz == 0 || start_pos + ssz > last) {
+                return;
+            }
+
+            // Chunk boundaries are multiples of 64 bytes of values so that
+            // no two threads start in the same cache line.
+            const size_t line_bases = 64 / sizeof(word_type) * bases_per_value;
+            size_t first_line = start_pos / line_bases;
+            size_t num_lines = (last - ssz) / line_bases + 1 - first_line;
+            size_t lines_per_chunk = std::max((size_t)256, (ssz * 4 + line_bases - 1) / line_bases);
+            lines_per_chunk = std::max(lines_per_chunk, num_lines / (num_threads * 16));
+            size_t num_chunks = (num_lines + lines_per_chunk - 1) / lines_per_chunk;
+
+            std::vector<std::vector<size_t> > chunk_results(num_chunks);
+            std::atomic<size_t> next_chunk(0);
+            run_threads(std::min(num_threads, num_chunks), [&](size_t) {
+                for (size_t chunk; (chunk = next_chunk++) < num_chunks; ) {
+                    // Matches start in [begin, end) and the scan reads ssz-1 bases beyond.
+                    size_t begin = std::max(start_pos, (first_line + chunk * lines_per_chunk) * line_bases);
+                    size_t end = std::min(last - ssz + 1, (first_line + (chunk + 1) * lines_per_chunk) * line_bases);
+                    size_t scan_end = end + ssz - 1;
+                    auto &r = chunk_results[chunk];
+                    for (size_t pos = begin; pos < end; ++pos) {
+                        pos = find_inexact(search_str, pos, scan_end - pos, max_distance, simd);
+                        if (pos == npos) break;
+                        r.push_back(pos);
+                    }
+                }
+            });
+
+            for (auto &r : chunk_results) {
+                results.insert(results.end(), r.begin(), r.end());
+            }
+        }
+
+        //! \brief Brute force search for many strings in one pass over this string.
+        //! Each search string is split into max_distance+1 pieces, one of which must
+        //! match exactly. The first bases of each piece are looked up in a table as
+        //! the string is scanned and possible matches are checked with compare_inexact.
+        //! Each search string has seeds as long as its pieces, up to bases_per_value,
+        //! so short strings do not shorten the seeds of long ones.
+        //! \param results set to the sorted positions of the matches of each search string.
+        //! \param search_strs strings to search for, each at least max_distance+1 bases.
+        //! \param max_distance number of allowable errors in the search.
+        //! \param start_pos Zero-based offset to start the search.
+        //! \param max_bases maxiumum number of bases to search.
+        void find_inexact_multi(
+            std::vector<std::vector<size_t> > &results,
+            const std::vector<std::string> &search_strs,
+            size_t max_distance = 0,
+            size_t start_pos = 0,
+            size_t max_bases = ~(size_t)0
+        ) const {
+            size_t num_pieces = max_distance + 1;
+            for (auto &search_str : search_strs) {
+                if (search_str.size() < num_pieces) {
+                    throw std::invalid_argument("find_inexact_multi(): search string shorter than max_distance+1");
+                }
+            }
+
+            // Make a table for each seed length of the first bases of every piece, sorted by value.
+            struct seed {
+                word_type value;
+                uint32_t str_idx;
+                uint32_t offset;
+
+                bool operator<(const seed &rhs) const {
+                    return value < rhs.value;
+                }
+            };
+            struct seed_table {
+                size_t seed_length;
+                std::vector<seed> seeds;
+                size_t filter_bits;
+                std::vector<uint64_t> filter;
+            };
+            std::vector<basic_dna_string<unmapped_traits> > dna_strs;
+            std::vector<seed_table> tables(bases_per_value + 1);
+            dna_strs.reserve(search_strs.size());
+            for (size_t i = 0; i != search_strs.size(); ++i) {
+                dna_strs.emplace_back(search_strs[i]);
+                size_t piece_length = search_strs[i].size() / num_pieces;
+                size_t seed_length = std::min(piece_length, bases_per_value);
+                for (size_t j = 0; j != num_pieces; ++j) {
+                    seed s = { dna_strs[i].get_index(j * piece_length, seed_length), (uint32_t)i, (uint32_t)(j * piece_length) };
+                    tables[seed_length].seed_length = seed_length;
+                    tables[seed_length].seeds.push_back(s);
+                }
+            }
+            tables.erase(std::remove_if(tables.begin(), tables.end(), [](const seed_table &t) { return t.seeds.empty(); }), tables.end());
+
+            // A bitmap of hashed seeds rejects most positions without a search.
+            auto hash = [](word_type value, size_t filter_bits) {
+                return (size_t)((value * 0x9e3779b97f4a7c15ull) >> (64 - filter_bits));
+            };
+            size_t min_seed_length = bases_per_value, max_seed_length = 0;
+            for (auto &t : tables) {
+                min_seed_length = std::min(min_seed_length, t.seed_length);
+                max_seed_length = std::max(max_seed_length, t.seed_length);
+                std::sort(t.seeds.begin(), t.seeds.end());
+                t.filter_bits = 10;
+                while (((size_t)1 << t.filter_bits) < t.seeds.size() * 16 && t.filter_bits < 26) ++t.filter_bits;
+                t.filter.resize(((size_t)1 << t.filter_bits) / 64);
+                for (auto &s : t.seeds) {
+                    size_t h = hash(s.value, t.filter_bits);
+                    t.filter[h / 64] |= (uint64_t)1 << (h % 64);
+                }
+            }
+
+            // Scan the string once with the longest seed, checking every possible match.
+            // The shorter seeds are the first bases of the longest.
+            results.assign(search_strs.size(), std::vector<size_t>());
+            size_t last = std::min(size(), start_pos + std::min(max_bases, size()));
+            if (tables.empty() || start_pos + min_seed_length > last) {
+                return;
+            }
+            kmer_iterator kmer(*this, start_pos, max_seed_length);
+            for (size_t pos = start_pos; pos + min_seed_length <= last; ++pos, ++kmer) {
+                for (auto &t : tables) {
+                    if (pos + t.seed_length > last) continue;
+                    word_type value = *kmer >> (max_seed_length - t.seed_length) * 2;
+                    size_t h = hash(value, t.filter_bits);
+                    if (((t.filter[h / 64] >> (h % 64)) & 1) == 0) continue;
+
+                    seed key = { value, 0, 0 };
+                    auto range = std::equal_range(t.seeds.begin(), t.seeds.end(), key);
+                    for (auto s = range.first; s != range.second; ++s) {
+                        size_t length = dna_strs[s->str_idx].size();
+                        if (pos < start_pos + s->offset || pos - s->offset + length > last) continue;
+                        size_t match_pos = pos - s->offset;
+                        if (compare_inexact(match_pos, length, dna_strs[s->str_idx], max_distance) == 0) {
+                            results[s->str_idx].push_back(match_pos);
+                        }
+                    }
+                }
+            }
+
+            // Matches found from more than one piece are reported once.
+            for (auto &r : results) {
+                std::sort(r.begin(), r.end());
+                r.erase(std::unique(r.begin(), r.end()), r.end());
+            }
+        }
+
         //! \brief Compare two substrings exactly.
         //! \tparam StringTraits Traits of other string to compare with.
         //! \param start_pos Zero-based offset to start the search.
@@ -417,6 +697,117 @@ namespace boost { namespace genetics {
             return error;
         }
 
+        //! \brief Find the best match for str starting within max_gap bases of start_pos,
+        //! allowing insertions and deletions as well as substitutions.
+        //! This uses Myers' bit-parallel edit distance with the pattern in 64 base blocks
+        //! and then traces the best match with a small dynamic program.
+        //! \tparam StringTraits Traits of other string to compare with.
+        //! \param start_pos Zero-based offset of the match without gaps.
+        //! \param str dna_string to compare with.
+        //! \param max_gap maximum number of bases to move the start or end of the match.
+        //! \param max_distance maximum edit distance of the match.
+        //! \param match_pos set to the start of the best match.
+        //! \param cigar set to the CIGAR string of the best match, eg. "40M2I58M".
+        //! \return the edit distance of the best match or npos if it is more than max_distance.
+        template <class StringTraits>
+        size_t edit_distance(size_t start_pos, const basic_dna_string<StringTraits> &str, size_t max_gap, size_t max_distance, size_t &match_pos, std::string &cigar) const {
+            size_t m = str.size();
+            size_t lo = start_pos > max_gap ? start_pos - max_gap : 0;
+            size_t hi = std::min(num_bases, start_pos + m + max_gap);
+            if (m == 0 || lo >= hi) {
+                return npos;
+            }
+
+            // One bit per pattern base for each code, plus the vertical deltas.
+            size_t num_blocks = (m + 63) / 64;
+            size_t last_bit = (m - 1) % 64;
+            std::vector<uint64_t> peq(num_blocks * 4), pv(num_blocks, ~(uint64_t)0), mv(num_blocks);
+            for (size_t i = 0; i != m; ++i) {
+                peq[str.get_code(i) * num_blocks + i / 64] |= (uint64_t)1 << (i % 64);
+            }
+
+            // The match may start anywhere, so the top row is zero and each column
+            // gives the distance of the best match ending there.
+            size_t score = m, best = npos, best_end = 0;
+            word_type w = 0;
+            for (size_t j = 0; j != hi - lo; ++j) {
+                if (j % bases_per_value == 0) w = window(lo + j);
+                const uint64_t *eq_code = &peq[(size_t)(w >> (bases_per_value*2-2)) * num_blocks];
+                w <<= 2;
+                int hin = 0;
+                for (size_t b = 0; b != num_blocks; ++b) {
+                    uint64_t p = pv[b], n = mv[b], eq = eq_code[b];
+                    uint64_t hin_neg = hin < 0 ? 1 : 0;
+                    uint64_t xv = eq | n;
+                    eq |= hin_neg;
+                    uint64_t xh = (((eq & p) + p) ^ p) | eq;
+                    uint64_t ph = n | ~(xh | p);
+                    uint64_t mh = p & xh;
+                    size_t bit = b == num_blocks - 1 ? last_bit : 63;
+                    int hout = (int)((ph >> bit) & 1) - (int)((mh >> bit) & 1);
+                    ph = (ph << 1) | (hin > 0 ? 1 : 0);
+                    mh = (mh << 1) | hin_neg;
+                    pv[b] = mh | ~(xv | ph);
+                    mv[b] = ph & xv;
+                    hin = hout;
+                }
+                score += hin;
+                if (score < best) {
+                    best = score;
+                    best_end = j + 1;
+                }
+            }
+
+            if (best > max_distance) {
+                return npos;
+            }
+
+            // Trace back through the distances of the bases the match could span.
+            size_t text_begin = best_end > m + best ? best_end - m - best : 0;
+            size_t width = best_end - text_begin;
+            std::vector<uint32_t> d((m + 1) * (width + 1));
+            for (size_t i = 0; i <= m; ++i) {
+                d[i * (width + 1)] = (uint32_t)i;
+            }
+            for (size_t i = 1; i <= m; ++i) {
+                int code = str.get_code(i - 1);
+                uint32_t *row = &d[i * (width + 1)], *prev = row - (width + 1);
+                for (size_t j = 1; j <= width; ++j) {
+                    uint32_t diag = prev[j-1] + (get_code(lo + text_begin + j - 1) != code);
+                    row[j] = std::min(diag, std::min(prev[j], row[j-1]) + 1);
+                }
+            }
+
+            // Keep extending a gap when it costs the same, so gaps are not split.
+            std::string ops;
+            size_t i = m, j = width;
+            char op = 'M';
+            while (i != 0) {
+                uint32_t cur = d[i * (width + 1) + j];
+                bool can_insert = cur == d[(i-1) * (width + 1) + j] + 1;
+                bool can_delete = j != 0 && cur == d[i * (width + 1) + j - 1] + 1;
+                bool can_match = j != 0 && cur == d[(i-1) * (width + 1) + j - 1] + (get_code(lo + text_begin + j - 1) != str.get_code(i - 1));
+                if (!(op == 'I' && can_insert) && !(op == 'D' && can_delete)) {
+                    op = can_match ? 'M' : can_insert ? 'I' : 'D';
+                }
+                ops.push_back(op);
+                if (op != 'D') --i;
+                if (op != 'I') --j;
+            }
+            match_pos = lo + text_begin + j;
+
+            // Run length encode the operations.
+            cigar.clear();
+            for (size_t k = ops.size(); k != 0; ) {
+                char op = ops[k-1];
+                size_t run = 0;
+                for (; k != 0 && ops[k-1] == op; --k) ++run;
+                cigar += std::to_string(run);
+                cigar.push_back(op);
+            }
+            return best;
+        }
+
         //! \brief Compare two substrings with errors.
         //! \tparam StringTraits Traits of other string to compare with.
         //! \param start_pos Zero-based offset to start the search.
@@ -506,16 +897,56 @@ namespace boost { namespace genetics {
             wr.write(values);
         }
 
+        //! \brief Start loading the bases [pos, pos + length) into the cache.
+        void prefetch(size_t pos, size_t length) const {
+            size_t end = std::min(pos + length, size());
+            if (pos >= end) return;
+            const word_type *p = values.data();
+            touch_nta(p + pos / bases_per_value);
+            touch_nta(p + (end - 1) / bases_per_value);
+        }
+
         //! \brief Back-door access to the values.
         const array_type &get_values() const {
             return values;
         }
 
+        //! \brief Calculate the suffix array of the string with a '$' terminator.
+        //! sa[i] is the position of the i'th suffix in sorted order, so sa[0] is the
+        //! position of the '$', size(). This uses the SA-IS algorithm, taking linear time
+        //! and little more memory than the result.
+        //! \param num_threads threads to use for the stages of SA-IS that can be split up.
+        void suffix_array(std::vector<addr_type> &sa, size_t num_threads = 1) const {
+            size_t str_size = size();
+            if (
+                str_size + 1 >= std::numeric_limits<addr_type>::max()
+            ) {
+                throw std::invalid_argument(
+                    "suffix_array(): string too large for address type"
+                );
+            }
+
+            // The '$' is a zero and each base is its code plus one.
+            sa.resize(0);
+            sa.resize(str_size + 1);
+            if (str_size == 0) {
+                return;
+            }
+            sais(sa.data(), code_text(*this), str_size + 1, 5, std::max((size_t)1, num_threads));
+        }
+
         //! \brief Calculate the Burrows Wheeler Transform
         //! This is useful for searching and compression.
-        void bwt(basic_dna_string &result, size_t &inverse_sa0) const {
-            const bool debug = false;
+        //! \param num_threads threads to use for the stages that can be split up.
+        void bwt(basic_dna_string &result, size_t &inverse_sa0, size_t num_threads = 1) const {
+            std::vector<addr_type> checkpoints;
+            checkpointed_bwt(result, inverse_sa0, checkpoints, 0, num_threads);
+        }
 
+        //! \brief Calculate the Burrows Wheeler Transform with checkpoints for a parallel ibwt().
+        //! checkpoints[i] is set to the row of the suffix at position i * interval.
+        //! Together they are a compressed form of the string that is quick to expand.
+        void checkpointed_bwt(basic_dna_string &result, size_t &inverse_sa0, std::vector<addr_type> &checkpoints, size_t interval, size_t num_threads = 1) const {
             // The suffix array is a sort of all the substrqings of a string.
             // Example "hello" -> "", "ello", "hello", llo", "lo", "o"
             // with the first character in alphabetical order
@@ -528,202 +959,211 @@ namespace boost { namespace genetics {
             // location inverse_sa0 in the result.
             
             // see: https://en.wikipedia.org/wiki/Burrows%E2%80%93Wheeler_transform
-        
-            size_t str_size = size();
-            if (str_size == 0) {
-                result.resize(1);
-                result.set_code(0, 0);
-                inverse_sa0 = 0;
-                return;
-            }
-            if (
-                size() >= std::numeric_limits<addr_type>::max()
-            ) {
-                throw std::invalid_argument(
-                    "bwt(): string too large for address type"
-                );
-            }
-            
-            // Big note: it may seem strange to computer scientists to use sorts in this way
-            // when you could invert an array using indices, but using x[y[i]]
-            // constructs in real code is highly inefficient (~3000 cycles per
-            // element for large arrays)
-
-            // construction sorter.
-            // note: this is impractical on real (non-academic) machines of the 2015
-            // generation as it uses at least 12.25 bytes per base (~32GB for ENSEMBL human).
-            // 64GB machines will be the norm fairly soon and in the meantime, SSE backed swap
-            // space works reasonably well with std::sort.
-            //
-            // Richard Durbin's aproach of using BWT merging seems better and we should
-            // investigate adopting it, especially as cloud computing is the target
-            // with limited memory available at reasonable price.
-            std::vector<bwt_sort_type> sorter;
-
-            // allocate memory.
-            sorter.reserve(str_size+1);
-            result.resize(str_size+1);
 
-            auto sort_by_address = [](const bwt_sort_type &a, const bwt_sort_type &b) { return a.addr < b.addr; };
-
-            auto sort_by_group = [](const bwt_sort_type &a, const bwt_sort_type &b) {
-                return a.group < b.group;
-            };
-
-            auto sort_by_group_and_next = [](const bwt_sort_type &a, const bwt_sort_type &b) {
-                return a.group < b.group + (a.next_group < b.next_group);
-            };
-            
-            auto debug_dump = [this,&sorter](const char *msg, size_t h) {
-                printf("\n%s h=%d\n", msg, (int)h);
-                for (size_t i = 0; i != sorter.size(); ++i) {
-                    auto &s = sorter[i];
-                    const char *str = std::string(substr(s.addr, 40)).c_str();
-                    printf("%4d %12d %4d %4d %s\n", (int)i, (int)s.group, (int)s.next_group, (int)s.addr, str);
+            // The suffix array takes sizeof(addr_type) bytes per base, which
+            // is most of the memory used (about 4.4 bytes per base in all).
+            // To use less, build the transform a part at a time with the
+            // part_starts version below.
+            std::vector<addr_type> sa;
+            suffix_array(sa, num_threads);
+
+            // Threads fill whole words of the result.
+            size_t rows = sa.size();
+            result.resize(rows);
+            checkpoints.resize(0);
+            checkpoints.resize(interval ? (rows + interval - 2) / interval : 0);
+            size_t num_words = (rows + bases_per_value - 1) / bases_per_value;
+            num_threads = std::max((size_t)1, std::min(num_threads, num_words));
+            run_threads(num_threads, [&](size_t tid) {
+                size_t begin = num_words * tid / num_threads * bases_per_value;
+                size_t end = std::min(rows, num_words * (tid + 1) / num_threads * bases_per_value);
+                for (size_t i = begin; i != end; ++i) {
+                    if (interval && sa[i] % interval == 0 && sa[i] != rows - 1) {
+                        checkpoints[sa[i] / interval] = (addr_type)i;
+                    }
+                    if (sa[i] == 0) {
+                        inverse_sa0 = i;
+                        result.set_code(i, 0);
+                    } else {
+                        result.set_code(i, get_code(sa[i] - 1));
+                    }
                 }
-            };
+            });
+        }
 
-            // use the upper few bits of the dna string as a key for the initial sort
-            const size_t key_chars = sizeof(addr_type) * 4;
-            const int sh = sizeof(word_type) * 8 - key_chars * 2;
-            for (size_t i = 0; i != str_size; ++i) {
-                addr_type group = (addr_type)(window(i) >> sh);
-                addr_type next_group = i + key_chars < str_size ? key_chars : str_size - i;
-                sorter.push_back(bwt_sort_type{ group, next_group, (addr_type)i });
+        //! \brief Calculate the Burrows Wheeler Transform a part at a time.
+        //! The parts begin at part_starts (eg. the chromosomes) and are merged from the
+        //! last to the first with prepend_bwt(), so the working memory is set by the
+        //! largest part rather than the whole string. The result is the same as bwt().
+        void bwt(basic_dna_string &result, size_t &inverse_sa0, const std::vector<size_t> &part_starts, size_t num_threads = 1) const {
+            std::vector<size_t> ends(part_starts);
+            ends.push_back(0);
+            ends.push_back(size());
+            std::sort(ends.begin(), ends.end());
+            ends.erase(std::unique(ends.begin(), ends.end()), ends.end());
+            if (ends.back() != size()) {
+                throw std::invalid_argument("bwt(): part start is beyond the end of the string");
             }
-            
-            {
-                // the $ value
-                sorter.push_back(bwt_sort_type{ 0, 0, (addr_type)str_size });
+
+            // Start with the transform of the empty string, "$".
+            result.resize(0);
+            result.resize(1);
+            inverse_sa0 = 0;
+            for (size_t i = ends.size() - 1; i != 0; --i) {
+                prepend_bwt(result, inverse_sa0, ends[i-1], ends[i] - ends[i-1], num_threads);
             }
+        }
 
-            // each time we go round the loop we have already constucted 
-            // a sort of the suffixes to h characters. This means that some
-            // suffixes will still be the same.
-            //
-            // example: (h=2)
-            //       group
-            // AAAA    1
-            // ACCG    2  <-
-            // ACGT    2  <- these are the same to 2 chars.
-            // AGTT    4
-            // etc.
-            // 
-            // But we can use our existing group numbers to resolve them.
+        //! \brief Extend the Burrows Wheeler Transform of a string s to that of the bases
+        //! [pos, pos + len) of this string followed by s.
+        //! bwt and inverse_sa0 are the result of bwt() for s and are updated in place.
+        //! Extra memory is about 4 * sizeof(addr_type) bytes per base of the new part plus
+        //! a copy of the transform, so a contig can be added to the front of a large string
+        //! without sorting it all again.
+        void prepend_bwt(basic_dna_string &bwt, size_t &inverse_sa0, size_t pos, size_t len, size_t num_threads = 1) const {
+            // After Hon, Lam, Sadakane, Sung and Yiu, "A space and time efficient
+            // algorithm for constructing compressed suffix arrays" (2007).
             //
-            // To avoid indexing the arrays, we use std::sort which is more
-            // cache friendly. Turn the debug flag on to see what it does.
-            //
-            for (size_t h = key_chars; ; h *= 2) {
-                // sort by group    
-                std::sort(sorter.begin(), sorter.end(), sort_by_group_and_next);
-    
-                if (debug) debug_dump("sorted group and next_group", h);
-
-                // build the group numbers
-                auto t = sorter[0];
-                addr_type group = 0;
-                sorter[0].group = group++;
-                int finished = 1;
-                for (size_t i = 1; i != str_size+1; ++i) {
-                    auto &s = sorter[i];
-                    int different = (t.group != s.group) | (t.next_group != s.next_group);
-                    finished &= different;
-                    group = different ? (addr_type)i : group;
-                    t = s;
-                    s.group = group;
-                }
-                
-                if (debug) debug_dump("built group numbers", h);
-
-                if (finished) break;
-    
-                // invert the sort, restoring the original order of the sequence
-                std::sort(sorter.begin(), sorter.end(), sort_by_address);
-
-                // avoid random access to the string by using a sort.                
-                for (size_t i = 0; i != str_size+1; ++i) {
-                    bwt_sort_type &s = sorter[i];
-                    s.next_group = i < str_size - h ? sorter[i+h].group : 0;
-                }
-    
-                if (debug) debug_dump("set next_group", h);
+            // The suffixes starting in s keep their order and each suffix p of the new
+            // part is placed after the j[p] suffixes of s that are smaller than it.
+            // j[p] comes from one LF step on the old transform, as in backward search.
+            // Parts with equal j[p] are ordered by the rest of the part, so sorting the
+            // suffixes of the string of (j[p], base) pairs gives the order of the new rows.
+            size_t old_rows = bwt.size();
+            if (pos > size() || len > size() - pos) {
+                throw std::invalid_argument("prepend_bwt(): part is beyond the end of the string");
             }
-
-            // linearise the addresses for fast access.
-            // this may be faster than using a peek/poke aproach
-            std::sort(sorter.begin(), sorter.end(), sort_by_address);
-
-            // this bwt entry (for address 0) would usually have '$',
-            // but we have only four characters in the alphabet.
-            inverse_sa0 = sorter[0].group;
-            sorter[0].next_group = (addr_type)0;
-
-            // put the previous char in next_group for the bwt.
-            for (size_t i = 1; i != str_size+1; ++i) {
-                bwt_sort_type &s = sorter[i];
-                s.next_group = get_code(i-1);
+            if (old_rows == 0 || inverse_sa0 >= old_rows) {
+                throw std::invalid_argument("prepend_bwt(): not a Burrows Wheeler Transform");
+            }
+            if (old_rows + len + 1 >= std::numeric_limits<addr_type>::max()) {
+                throw std::invalid_argument("prepend_bwt(): string too large for address type");
+            }
+            if (len == 0) {
+                return;
             }
 
-            if (debug) debug_dump("set next_group for bwt", 0);
-
-            // restore the group order
-            std::sort(sorter.begin(), sorter.end(), sort_by_group);
+            rank_table ranks(bwt, inverse_sa0, num_threads);
 
-            // copy the chars into the BWT
-            for (size_t i = 0; i != str_size+1; ++i) {
-                bwt_sort_type &s = sorter[i];
-                result.set_code(i, s.next_group);
+            // j[p] for p in [0, len] where j[len] is the row of s itself.
+            std::vector<addr_type> j(len + 1);
+            j[len] = (addr_type)inverse_sa0;
+            for (size_t p = len; p-- != 0; ) {
+                int code = get_code(pos + p);
+                j[p] = (addr_type)(ranks.first_row(code) + ranks.occ(code, j[p+1]));
             }
 
-            if (debug) debug_dump("set bwt data", 0);
-            
-            if (debug) printf("inverse_sa0=%d\n", (int)inverse_sa0);
-            
-            // make sure we fail the tests if debug is on.
-            if (debug) {
-                result.resize(0);
-                std::cout << "bwt fail: debug still on\n";
+            // Name the (j[p], base) pairs in order. s itself is greater than any
+            // suffix of the part with the same j, so it gets a base of 4.
+            // A radix sort of the positions by (j[p], base) takes linear time.
+            auto key = [&](size_t p) {
+                return (uint64_t)j[p] * 5 + (p == len ? 4 : get_code(pos + p));
+            };
+            std::vector<addr_type> sa(len + 2);
+            {
+                const size_t radix_bits = 12;
+                std::vector<addr_type> tmp(len + 2);
+                std::vector<size_t> starts((size_t)1 << radix_bits);
+                for (size_t p = 0; p != len + 1; ++p) sa[p] = (addr_type)p;
+                for (size_t shift = 0; ((uint64_t)old_rows * 5) >> shift; shift += radix_bits) {
+                    std::fill(starts.begin(), starts.end(), 0);
+                    for (size_t p = 0; p != len + 1; ++p) {
+                        starts[(key(p) >> shift) & (starts.size() - 1)]++;
+                    }
+                    for (size_t i = 0, sum = 0; i != starts.size(); ++i) {
+                        size_t c = starts[i];
+                        starts[i] = sum;
+                        sum += c;
+                    }
+                    for (size_t i = 0; i != len + 1; ++i) {
+                        tmp[starts[(key(sa[i]) >> shift) & (starts.size() - 1)]++] = sa[i];
+                    }
+                    sa.swap(tmp);
+                }
             }
-        }
-
-        //! \brief Calculate the inverse Burrows Wheeler Transform
-        void ibwt(basic_dna_string &result, size_t inverse_sa0) const {
-            const bool debug = false;
-            
-            size_t str_size = size();
-            result.resize(str_size-1);
-            
-            std::vector<ibwt_sort_type> sorter;
-            sorter.resize(str_size);
-            for (size_t i = 0; i != str_size; ++i) {
-                sorter[i].addr = (addr_type)i;
-                sorter[i].chr = get_code(i) + 1;
+            std::vector<addr_type> names(len + 2);
+            size_t num_names = 0;
+            for (size_t i = 0; i != len + 1; ++i) {
+                if (i == 0 || key(sa[i]) != key(sa[i-1])) ++num_names;
+                names[sa[i]] = (addr_type)num_names;
             }
-            sorter[inverse_sa0].chr = 0;
+            names[len + 1] = 0;
+            sais(sa.data(), array_text(names.data()), len + 2, num_names + 1, std::max((size_t)1, num_threads));
+            std::vector<addr_type>().swap(names);
 
-            // Ok, we should be able to bucket sort this one!
-            auto sort_by_chr = [](const ibwt_sort_type &a, const ibwt_sort_type &b) { return a.chr < b.chr + (a.addr < b.addr); };
-            std::sort(sorter.begin(), sorter.end(), sort_by_chr);
-
-            if (debug) {
-                for (size_t i = 0; i != sorter.size(); ++i) {
-                    auto &s = sorter[i];
-                    printf("%4d %2d %4d\n", (int)i, (int)s.chr, (int)s.addr);
+            // Merge the old rows with the new ones. The '$' of s is now the last base of the part.
+            basic_dna_string result;
+            result.resize(old_rows + len);
+            size_t row = 0, old_row = 0;
+            auto copy_old = [&](size_t end) {
+                for (; old_row != end; ++old_row, ++row) {
+                    result.set_code(row, old_row == inverse_sa0 ? get_code(pos + len - 1) : bwt.get_code(old_row));
+                }
+            };
+            size_t new_inverse_sa0 = 0;
+            for (size_t i = 1; i != len + 2; ++i) {
+                size_t p = sa[i];
+                if (p == len) continue;
+                copy_old(j[p]);
+                if (p == 0) {
+                    new_inverse_sa0 = row;
+                    result.set_code(row++, 0);
+                } else {
+                    result.set_code(row++, get_code(pos + p - 1));
                 }
             }
+            copy_old(old_rows);
+            bwt = std::move(result);
+            inverse_sa0 = new_inverse_sa0;
+        }
+
+        //! \brief Calculate the inverse Burrows Wheeler Transform
+        //! This walks back through the transform with the LF mapping
+        //! using a small table of base counts, so uses little memory beyond the result.
+        void ibwt(basic_dna_string &result, size_t inverse_sa0, size_t num_threads = 1) const {
+            ibwt(result, inverse_sa0, std::vector<addr_type>(), 0, num_threads);
+        }
 
-            // Sadly, very little choice but to pointer chase this loop.
-            for (size_t addr = sorter[0].addr, i = 0; i != str_size; ++i, addr = sorter[addr].addr) {
-                result.set_code(i, sorter[addr].chr - 1);
+        //! \brief Calculate the inverse Burrows Wheeler Transform on several threads.
+        //! checkpoints[i] is the row of the suffix at position i * interval (see bwt()).
+        //! The segments between checkpoints are independent, so are shared between threads.
+        void ibwt(basic_dna_string &result, size_t inverse_sa0, const std::vector<addr_type> &checkpoints, size_t interval, size_t num_threads = 1) const {
+            size_t rows = size();
+            if (rows == 0 || inverse_sa0 >= rows) {
+                throw std::invalid_argument("ibwt(): not a Burrows Wheeler Transform");
             }
-            
-            if (debug) {
-                std::cout << "ibwt fail: debug still on\n";
-                result.resize(0);
+            size_t str_size = rows - 1;
+            if (interval == 0) {
+                // Without checkpoints, walk back from the '$' in one segment.
+                interval = str_size + 1;
+            } else if (checkpoints.size() != (str_size + interval - 1) / interval) {
+                throw std::invalid_argument("ibwt(): wrong number of checkpoints");
             }
+            rank_table ranks(*this, inverse_sa0, num_threads);
+            result.resize(0);
+            result.resize(str_size);
+
+            // Each thread takes groups of bases_per_value segments, so that
+            // threads never write to the same word of the result.
+            size_t num_segments = (str_size + interval - 1) / interval;
+            size_t num_groups = (num_segments + bases_per_value - 1) / bases_per_value;
+            num_threads = std::max((size_t)1, std::min(num_threads, num_groups));
+            run_threads(num_threads, [&](size_t tid) {
+                size_t seg_end = std::min(num_segments, num_groups * (tid + 1) / num_threads * bases_per_value);
+                for (size_t seg = num_groups * tid / num_threads * bases_per_value; seg < seg_end; ++seg) {
+                    // Start at the row of the suffix at the end of the segment.
+                    size_t begin = seg * interval;
+                    size_t end = std::min(str_size, begin + interval);
+                    size_t row = end == str_size ? 0 : checkpoints[end / interval];
+                    for (size_t pos = end; pos-- != begin; ) {
+                        int code = get_code(row);
+                        result.set_code(pos, code);
+                        row = ranks.first_row(code) + ranks.occ(code, row);
+                    }
+                }
+            });
         }
-        
+
         //! Calculate the occurance of each of the letters, ACG and T in [start, end)
         std::array<size_t, 4> occurance(size_t start, size_t end) const {
             if (start > end || end > size()) {
@@ -778,12 +1218,330 @@ namespace boost { namespace genetics {
             occ[3] = (end - start) - (occ[0] + totC + totG);
             return occ;
         }
+    protected:
+        // Append ascii characters like append(), calling run(pos, n, val) for each
+        // run of n chars at base pos, where val is zero for bases and the char otherwise.
+        // Bases are decoded up to sixteen at a time with ascii_to_codes16, and
+        // blocks of sixteen of the same letter, such as N, are taken at once.
+        // random_acc is the state of the random codes, updated for the next append.
+        template <class RunFn>
+        void append_ascii(const char *b, const char *e, bool randomise, RunFn run, std::int32_t &random_acc) {
+            size_t max_bases = values.size() * bases_per_value;
+            word_type acc = num_bases < max_bases ? values.back() >> (max_bases - num_bases) * 2 : 0;
+            const std::int32_t random_xor = 0xa9831bc5;
+            auto store = [&]() {
+                size_t index = (num_bases-1) / bases_per_value;
+                if (index >= values.size()) {
+                    values.push_back(acc);
+                } else {
+                    values[index] = acc;
+                }
+            };
+            // Add the top n of sixteen codes.
+            auto push_codes = [&](uint32_t codes, size_t n) {
+                word_type new_codes = (word_type)codes >> (32 - n * 2);
+                size_t used = num_bases % bases_per_value;
+                if (used + n < bases_per_value) {
+                    acc = acc << (n * 2) | new_codes;
+                    num_bases += n;
+                } else {
+                    // Fill the word and keep the rest of the codes.
+                    size_t fill = bases_per_value - used;
+                    acc = acc << (fill * 2) | new_codes >> ((n - fill) * 2);
+                    num_bases += fill;
+                    store();
+                    acc = new_codes & (((word_type)1 << ((n - fill) * 2)) - 1);
+                    num_bases += n - fill;
+                }
+            };
+            while (b != e) {
+                if (e - b >= 16) {
+                    uint32_t codes;
+                    size_t n = ascii_to_codes16(b, codes);
+                    if (n != 0) {
+                        run(num_bases, n, 0);
+                        push_codes(codes, n);
+                        b += n;
+                        if (n == 16) continue;
+                    } else if (is_run16(b) && !is_whitespace(*b)) {
+                        // Sixteen of a letter that is not a base, such as a line of N.
+                        int chr = (int)*b;
+                        uint32_t letter_codes = (uint32_t)base_to_code(chr) * 0x55555555u;
+                        if (randomise) {
+                            for (size_t i = 0; i != 16; ++i) {
+                                random_acc = ((random_acc >> 31) & random_xor ) ^ (random_acc << 1);
+                                letter_codes |= (uint32_t)(random_acc & 3) << (30 - i * 2);
+                            }
+                        }
+                        run(num_bases, 16, chr);
+                        push_codes(letter_codes, 16);
+                        b += 16;
+                        continue;
+                    }
+                }
+
+                int chr = (int)*b++;
+                if (!is_whitespace(chr)) {
+                    bool base = is_base(chr);
+                    run(num_bases, 1, base ? 0 : chr);
+                    acc = acc * 4 + base_to_code(chr);
+                    if (randomise && !base) {
+                        random_acc = ((random_acc >> 31) & random_xor ) ^ (random_acc << 1);
+                        acc |= random_acc & 3;
+                    }
+                    num_bases++;
+                    if (num_bases % bases_per_value == 0) {
+                        store();
+                        acc = 0;
+                    }
+                }
+            }
+
+            if (num_bases % bases_per_value != 0) {
+                acc <<= (0-num_bases) % bases_per_value * 2;
+                store();
+            }
+        }
+
     private:
+        // Counts of each base before every block of a Burrows Wheeler Transform,
+        // skipping the '$' at inverse_sa0, for the LF mapping of prepend_bwt and ibwt.
+        class rank_table {
+        public:
+            rank_table(const basic_dna_string &bwt, size_t inverse_sa0, size_t num_threads) :
+                words(bwt.get_values().data()),
+                inverse_sa0(inverse_sa0),
+                use_popcnt(has_popcnt())
+            {
+                size_t rows = bwt.size();
+                size_t num_blocks = rows / block_bases + 1;
+                block_counts.resize(num_blocks * 4);
+
+                // Count the bases in each block on several threads and then add them up.
+                num_threads = std::max((size_t)1, std::min(num_threads, num_blocks));
+                run_threads(num_threads, [&](size_t tid) {
+                    size_t blocks_end = num_blocks * (tid + 1) / num_threads;
+                    for (size_t block = num_blocks * tid / num_threads; block != blocks_end; ++block) {
+                        size_t end = std::min(rows, (block + 1) * block_bases);
+                        for (size_t i = block * block_bases; i < end; i += bases_per_value) {
+                            size_t num_bases = std::min(end - i, (size_t)bases_per_value);
+                            for (int c = 0; c != 4; ++c) {
+                                block_counts[block * 4 + c] += (addr_type)count_code(words[i / bases_per_value], c, num_bases);
+                            }
+                        }
+                    }
+                });
+
+                std::array<size_t, 4> totals = {{ 0, 0, 0, 0 }};
+                for (size_t block = 0; block != num_blocks; ++block) {
+                    for (size_t c = 0; c != 4; ++c) {
+                        size_t count = block_counts[block * 4 + c];
+                        block_counts[block * 4 + c] = (addr_type)(totals[c] - (c == 0 && inverse_sa0 < block * block_bases));
+                        totals[c] += count;
+                    }
+                }
+                totals[0]--;
+
+                // The row of the first suffix starting with each base.
+                first_rows[0] = 1;
+                for (size_t c = 0; c != 4; ++c) first_rows[c + 1] = first_rows[c] + totals[c];
+            }
+
+            //! Number of "code"s in rows [0, row) of the transform.
+            size_t occ(int code, size_t row) const {
+                size_t block = row / block_bases;
+                size_t result = block_counts[block * 4 + code];
+                size_t w = block * block_words;
+                for (; w != row / bases_per_value; ++w) {
+                    result += count_code(words[w], code, bases_per_value);
+                }
+                if (row % bases_per_value) {
+                    result += count_code(words[w], code, row % bases_per_value);
+                }
+                if (code == 0 && inverse_sa0 >= block * block_bases && inverse_sa0 < row) --result;
+                return result;
+            }
+
+            //! Row of the first suffix starting with code.
+            size_t first_row(int code) const {
+                return first_rows[code];
+            }
+        private:
+            static const size_t block_words = 8;
+            static const size_t block_bases = block_words * bases_per_value;
+
+            // Number of "code"s in the first num_bases bases of word w.
+            size_t count_code(word_type w, int code, size_t num_bases) const {
+                const word_type fives = (word_type)0x5555555555555555ull;
+                word_type x = w ^ (fives * (word_type)code);
+                x |= x >> 1;
+                x &= num_bases == bases_per_value ? fives : fives & ~(~(word_type)0 >> (num_bases * 2));
+                return num_bases - popcnt(x, use_popcnt);
+            }
+
+            const word_type *words;
+            size_t inverse_sa0;
+            bool use_popcnt;
+            std::vector<addr_type> block_counts;
+            std::array<size_t, 5> first_rows;
+        };
+
+        // The text of the top level of SA-IS: the codes of the bases plus one and a '$' of zero.
+        struct code_text {
+            const basic_dna_string &str;
+            code_text(const basic_dna_string &str) : str(str) {}
+            addr_type operator()(size_t i) const { return i == str.size() ? 0 : (addr_type)str.get_code(i) + 1; }
+        };
+
+        // The text of the lower levels of SA-IS: the names of the LMS substrings.
+        struct array_text {
+            const addr_type *names;
+            array_text(const addr_type *names) : names(names) {}
+            addr_type operator()(size_t i) const { return names[i]; }
+        };
+
+        // SA-IS suffix sorting (Nong, Zhang and Chan, 2009).
+        // Sorts the suffixes of text(0) .. text(n-1) into sa, where text(n-1) is a
+        // unique smallest char and all chars are less than k. Sorting the LMS substrings
+        // (those starting where the suffix order falls) induces the order of the rest.
+        // If the LMS substrings are not all different, their order is found by
+        // sorting the string of their names in the spare half of sa.
+        template <class Text>
+        static void sais(addr_type *sa, const Text &text, size_t n, size_t k, size_t num_threads) {
+            const addr_type empty = ~(addr_type)0;
+
+            // Each suffix is S type if it is smaller than the next one, L type otherwise.
+            std::vector<uint64_t> s_type((n + 63) / 64);
+            auto is_s = [&](size_t i) { return ((s_type[i / 64] >> (i % 64)) & 1) != 0; };
+            auto is_lms = [&](size_t i) { return i > 0 && is_s(i) && !is_s(i - 1); };
+            s_type[(n - 1) / 64] |= (uint64_t)1 << ((n - 1) % 64);
+            for (size_t i = n - 1; i-- != 0; ) {
+                addr_type c = text(i), next = text(i + 1);
+                if (c < next || (c == next && is_s(i + 1))) {
+                    s_type[i / 64] |= (uint64_t)1 << (i % 64);
+                }
+            }
+
+            // Count the chars, on several threads for the small alphabet of the top level.
+            std::vector<addr_type> counts(k), buckets(k);
+            if (k <= 256 && num_threads > 1 && n >= num_threads * 0x10000) {
+                std::vector<std::vector<addr_type> > thread_counts(num_threads, std::vector<addr_type>(k));
+                run_threads(num_threads, [&](size_t tid) {
+                    auto &c = thread_counts[tid];
+                    for (size_t i = n * tid / num_threads; i != n * (tid + 1) / num_threads; ++i) {
+                        c[text(i)]++;
+                    }
+                });
+                for (auto &c : thread_counts) {
+                    for (size_t i = 0; i != k; ++i) counts[i] += c[i];
+                }
+            } else {
+                for (size_t i = 0; i != n; ++i) {
+                    counts[text(i)]++;
+                }
+            }
+            auto bucket_starts = [&]() {
+                addr_type sum = 0;
+                for (size_t i = 0; i != k; ++i) { buckets[i] = sum; sum += counts[i]; }
+            };
+            auto bucket_ends = [&]() {
+                addr_type sum = 0;
+                for (size_t i = 0; i != k; ++i) { sum += counts[i]; buckets[i] = sum; }
+            };
+
+            // Fill in the L type suffixes from the left and then the S type from the right.
+            auto induce = [&]() {
+                bucket_starts();
+                for (size_t i = 0; i != n; ++i) {
+                    addr_type j = sa[i];
+                    if (j != empty && j != 0 && !is_s(j - 1)) {
+                        sa[buckets[text(j - 1)]++] = j - 1;
+                    }
+                }
+                bucket_ends();
+                for (size_t i = n; i-- != 0; ) {
+                    addr_type j = sa[i];
+                    if (j != empty && j != 0 && is_s(j - 1)) {
+                        sa[--buckets[text(j - 1)]] = j - 1;
+                    }
+                }
+            };
+
+            // Stage 1: sort the LMS substrings by inducing from their first chars.
+            std::fill(sa, sa + n, empty);
+            bucket_ends();
+            for (size_t i = 1; i != n; ++i) {
+                if (is_lms(i)) sa[--buckets[text(i)]] = (addr_type)i;
+            }
+            induce();
+
+            // Move the sorted LMS substrings to the start of sa.
+            size_t n1 = 0;
+            for (size_t i = 0; i != n; ++i) {
+                if (sa[i] != empty && is_lms(sa[i])) sa[n1++] = sa[i];
+            }
+
+            // Name the LMS substrings in order, equal substrings getting equal names.
+            // Comparing each substring with the previous one can be done on several threads.
+            std::vector<uint64_t> is_new((n1 + 63) / 64);
+            size_t num_blocks = (n1 + 63) / 64;
+            size_t name_threads = n1 >= 0x10000 ? std::min(num_threads, num_blocks) : 1;
+            run_threads(name_threads, [&](size_t tid) {
+                for (size_t i = num_blocks * tid / name_threads * 64; i < std::min(n1, num_blocks * (tid + 1) / name_threads * 64); ++i) {
+                    bool differs = i == 0;
+                    for (size_t a = sa[i], b = i ? sa[i-1] : 0, d = 0; !differs; ++d) {
+                        if (text(a + d) != text(b + d) || is_s(a + d) != is_s(b + d)) {
+                            differs = true;
+                        } else if (d > 0 && (is_lms(a + d) || is_lms(b + d))) {
+                            break;
+                        }
+                    }
+                    if (differs) is_new[i / 64] |= (uint64_t)1 << (i % 64);
+                }
+            });
+            std::fill(sa + n1, sa + n, empty);
+            size_t num_names = 0;
+            for (size_t i = 0; i != n1; ++i) {
+                num_names += (is_new[i / 64] >> (i % 64)) & 1;
+                sa[n1 + sa[i] / 2] = (addr_type)(num_names - 1);
+            }
+            for (size_t i = n, j = n; i-- != n1; ) {
+                if (sa[i] != empty) sa[--j] = sa[i];
+            }
+
+            // Stage 2: sort the string of names, recursing if some names are the same.
+            addr_type *sa1 = sa, *s1 = sa + n - n1;
+            if (num_names < n1) {
+                sais(sa1, array_text(s1), n1, num_names, num_threads);
+            } else {
+                for (size_t i = 0; i != n1; ++i) sa1[s1[i]] = (addr_type)i;
+            }
+
+            // Stage 3: put the LMS suffixes in order at the ends of their buckets
+            // and induce the order of the rest.
+            for (size_t i = 1, j = 0; i != n; ++i) {
+                if (is_lms(i)) s1[j++] = (addr_type)i;
+            }
+            for (size_t i = 0; i != n1; ++i) sa1[i] = s1[sa1[i]];
+            std::fill(sa + n1, sa + n, empty);
+            bucket_ends();
+            for (size_t i = n1; i-- != 0; ) {
+                addr_type j = sa[i];
+                sa[i] = empty;
+                sa[--buckets[text(j)]] = j;
+            }
+            induce();
+        }
+
         //! Inexact search using popcnt (if we have one!)
         template <class StringTraits, bool cpu_has_popcnt>
-        size_t inexact_search(basic_dna_string<StringTraits> &search_str, size_t pos, size_t nv, word_type s0, word_type s0mask, size_t max_distance, size_t max_bases, size_t last) const {
+        size_t inexact_search(basic_dna_string<StringTraits> &search_str, size_t pos, size_t nv, word_type s0, word_type s0mask, size_t max_distance, size_t max_bases, size_t last, simd_level simd) const {
             const size_t bpv = bases_per_value;
             for (size_t i = pos/bpv; i < nv; ++i) {
+                // Skip words with no near matches, several at a time.
+                i = scan_windows(simd, values.data(), i, nv, s0, s0mask, max_distance);
+                if (i == nv) break;
+
                 word_type v0 = values[i];
                 word_type v1 = values[i+1];
                 word_type s0x = s0;
@@ -847,10 +1605,21 @@ namespace boost { namespace genetics {
     //! \brief File mapped dna string used for searches.
     typedef basic_dna_string<mapped_traits> mapped_dna_string;
 
+    //! \brief dna string with 64 bit suffix addresses for more than 4G bases.
+    typedef basic_dna_string<large_unmapped_traits> large_dna_string;
+
+    //! \brief File mapped dna string with 64 bit suffix addresses.
+    typedef basic_dna_string<large_mapped_traits> large_mapped_dna_string;
+
     template <>
     inline int get_code<dna_string>(const dna_string &str, size_t index) {
         return str.get_code(index);
     }
+
+    template <>
+    inline uint64_t get_index<dna_string>(const dna_string &str, size_t pos, size_t num_index_chars) {
+        return str.get_index(pos, num_index_chars);
+    }
 } }
 
 
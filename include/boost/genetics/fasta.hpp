@@ -7,11 +7,16 @@
 #define BOOST_GENETICS_FASTA_HPP
 
 #include <type_traits>
+#include <algorithm>
+#include <string>
 #include <cstdint>
+#include <memory>
 
 #include <boost/genetics/dna_string.hpp>
 #include <boost/genetics/augmented_string.hpp>
 #include <boost/genetics/two_stage_index.hpp>
+#include <boost/genetics/fm_index.hpp>
+#include <boost/genetics/gzip_reader.hpp>
 
 #include <boost/interprocess/file_mapping.hpp>
 #include <boost/interprocess/mapped_region.hpp>
@@ -22,16 +27,24 @@ namespace boost { namespace genetics {
         size_t location;
         size_t distance;
         bool reverse_complement;
+
+        //! CIGAR string if the match has gaps, otherwise empty.
+        std::string cigar;
     };
    
     //! Interface to the various incarantions of the reference
     struct fasta_file_interface {
         //! find a list of results that match the string dstr with up to
-        //! max_distance errors and up to max_gap bases of introns.
+        //! max_distance errors and up to max_gap bases inserted or deleted.
         //! If the flag is_brute_force is set, do the search on every base
         //! in the file using popcnt if possible.
         virtual void find_inexact(std::vector<fasta_result> &result, const std::string &dstr, search_params &params, search_stats &stats) = 0;
 
+        //! find_inexact for many strings, giving results[i] for dstrs[i].
+        //! Searches are done in batches of batch_size with their index
+        //! lookups interleaved to hide memory latency.
+        virtual void find_inexact_batch(std::vector<std::vector<fasta_result> > &results, const std::vector<std::string> &dstrs, search_params &params, search_stats &stats, size_t batch_size = 32) = 0;
+
         //! Get chromosome data for one chromosome.
         virtual const chromosome &get_chromosome(size_t index) const = 0;
 
@@ -39,17 +52,24 @@ namespace boost { namespace genetics {
         virtual size_t get_num_chromosomes() const = 0;
 
         //! Called after append to index the file.
-        virtual void make_index(size_t num_indexed_chars) = 0;
+        virtual void make_index(size_t num_indexed_chars, const index_params &params = index_params()) = 0;
 
         //! Append a FASTA file to this reference.
         virtual void append(const std::string &filename) = 0;
 
+        //! Get length bases of the reference from offset, optionally reverse complemented.
+        virtual std::string substr(size_t offset, size_t length, bool rev_comp=false) const = 0;
+
         //! Give chromosome data or a null entry for this linear location in the reference.
         virtual const chromosome &find_chromosome(size_t location) const = 0;
 
         //! Write the reference data and the index to a binary writer wr.
         virtual void write_binary(writer &wr) const = 0;
 
+        //! Write the reference data and an index built with num_indexed_chars
+        //! to wr without building the index in memory.
+        virtual void write_binary(writer &wr, size_t num_indexed_chars, const index_params &params) const = 0;
+
         //! Write the FASTA data in ASCII to an ostream.
         virtual void write_ascii(std::ostream &str) const = 0;
 
@@ -63,6 +83,7 @@ namespace boost { namespace genetics {
         typedef typename Traits::FastaChromosomeType chromosome_type;
         typedef basic_augmented_string<Traits> string_type;
         typedef basic_two_stage_index<Traits> index_type;
+        typedef basic_fm_index<Traits> fm_index_type;
 
         //! Create an empty FASTA reference file. Use append() to add files.
         basic_fasta_file() {
@@ -85,6 +106,10 @@ namespace boost { namespace genetics {
             str(map),
             idx(str, map)
         {
+            // Files indexed with the fm engine have an fm_index at the end.
+            if (!map.is_end()) {
+                fm_idx = fm_index_type(str, map);
+            }
         }
 
         //! Move from another reference of the same type.
@@ -92,6 +117,7 @@ namespace boost { namespace genetics {
             chromosomes = std::move(rhs.chromosomes);
             str = std::move(rhs.str);
             idx = std::move(rhs.idx);
+            fm_idx = std::move(rhs.fm_idx);
             return *this;
         }
 
@@ -99,13 +125,19 @@ namespace boost { namespace genetics {
         }
 
         //! Append a single FASTA file to this file.
+        //! Files compressed with gzip or bgzip are decoded as they are packed.
         void append(const std::string &filename) {
             using namespace boost::interprocess;
             file_mapping fm(filename.c_str(), read_only);
             mapped_region region(fm, read_only);
             const char *p = (const char*)region.get_address();
             const char *end = p + region.get_size();
-            append(p, end);
+            if (gzip_reader::is_gzip(p, end)) {
+                gzip_reader reader(p, end);
+                append(reader, 1);
+            } else {
+                append(p, end);
+            }
         }
 
         //! Append a randomly generated chromosome "chr" of "size" bases.
@@ -135,56 +167,135 @@ namespace boost { namespace genetics {
 
         //! Append the image of a FASTA file to this file.
         void append(const char *p, const char *end) {
-            chromosome g;
-            while (p != end) {
-                g.start = str.size();
+            std::vector<fasta_record> records;
+            find_records(records, p, end);
+            append_records(records, 1);
+        }
 
-                //if (*p != '>') throw(std::runtime_error("bad fasta"));
-                const char *b = p;
-                while (p != end && *p != '\n' && *p != '\r') ++p;
-                size_t size = std::min(sizeof(g.info)-1, (size_t)(p-(b+1)));
-                memcpy(g.info, b+1, size);
+        //! Append the image of a FASTA file, packing the chromosomes on num_threads threads.
+        //! The result is the same as append(p, end).
+        void append(const char *p, const char *end, size_t num_threads) {
+            std::vector<fasta_record> records;
+            find_records(records, p, end);
+            append_records(records, num_threads);
+        }
 
-                g.info[size] = 0;
-                size_t i = 0;
-                for (; i != size && i != sizeof(g.name)-1 && g.info[i] != ' '; ++i) {
-                    g.name[i] = g.info[i];
+        //! Append several FASTA files, packing the chromosomes on num_threads threads.
+        //! Compressed files are decoded on the same number of threads.
+        //! The result is the same as appending the files one at a time.
+        void append(const std::vector<std::string> &filenames, size_t num_threads) {
+            using namespace boost::interprocess;
+            std::vector<fasta_record> records;
+            std::vector<std::unique_ptr<mapped_region> > regions;
+            for (size_t i = 0; i != filenames.size(); ++i) {
+                file_mapping fm(filenames[i].c_str(), read_only);
+                regions.emplace_back(new mapped_region(fm, read_only));
+                const char *p = (const char*)regions.back()->get_address();
+                const char *end = p + regions.back()->get_size();
+                if (gzip_reader::is_gzip(p, end)) {
+                    append_records(records, num_threads);
+                    records.clear();
+                    gzip_reader reader(p, end, num_threads);
+                    append(reader, num_threads);
+                } else {
+                    find_records(records, p, end);
                 }
-                g.name[i] = 0;
+            }
+            append_records(records, num_threads);
+        }
 
-                size_t num_leading_N = 0;
-                while (p != end && *p != '>' && !is_base(*p)) {
-                    num_leading_N += *p == 'N';
-                    ++p;
+        //! Append FASTA text from a gzip_reader while it decodes the rest.
+        //! Each chunk is packed as it arrives, so only a partial header line or
+        //! a run of N at the end of a chunk is kept until the next one.
+        //! Long runs of bases are packed on num_threads threads.
+        //! The result is the same as appending the uncompressed file.
+        void append(gzip_reader &reader, size_t num_threads) {
+            enum { in_header, in_leading_N, in_bases } state = in_header;
+            bool any = false;
+            std::string header;
+            std::string held;
+            chromosome chr;
+            size_t num_leading_N = 0;
+            typename string_type::piece_state pieces = str.begin_pieces();
+
+            // Finish the current chromosome, whose trailing N are in held.
+            auto end_chromosome = [&]() {
+                if (state == in_header) {
+                    parse_header(chr, header.data(), header.data() + header.size());
                 }
-                g.num_leading_N = num_leading_N;
-
-                b = p;
-                const char *e = b;
-                size_t num_trailing_N = 0;
-                while (p != end && *p != '>') {
-                    if (is_base(*p)) {
-                        e = p+1;
-                        num_trailing_N = 0;
+                if (state != in_bases) {
+                    chr.start = str.size();
+                }
+                chr.num_leading_N = num_leading_N;
+                chr.num_trailing_N = std::count(held.begin(), held.end(), 'N');
+                chr.end = str.size();
+                chromosomes.push_back(chr);
+                chr = chromosome();
+                held.clear();
+                header.clear();
+                num_leading_N = 0;
+                state = in_header;
+            };
+
+            const char *p, *end;
+            while (reader.next_chunk(p, end)) {
+                any = any || p != end;
+                while (p != end) {
+                    if (state == in_header) {
+                        // Only the start of a long header is kept.
+                        const char *e = p;
+                        while (e != end && *e != '\n' && *e != '\r') ++e;
+                        if (header.size() < sizeof(chr.info)) {
+                            header.append(p, std::min((size_t)(e - p), sizeof(chr.info) - header.size()));
+                        }
+                        p = e;
+                        if (p != end) {
+                            parse_header(chr, header.data(), header.data() + header.size());
+                            state = in_leading_N;
+                        }
+                    } else if (state == in_leading_N) {
+                        while (p != end && *p != '>' && !is_base(*p)) {
+                            num_leading_N += *p == 'N';
+                            ++p;
+                        }
+                        if (p != end && *p == '>') {
+                            end_chromosome();
+                        } else if (p != end) {
+                            chr.start = str.size();
+                            pieces = str.begin_pieces();
+                            state = in_bases;
+                        }
+                    } else {
+                        // Pack up to the last base before the next '>' and hold the rest.
+                        const char *chr_end = (const char *)memchr(p, '>', (size_t)(end - p));
+                        if (!chr_end) chr_end = end;
+                        const char *e = chr_end;
+                        while (e != p && !is_base(e[-1])) --e;
+                        if (e != p) {
+                            str.append_piece(held.data(), held.data() + held.size(), pieces);
+                            append_piece(p, e, pieces, num_threads);
+                            held.assign(e, chr_end);
+                        } else {
+                            held.append(p, chr_end);
+                        }
+                        p = chr_end;
+                        if (p != end) {
+                            end_chromosome();
+                        }
                     }
-                    num_trailing_N += *p == 'N';
-                    ++p;
                 }
-
-                g.num_trailing_N = num_trailing_N;
-
-                str.append(b, e);
-                g.end = str.size();
-
-                chromosomes.push_back(g);
+            }
+            if (any) {
+                end_chromosome();
             }
         }
-        
+
         //! Swap references.
         void swap(basic_fasta_file &rhs) {
             std::swap(str, rhs.str);
             std::swap(chromosomes, rhs.chromosomes);
             std::swap(idx, rhs.idx);
+            fm_idx.swap(rhs.fm_idx);
         }
         
         //! copy the bytes in this file to an image.
@@ -192,6 +303,24 @@ namespace boost { namespace genetics {
             wr.write(chromosomes);
             str.write_binary(wr);
             idx.write_binary(wr);
+            if (!fm_idx.empty()) {
+                fm_idx.write_binary(wr);
+            }
+        }
+
+        //! copy the bytes in this file to an image, streaming the index
+        //! into the image instead of calling make_index.
+        //! Use params.max_memory to limit the memory used by the index.
+        //! An fm_index is always built in memory, a few chromosomes at a time.
+        void write_binary(writer &wr, size_t num_indexed_chars, const index_params &params) const {
+            wr.write(chromosomes);
+            str.write_binary(wr);
+            if (params.engine == fm_engine) {
+                index_type().write_binary(wr);
+                fm_index_type(const_cast<string_type &>(str), params.sa_sample_rate, params.num_threads, fm_part_starts(params)).write_binary(wr);
+            } else {
+                index_type::write_binary(wr, str, num_indexed_chars, params);
+            }
         }
         
         //! Write as an ASCII FASTA file.
@@ -228,19 +357,53 @@ namespace boost { namespace genetics {
             for (int pass = 0; pass != max_pass; ++pass) {
                 bool reverse_complement = pass == 1;
                 std::string search_str = reverse_complement ? rev_comp(dstr) : dstr;
-                for (
-                    auto i = idx.find_inexact(search_str, 0, params, stats);
-                    i != idx.end();
-                    ++i
-                ) {
-                    fasta_result r;
-                    r.location = (size_t)i;
-                    r.reverse_complement = reverse_complement;
-                    r.distance = i.distance();
-                    if (r.distance <= params.max_distance) {
-                        result.push_back(r);
-                        if (result.size() == params.max_results) {
-                            return;
+                if (use_fm_index(params)) {
+                    if (!add_fm_results(result, search_str, reverse_complement, params)) {
+                        return;
+                    }
+                    continue;
+                }
+                check_two_stage_index();
+                auto i = idx.find_inexact(search_str, 0, params, stats);
+                if (!add_results(result, i, reverse_complement, params)) {
+                    return;
+                }
+            }
+        }
+
+        //! Search for many strings with their index lookups interleaved.
+        //! With params.always_brute_force, each batch is found in one pass over the reference.
+        void find_inexact_batch(std::vector<std::vector<fasta_result> > &results, const std::vector<std::string> &dstrs, search_params &params, search_stats &stats, size_t batch_size = 32) {
+            size_t max_pass = params.search_rev_comp ? 2 : 1;
+            std::vector<std::string> search_strs;
+            std::vector<typename index_type::iterator> iters;
+            results.resize(dstrs.size());
+            if (use_fm_index(params)) {
+                // Backtracking searches have no index lookups to interleave.
+                for (size_t j = 0; j != dstrs.size(); ++j) {
+                    find_inexact(results[j], dstrs[j], params, stats);
+                }
+                return;
+            }
+            for (size_t begin = 0; begin < dstrs.size(); begin += batch_size) {
+                size_t end = std::min(begin + batch_size, dstrs.size());
+                search_strs.resize(0);
+                for (size_t j = begin; j != end; ++j) {
+                    search_strs.push_back(dstrs[j]);
+                    if (max_pass == 2) search_strs.push_back(rev_comp(dstrs[j]));
+                }
+                if (params.always_brute_force) {
+                    add_multi_results(results, begin, end, search_strs, params, stats);
+                    continue;
+                }
+                check_two_stage_index();
+                idx.find_inexact_batch(iters, search_strs.data(), search_strs.size(), 0, params, stats);
+                for (size_t j = begin; j != end; ++j) {
+                    std::vector<fasta_result> &result = results[j];
+                    result.resize(0);
+                    for (size_t pass = 0; pass != max_pass; ++pass) {
+                        if (!add_results(result, iters[(j - begin) * max_pass + pass], pass == 1, params)) {
+                            break;
                         }
                     }
                 }
@@ -260,9 +423,30 @@ namespace boost { namespace genetics {
             return str;
         }
 
+        const index_type &get_index() const {
+            return idx;
+        }
+
+        const fm_index_type &get_fm_index() const {
+            return fm_idx;
+        }
+
+        std::string substr(size_t offset, size_t length, bool rev_comp=false) const {
+            return str.substr(offset, length, rev_comp);
+        }
+
         //! Must be called after appending FASTA data.
-        void make_index(size_t num_indexed_chars) {
-            idx = index_type(str, num_indexed_chars);
+        //! Set params.num_threads to build the index on several threads.
+        //! Set params.engine to fm_engine to build an fm_index instead.
+        //! Set params.max_memory to build the fm_index a few chromosomes at a time.
+        void make_index(size_t num_indexed_chars, const index_params &params = index_params()) {
+            if (params.engine == fm_engine) {
+                idx = index_type();
+                fm_idx = fm_index_type(str, params.sa_sample_rate, params.num_threads, fm_part_starts(params));
+            } else {
+                idx = index_type(str, num_indexed_chars, params);
+                fm_idx = fm_index_type();
+            }
         }
 
         //! Number of base pairs in this reference.
@@ -281,6 +465,238 @@ namespace boost { namespace genetics {
             }
         }
     private:
+        // A chromosome header and the extent of its bases in the FASTA image.
+        struct fasta_record {
+            chromosome chr;
+            const char *begin;
+            const char *end;
+        };
+
+        // Set the name and info of g from a header line [b, e), including the '>'.
+        static void parse_header(chromosome &g, const char *b, const char *e) {
+            size_t size = std::min(sizeof(g.info)-1, (size_t)(e-(b+1)));
+            memcpy(g.info, b+1, size);
+
+            g.info[size] = 0;
+            size_t i = 0;
+            for (; i != size && i != sizeof(g.name)-1 && g.info[i] != ' '; ++i) {
+                g.name[i] = g.info[i];
+            }
+            g.name[i] = 0;
+        }
+
+        // Parse the headers and trim the N runs at the ends of each chromosome.
+        // start and end are filled in when the bases are appended.
+        static void find_records(std::vector<fasta_record> &records, const char *p, const char *end) {
+            while (p != end) {
+                fasta_record r;
+                chromosome &g = r.chr;
+
+                //if (*p != '>') throw(std::runtime_error("bad fasta"));
+                const char *b = p;
+                while (p != end && *p != '\n' && *p != '\r') ++p;
+                parse_header(g, b, p);
+
+                // The sequence runs up to the next '>', found with memchr rather than
+                // a scan of every byte. The N runs at the ends are usually short.
+                const char *chr_end = (const char *)memchr(p, '>', (size_t)(end - p));
+                if (!chr_end) chr_end = end;
+
+                size_t num_leading_N = 0;
+                while (p != chr_end && !is_base(*p)) {
+                    num_leading_N += *p == 'N';
+                    ++p;
+                }
+                g.num_leading_N = num_leading_N;
+
+                b = p;
+                const char *e = chr_end;
+                size_t num_trailing_N = 0;
+                while (e != b && !is_base(e[-1])) {
+                    num_trailing_N += e[-1] == 'N';
+                    --e;
+                }
+                g.num_trailing_N = num_trailing_N;
+                p = chr_end;
+
+                r.begin = b;
+                r.end = e;
+                records.push_back(r);
+            }
+        }
+
+        // With several threads, each takes the next chromosome and packs it into its own segment.
+        // The segments are then joined in order, so the string, its RLE index and
+        // the chromosome table match serial ingest. This briefly needs a second
+        // copy of the packed bases.
+        void append_records(std::vector<fasta_record> &records, size_t num_threads) {
+            if (num_threads <= 1) {
+                for (size_t i = 0; i != records.size(); ++i) {
+                    fasta_record &r = records[i];
+                    r.chr.start = str.size();
+                    // Decodes the bases and finds the runs of N in one pass.
+                    str.append(r.begin, r.end);
+                    r.chr.end = str.size();
+                    chromosomes.push_back(r.chr);
+                }
+                return;
+            }
+
+            std::vector<string_type> segments(records.size());
+            std::atomic<size_t> next(0);
+            run_threads(std::min(num_threads, records.size()), [&](size_t) {
+                for (size_t i; (i = next++) < records.size(); ) {
+                    segments[i].append(records[i].begin, records[i].end);
+                }
+            });
+            for (size_t i = 0; i != records.size(); ++i) {
+                fasta_record &r = records[i];
+                r.chr.start = str.size();
+                str.append(segments[i]);
+                segments[i] = string_type();
+                r.chr.end = str.size();
+                chromosomes.push_back(r.chr);
+            }
+        }
+
+        // Append the text [b, e) of a chromosome, splitting long texts between
+        // num_threads threads. Each thread starts its random codes for N where
+        // the piece before it left off, so the result is the same as a serial append.
+        void append_piece(const char *b, const char *e, typename string_type::piece_state &pieces, size_t num_threads) {
+            const size_t min_piece_size = 0x10000;
+            size_t num_pieces = std::min(num_threads, (size_t)(e - b) / min_piece_size);
+            if (num_pieces <= 1) {
+                str.append_piece(b, e, pieces);
+                return;
+            }
+
+            std::vector<const char *> bounds(num_pieces + 1);
+            for (size_t i = 0; i <= num_pieces; ++i) {
+                bounds[i] = b + (e - b) * i / num_pieces;
+            }
+            std::vector<size_t> num_non_bases(num_pieces);
+            run_threads(num_pieces, [&](size_t i) {
+                num_non_bases[i] = string_type::count_non_bases(bounds[i], bounds[i+1]);
+            });
+
+            std::vector<string_type> segments(num_pieces);
+            std::vector<std::int32_t> random_accs(num_pieces);
+            run_threads(num_pieces, [&](size_t i) {
+                size_t skip = 0;
+                for (size_t j = 0; j != i; ++j) skip += num_non_bases[j];
+                typename string_type::piece_state state = segments[i].begin_pieces();
+                state.random_acc = string_type::skip_random(pieces.random_acc, skip);
+                segments[i].append_piece(bounds[i], bounds[i+1], state);
+                random_accs[i] = state.random_acc;
+            });
+            for (size_t i = 0; i != num_pieces; ++i) {
+                str.append_piece(segments[i], pieces);
+                segments[i] = string_type();
+            }
+            pieces.random_acc = random_accs.back();
+        }
+
+        // With a memory limit, the BWT of the fm_index is merged from parts made of
+        // whole chromosomes where they fit. Merging a part takes about
+        // 4 * sizeof(addr_type) bytes per base of the part.
+        std::vector<size_t> fm_part_starts(const index_params &params) const {
+            std::vector<size_t> starts;
+            if (params.max_memory == 0) {
+                return starts;
+            }
+            size_t max_part = std::max(params.max_memory / (4 * sizeof(typename string_type::addr_type)), (size_t)0x10000);
+            size_t part_start = 0;
+            for (size_t i = 0; i != chromosomes.size(); ++i) {
+                const chromosome &c = chromosomes[i];
+                if (c.start > part_start && c.end - part_start > max_part) {
+                    part_start = c.start;
+                    starts.push_back(part_start);
+                }
+                while (c.end - part_start > max_part) {
+                    part_start += max_part;
+                    starts.push_back(part_start);
+                }
+            }
+            return starts;
+        }
+
+        // Scan for the strings of one batch at once and add their results.
+        void add_multi_results(std::vector<std::vector<fasta_result> > &results, size_t begin, size_t end, const std::vector<std::string> &search_strs, search_params &params, search_stats &stats) {
+            size_t max_pass = params.search_rev_comp ? 2 : 1;
+            std::vector<std::vector<size_t> > hits;
+            str.find_inexact_multi(hits, search_strs, params.max_distance);
+            for (size_t j = begin; j != end; ++j) {
+                std::vector<fasta_result> &result = results[j];
+                result.resize(0);
+                for (size_t pass = 0; pass != max_pass && result.size() != params.max_results; ++pass) {
+                    size_t str_idx = (j - begin) * max_pass + pass;
+                    dna_string dna_str(search_strs[str_idx]);
+                    for (size_t location : hits[str_idx]) {
+                        fasta_result r;
+                        r.location = location;
+                        r.reverse_complement = pass == 1;
+                        r.distance = str.distance(location, dna_str.size(), dna_str);
+                        stats.compares_done++;
+                        result.push_back(r);
+                        if (result.size() == params.max_results) {
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        // Add the results from a search, returning false if we have max_results.
+        bool add_results(std::vector<fasta_result> &result, typename index_type::iterator &i, bool reverse_complement, search_params &params) {
+            for (; i != idx.end(); ++i) {
+                fasta_result r;
+                r.location = (size_t)i;
+                r.reverse_complement = reverse_complement;
+                r.distance = i.distance();
+                r.cigar = i.cigar();
+                if (r.distance <= params.max_distance) {
+                    result.push_back(r);
+                    if (result.size() == params.max_results) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        }
+
+        // A file indexed with only the fm engine is searched with it,
+        // whatever params.engine says.
+        bool use_fm_index(const search_params &params) const {
+            return params.engine == fm_engine || (idx.empty() && !fm_idx.empty());
+        }
+
+        void check_two_stage_index() const {
+            if (idx.empty()) {
+                throw std::runtime_error("find_inexact(): no two_stage_index (call make_index first)");
+            }
+        }
+
+        // Search the fm_index and add the results, returning false if we have max_results.
+        bool add_fm_results(std::vector<fasta_result> &result, const std::string &search_str, bool reverse_complement, search_params &params) {
+            if (fm_idx.empty()) {
+                throw std::runtime_error("find_inexact(): no fm_index (index the reference with the fm engine)");
+            }
+            if (params.max_gap != 0) {
+                throw std::invalid_argument("find_inexact(): the fm engine does not find gaps");
+            }
+            std::vector<size_t> locations;
+            fm_idx.find_inexact(locations, search_str, params.max_distance, params.max_results - result.size(), params.max_bucket_size);
+            dna_string dna_str(search_str);
+            for (size_t location : locations) {
+                fasta_result r;
+                r.location = location;
+                r.reverse_complement = reverse_complement;
+                r.distance = str.distance(location, dna_str.size(), dna_str);
+                result.push_back(r);
+            }
+            return result.size() != params.max_results;
+        }
+
         // Note: for these data members, order matters because the map constructor requires this.
 
         //! Empty chromosome for out-of-range queries.
@@ -294,6 +710,9 @@ namespace boost { namespace genetics {
 
         //! Index on str.
         index_type idx;
+
+        //! FM index on str, if indexed with the fm engine.
+        fm_index_type fm_idx;
     };
 
     //! This container is a writable type for conversion from ASCII files.
@@ -302,6 +721,18 @@ namespace boost { namespace genetics {
     //! This container is read only for mapped files.
     typedef basic_fasta_file<mapped_traits> mapped_fasta_file;
 
+    //! Writable container with a compressed index.
+    typedef basic_fasta_file<compressed_traits> compressed_fasta_file;
+
+    //! Read only container for mapped files with a compressed index.
+    typedef basic_fasta_file<compressed_mapped_traits> compressed_mapped_fasta_file;
+
+    //! Writable container for references of more than 4G bases.
+    typedef basic_fasta_file<large_unmapped_traits> large_fasta_file;
+
+    //! Read only container for mapped references of more than 4G bases.
+    typedef basic_fasta_file<large_mapped_traits> large_mapped_fasta_file;
+
 } }
 
 #endif
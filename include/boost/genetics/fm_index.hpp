@@ -9,6 +9,7 @@
 #include <stdexcept>
 #include <type_traits>
 #include <limits>
+#include <utility>
 #include <boost/genetics/dna_string.hpp>
 
 namespace boost { namespace genetics {
@@ -33,6 +34,22 @@ namespace boost { namespace genetics {
 
         typedef typename Traits::SuffixArrayType addr_array_type;
         typedef typename Traits::SuffixArrayType::value_type addr_type;
+        typedef typename Traits::DnaArrayType occ_array_type;
+
+        //! The occurrence table is made of 64 byte lines. Each line has the
+        //! number of A, C, G and T chars in the BWT before the line followed
+        //! by the BWT words themselves, so a rank query reads one cache line.
+        static const size_t line_words = 8;
+        static const size_t count_words = sizeof(addr_type) * 4 / sizeof(uint64_t);
+        static const size_t bwt_words = line_words - count_words;
+        static const size_t bases_per_line = bwt_words * dna_string_type::bases_per_value;
+
+        //! The suffix array marks are 64 byte lines of the number of sampled
+        //! rows before the line and one bit for each row of the line.
+        static const size_t rows_per_line = (line_words - 1) * 64;
+
+        //! A range of rows [first, last) of the suffix array.
+        typedef std::pair<size_t, size_t> interval_type;
 
         //! \brief Construct an empty suffix array.
         basic_fm_index(
@@ -41,15 +58,31 @@ namespace boost { namespace genetics {
         
         //! \brief Write to a binary stream for subsequent mapping.
         void write_binary(writer &wr) const {
-            wr.write(bwt_);
+            wr.write64(num_rows_);
             wr.write64(inverse_sa0_);
+
+            // Write the lines without the alignment slack, aligned to 64 bytes.
+            size_t size = num_lines() * line_words;
+            uint64_t *dest = wr.template alloc_vector<uint64_t>(size, line_words * sizeof(uint64_t));
+            if (dest) std::copy(lines(), lines() + size, dest);
+
+            wr.write64(sa_sample_rate_);
+            size = num_mark_lines() * line_words;
+            dest = wr.template alloc_vector<uint64_t>(size, line_words * sizeof(uint64_t));
+            if (dest) std::copy(mark_lines(), mark_lines() + size, dest);
+            wr.write(sa_samples_);
         }
 
         //! \brief rvalue move operator
         basic_fm_index &operator =(basic_fm_index &&rhs) {
             string_ = rhs.string_;
-            bwt_ = std::move(rhs.bwt_);
+            num_rows_ = rhs.num_rows_;
             inverse_sa0_ = rhs.inverse_sa0_;
+            occ_ = std::move(rhs.occ_);
+            sa_sample_rate_ = rhs.sa_sample_rate_;
+            sa_marks_ = std::move(rhs.sa_marks_);
+            sa_samples_ = std::move(rhs.sa_samples_);
+            cumulative_index_ = rhs.cumulative_index_;
             return *this;
         }
 
@@ -62,35 +95,77 @@ namespace boost { namespace genetics {
             typename Mapper::is_mapper *p=0
         ) :
             string_(&string),
-            bwt_(map),
-            inverse_sa0_((size_t)map.read64())
+            num_rows_((size_t)map.read64()),
+            inverse_sa0_((size_t)map.read64()),
+            occ_(map, line_words * sizeof(uint64_t)),
+            sa_sample_rate_((size_t)map.read64()),
+            sa_marks_(map, line_words * sizeof(uint64_t)),
+            sa_samples_(map)
         {
+            if (occ_.size() != num_lines() * line_words) {
+                throw std::runtime_error("mapped file: occurrence table size mismatch (check file format)");
+            }
+            if (sa_marks_.size() != num_mark_lines() * line_words) {
+                throw std::runtime_error("mapped file: suffix array marks size mismatch (check file format)");
+            }
+            if (!empty()) make_cumulative_index();
         }
         
         //! \brief Construct an FM index for a dna string https://en.wikipedia.org/wiki/FM-index
+        //! \param sa_sample_rate keep the suffix array entry for every sa_sample_rate
+        //! positions of the string. Larger rates use less memory but locate() is slower.
+        //! \param num_threads number of threads used to build the BWT.
+        //! \param part_starts if not empty, build the BWT by merging parts of the string
+        //! starting at these positions (eg. chromosomes) to bound the memory used.
         basic_fm_index(
-            string_type &str
-        ) : string_(&str) {
-            str.bwt(bwt_, inverse_sa0_);
+            string_type &str,
+            size_t sa_sample_rate = 32,
+            size_t num_threads = 1,
+            const std::vector<size_t> &part_starts = std::vector<size_t>()
+        ) : string_(&str), sa_sample_rate_(sa_sample_rate) {
+            if (sa_sample_rate == 0) {
+                throw std::invalid_argument("fm_index: sa_sample_rate must be at least one");
+            }
+            // The BWT is kept only in the lines of the occurrence table.
+            dna_string_type bwt;
+            if (part_starts.empty()) {
+                str.bwt(bwt, inverse_sa0_, num_threads);
+            } else {
+                str.bwt(bwt, inverse_sa0_, part_starts, num_threads);
+            }
+            num_rows_ = bwt.size();
+            make_occ(bwt);
+            bwt = dna_string_type();
+            make_sampled_sa();
         }
 
         //! Swap two suffix arrays
         void swap(basic_fm_index &rhs) {
             std::swap(string_, rhs.string_);
-            bwt_.swap(rhs.bwt_);
+            std::swap(num_rows_, rhs.num_rows_);
             std::swap(inverse_sa0_, rhs.inverse_sa0_);
+            occ_.swap(rhs.occ_);
+            std::swap(sa_sample_rate_, rhs.sa_sample_rate_);
+            sa_marks_.swap(rhs.sa_marks_);
+            sa_samples_.swap(rhs.sa_samples_);
+            std::swap(cumulative_index_, rhs.cumulative_index_);
         }
 
         //! Write the suffix array to a stream for debugging.
         template <class charT, class traits>
         void write_ascii(std::basic_ostream<charT, traits>& os) const {
-            os << "bwt = " << bwt_ << "\n";
+            os << "bwt = " << bwt() << "\n";
             os << "inverse_sa0 = " + inverse_sa0_ << "\n";
         }
         
-        //! Get the Burrows Wheeler transform
-        const dna_string_type &bwt() const {
-            return bwt_;
+        //! Get a copy of the Burrows Wheeler transform from the occurrence table.
+        basic_dna_string<unmapped_traits> bwt() const {
+            basic_dna_string<unmapped_traits> result;
+            result.resize(num_rows_);
+            for (size_t row = 0; row != num_rows_; ++row) {
+                result.set_code(row, bwt_code(row));
+            }
+            return result;
         }
         
         //! Get the Burrows Wheeler transform '$' index
@@ -98,36 +173,478 @@ namespace boost { namespace genetics {
             return inverse_sa0_;
         }
         
+        //! Get the first row of the suffix array starting with each of '$', 'A', 'C', 'G', 'T'
+        //! and the total number of rows.
+        const std::array<addr_type, 6> &cumulative_index() const {
+            return cumulative_index_;
+        }
+
+        //! Number of times code (0-3 for A, C, G and T) occurs in the BWT before row pos.
+        //! The '$' row is not counted.
+        size_t occ(int code, size_t pos) const {
+            const uint64_t *line = lines() + (pos / bases_per_line) * line_words;
+            size_t count = (size_t)((const addr_type *)line)[code];
+            size_t bases = pos % bases_per_line;
+
+            // Compare each base with the code and count the pairs of bits that differ.
+            bool cpu_has_popcnt = has_popcnt();
+            const size_t bpv = dna_string_type::bases_per_value;
+            uint64_t rep = (uint64_t)code * 0x5555555555555555ull;
+            const uint64_t *w = line + count_words;
+            for (size_t i = 0; i != bases / bpv; ++i) {
+                count += bpv - count_word(w[i] ^ rep, cpu_has_popcnt);
+            }
+            if (bases % bpv) {
+                uint64_t mask = ~(uint64_t)0 << ((bpv - bases % bpv) * 2);
+                count += bases % bpv - count_word((w[bases / bpv] ^ rep) & mask, cpu_has_popcnt);
+            }
+            return count - (code == 0 && pos > inverse_sa0_);
+        }
+
+        //! Find the rows of the suffix array that start with str by backward search.
+        //! The number of matches is last - first.
+        template <class StringTraits>
+        interval_type backward_search(const basic_dna_string<StringTraits> &str) const {
+            size_t first = 0;
+            size_t last = num_rows_;
+            for (size_t i = str.size(); i != 0 && first != last; --i) {
+                int code = str.get_code(i - 1);
+                first = cumulative_index_[code + 1] + occ(code, first);
+                last = cumulative_index_[code + 1] + occ(code, last);
+            }
+            return interval_type(first, last);
+        }
+
+        //! Find the rows of the suffix array that start with str by backward search.
+        //! Strings containing chars other than A, C, G and T do not match.
+        interval_type backward_search(const std::string &str) const {
+            if (str.find_first_not_of("ACGT") != std::string::npos) {
+                return interval_type(0, 0);
+            }
+            return backward_search(basic_dna_string<unmapped_traits>(str));
+        }
+
+        //! Get the suffix array sample rate.
+        size_t sa_sample_rate() const {
+            return sa_sample_rate_;
+        }
+
+        //! Row of the suffix array for the position before that of row (the LF mapping).
+        size_t lf(size_t row) const {
+            int code = bwt_code(row);
+            return cumulative_index_[code + 1] + occ(code, row);
+        }
+
+        //! Position in the string of a row of the suffix array.
+        //! Walks back through the BWT to the nearest sampled position,
+        //! taking fewer than sa_sample_rate steps.
+        size_t locate(size_t row) const {
+            size_t steps = 0;
+            for (;;) {
+                const uint64_t *line = mark_lines() + (row / rows_per_line) * line_words;
+                size_t bit = row % rows_per_line;
+                uint64_t word = line[1 + bit / 64];
+                if ((word >> (bit % 64)) & 1) {
+                    size_t rank = (size_t)line[0];
+                    for (size_t i = 0; i != bit / 64; ++i) {
+                        rank += popcnt(line[1 + i], has_popcnt());
+                    }
+                    rank += popcnt(word & (((uint64_t)1 << (bit % 64)) - 1), has_popcnt());
+                    return (size_t)sa_samples_[rank] + steps;
+                }
+                row = lf(row);
+                ++steps;
+            }
+        }
+
+        //! Add the sorted positions of the rows in an interval to positions.
+        void locate(std::vector<size_t> &positions, const interval_type &rows) const {
+            size_t begin = positions.size();
+            for (size_t row = rows.first; row < rows.second; ++row) {
+                positions.push_back(locate(row));
+            }
+            std::sort(positions.begin() + begin, positions.end());
+        }
+
+        //! Count the occurrences of str in the string.
+        size_t count(const std::string &str) const {
+            interval_type i = backward_search(str);
+            return i.second - i.first;
+        }
+
+        //! \brief Find the sorted positions of str with up to max_distance substitutions.
+        //! Chars other than A, C, G and T are always errors.
+        //! If the index has its string, str is split into max_distance+1 pieces, one
+        //! of which must match exactly. The hits of each piece are located and checked
+        //! against the string. If any piece has more than max_seed_hits hits, or there
+        //! is no string, the search backtracks from the end of str instead.
+        //! \param positions set to the positions of the matches.
+        //! \param str string to search for.
+        //! \param max_distance number of allowable errors in the search.
+        //! \param max_results keep only the first (lowest) max_results positions.
+        //! \param max_seed_hits backtrack if any piece has more hits than this.
+        void find_inexact(std::vector<size_t> &positions, const std::string &str, size_t max_distance = 0, size_t max_results = ~(size_t)0, size_t max_seed_hits = 100) const {
+            positions.clear();
+            if (empty()) {
+                return;
+            }
+
+            std::vector<int> codes(str.size());
+            for (size_t i = 0; i != str.size(); ++i) {
+                const char *p = strchr("ACGT", str[i]);
+                codes[i] = p && str[i] ? (int)(p - "ACGT") : -1;
+            }
+
+            if (!find_from_seeds(positions, codes, max_distance, max_seed_hits)) {
+                backtrack(positions, codes, max_distance);
+            }
+            // Sort before truncating, so the lowest positions are kept.
+            std::sort(positions.begin(), positions.end());
+            positions.erase(std::unique(positions.begin(), positions.end()), positions.end());
+            if (positions.size() > max_results) {
+                positions.resize(max_results);
+            }
+        }
+
+        //! Recover the indexed string from the BWT. The sampled suffix array
+        //! rows are the starting points of segments that are expanded on several threads.
+        void ibwt(dna_string_type &result, size_t num_threads = 1) const {
+            if (empty()) {
+                result.resize(0);
+                return;
+            }
+            size_t str_size = num_rows_ - 1;
+            std::vector<typename dna_string_type::addr_type> checkpoints((str_size + sa_sample_rate_ - 1) / sa_sample_rate_);
+            // The samples are in row order, so visit the marked rows in order.
+            const uint64_t *marks = mark_lines();
+            size_t rank = 0;
+            for (size_t line = 0; line != num_mark_lines(); ++line) {
+                for (size_t j = 1; j != line_words; ++j) {
+                    for (uint64_t word = marks[line * line_words + j]; word; word &= word - 1) {
+                        size_t bit = popcnt((word & (~word + 1)) - 1, has_popcnt());
+                        size_t pos = sa_samples_[rank++];
+                        if (pos != str_size) {
+                            checkpoints[pos / sa_sample_rate_] = (typename dna_string_type::addr_type)(line * rows_per_line + (j - 1) * 64 + bit);
+                        }
+                    }
+                }
+            }
+
+            // Walk back from the row at the end of each segment with the LF mapping.
+            // Each thread takes groups of bases_per_value segments, so that
+            // threads never write to the same word of the result.
+            result.resize(0);
+            result.resize(str_size);
+            const size_t bpv = dna_string_type::bases_per_value;
+            size_t num_segments = checkpoints.size();
+            size_t num_groups = (num_segments + bpv - 1) / bpv;
+            num_threads = std::max((size_t)1, std::min(num_threads, num_groups));
+            run_threads(num_threads, [&](size_t tid) {
+                size_t seg_end = std::min(num_segments, num_groups * (tid + 1) / num_threads * bpv);
+                for (size_t seg = num_groups * tid / num_threads * bpv; seg < seg_end; ++seg) {
+                    size_t begin = seg * sa_sample_rate_;
+                    size_t end = std::min(str_size, begin + sa_sample_rate_);
+                    size_t row = end == str_size ? 0 : (size_t)checkpoints[end / sa_sample_rate_];
+                    for (size_t pos = end; pos-- != begin; ) {
+                        result.set_code(pos, bwt_code(row));
+                        row = lf(row);
+                    }
+                }
+            });
+        }
+
+        //! True if the index has not been built.
+        bool empty() const {
+            return num_rows_ == 0;
+        }
+
         //! Used for unit testing to check the integrity of the algorithms.
         bool verify() const {
-            if (bwt_.size() != string_->size() + 1) {
+            std::vector<size_t> positions;
+            locate(positions, interval_type(0, num_rows_));
+            for (size_t i = 0; i != positions.size(); ++i) {
+                if (positions[i] != i) {
+                    std::cerr << "fm_index verify fail: locate does not give every position\n";
+                    return false;
+                }
+            }
+
+            if (num_rows_ != string_->size() + 1) {
                 std::cerr << "fm_index verify fail: wrong bwt size\n";
                 return false;
             }
 
             dna_string_type ibwt;
-            bwt_.ibwt(ibwt, inverse_sa0_);
+            this->ibwt(ibwt);
             
             if (ibwt != *string_) {
                 std::cerr << "fm_index verify fail: inverse bwt not same as string\n";
                 return false;
             }
+
+            std::array<size_t, 4> counts = {{ 0, 0, 0, 0 }};
+            for (size_t i = 0; i <= num_rows_; ++i) {
+                for (int code = 0; code != 4; ++code) {
+                    if (occ(code, i) != counts[code]) {
+                        std::cerr << "fm_index verify fail: bad occurrence count\n";
+                        return false;
+                    }
+                }
+                if (i < num_rows_ && i != inverse_sa0_) {
+                    counts[bwt_code(i)]++;
+                }
+            }
             return true;
         }
     private:
+        // Locate the exact hits of max_distance+1 pieces of codes and check
+        // each possible match against the string, returning false if any
+        // piece has too many hits to be worth locating.
+        bool find_from_seeds(std::vector<size_t> &positions, const std::vector<int> &codes, size_t max_distance, size_t max_seed_hits) const {
+            size_t length = codes.size();
+            size_t num_pieces = max_distance + 1;
+            size_t str_size = num_rows_ - 1;
+            if (string_ == nullptr || length < num_pieces || length > str_size) {
+                return false;
+            }
+
+            std::vector<interval_type> intervals(num_pieces);
+            for (size_t piece = 0; piece != num_pieces; ++piece) {
+                size_t first = 0, last = num_rows_;
+                for (size_t i = length * (piece + 1) / num_pieces; i != length * piece / num_pieces && first != last; --i) {
+                    int code = codes[i - 1];
+                    if (code < 0) {
+                        last = first;
+                    } else {
+                        first = cumulative_index_[code + 1] + occ(code, first);
+                        last = cumulative_index_[code + 1] + occ(code, last);
+                    }
+                }
+                if (last - first > max_seed_hits) {
+                    return false;
+                }
+                intervals[piece] = interval_type(first, last);
+            }
+
+            std::vector<size_t> candidates;
+            for (size_t piece = 0; piece != num_pieces; ++piece) {
+                size_t offset = length * piece / num_pieces;
+                for (size_t row = intervals[piece].first; row != intervals[piece].second; ++row) {
+                    size_t pos = locate(row);
+                    if (pos >= offset && pos - offset <= str_size - length) {
+                        candidates.push_back(pos - offset);
+                    }
+                }
+            }
+            std::sort(candidates.begin(), candidates.end());
+            candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+            for (size_t pos : candidates) {
+                size_t errors = 0;
+                for (size_t i = 0; i != length && errors <= max_distance; ++i) {
+                    errors += codes[i] != string_->get_code(pos + i);
+                }
+                if (errors <= max_distance) {
+                    positions.push_back(pos);
+                }
+            }
+            return true;
+        }
+
+        // Backtrack from the end of codes, trying every base at each position
+        // while errors remain. The search is pruned with a lower bound on the
+        // errors in the unsearched start of codes: each piece of it which
+        // does not occur in the string at all needs at least one error.
+        void backtrack(std::vector<size_t> &positions, const std::vector<int> &codes, size_t max_distance) const {
+            size_t length = codes.size();
+
+            // Split codes from the end into the shortest pieces that do not occur.
+            // min_errors[k] is the number of pieces inside the first k chars.
+            std::vector<size_t> min_errors(length + 1);
+            {
+                size_t first = 0, last = num_rows_, piece_end = length;
+                std::vector<size_t> piece_ends;
+                for (size_t i = length; i != 0; --i) {
+                    int code = codes[i - 1];
+                    if (code >= 0) {
+                        first = cumulative_index_[code + 1] + occ(code, first);
+                        last = cumulative_index_[code + 1] + occ(code, last);
+                    }
+                    if (code < 0 || first >= last) {
+                        piece_ends.push_back(piece_end);
+                        piece_end = i - 1;
+                        first = 0;
+                        last = num_rows_;
+                    }
+                }
+                for (size_t end : piece_ends) {
+                    for (size_t k = end; k <= length; ++k) {
+                        min_errors[k]++;
+                    }
+                }
+            }
+
+            // Depth first search of the prefixes of suffixes of the string,
+            // trying the matching base last so that it is searched first.
+            struct state { size_t length, errors, first, last; };
+            std::vector<state> stack;
+            std::vector<interval_type> intervals;
+            stack.push_back(state{ length, max_distance, 0, num_rows_ });
+            while (!stack.empty()) {
+                state s = stack.back();
+                stack.pop_back();
+                if (min_errors[s.length] > s.errors) {
+                    continue;
+                }
+                if (s.length == 0) {
+                    intervals.push_back(interval_type(s.first, s.last));
+                    continue;
+                }
+                auto push = [&](int code, size_t errors) {
+                    size_t first = cumulative_index_[code + 1] + occ(code, s.first);
+                    size_t last = cumulative_index_[code + 1] + occ(code, s.last);
+                    if (first < last) {
+                        stack.push_back(state{ s.length - 1, errors, first, last });
+                    }
+                };
+                int match = codes[s.length - 1];
+                for (int code = 0; code != 4 && s.errors != 0; ++code) {
+                    if (code != match) push(code, s.errors - 1);
+                }
+                if (match >= 0) push(match, s.errors);
+            }
+
+            for (auto &i : intervals) {
+                locate(positions, i);
+            }
+        }
+
+        // The code of the BWT at row, read from its line of the occurrence table.
+        int bwt_code(size_t row) const {
+            const size_t bpv = dna_string_type::bases_per_value;
+            const uint64_t *line = lines() + (row / bases_per_line) * line_words;
+            size_t base = row % bases_per_line;
+            return (int)(line[count_words + base / bpv] >> ((bpv - 1 - base % bpv) * 2)) & 3;
+        }
+
+        // An empty (default constructed) index has no lines.
+        size_t num_lines() const {
+            return num_rows_ ? num_rows_ / bases_per_line + 1 : 0;
+        }
+
+        // The first line. Unmapped tables have spare words so that
+        // the lines can start on a 64 byte boundary.
+        const uint64_t *lines() const {
+            return aligned_lines(occ_, num_lines());
+        }
+
+        static const uint64_t *aligned_lines(const occ_array_type &array, size_t num_lines) {
+            size_t spare = array.size() - num_lines * line_words;
+            size_t misalignment = (0 - (size_t)array.data()) / sizeof(uint64_t) % line_words;
+            return array.data() + std::min(spare, misalignment);
+        }
+
+        // Interleave the BWT with running counts of each char.
+        void make_occ(const dna_string_type &bwt) {
+            const auto &values = bwt.get_values();
+            occ_.resize(0);
+            occ_.resize(num_lines() * line_words + line_words - 1);
+            uint64_t *line = (uint64_t *)lines();
+            std::array<size_t, 4> counts = {{ 0, 0, 0, 0 }};
+            for (size_t i = 0; i != num_lines(); ++i, line += line_words) {
+                for (int code = 0; code != 4; ++code) {
+                    ((addr_type *)line)[code] = (addr_type)counts[code];
+                }
+                for (size_t j = 0; j != bwt_words; ++j) {
+                    size_t v = i * bwt_words + j;
+                    line[count_words + j] = v < values.size() ? values[v] : 0;
+                }
+                size_t end = std::min(num_rows_, (i + 1) * bases_per_line);
+                for (size_t pos = i * bases_per_line; pos < end; ++pos) {
+                    counts[bwt.get_code(pos)]++;
+                }
+            }
+            make_cumulative_index();
+        }
+
+        size_t num_mark_lines() const {
+            return num_rows_ ? num_rows_ / rows_per_line + 1 : 0;
+        }
+
+        const uint64_t *mark_lines() const {
+            return aligned_lines(sa_marks_, num_mark_lines());
+        }
+
+        // Walk back through the whole BWT from the '$' suffix, marking the rows
+        // of sampled positions and keeping their positions in row order.
+        void make_sampled_sa() {
+            std::vector<std::pair<addr_type, addr_type> > samples;
+            samples.reserve(num_rows_ / sa_sample_rate_ + 1);
+            size_t row = 0;
+            for (size_t pos = num_rows_ - 1; ; --pos) {
+                if (pos % sa_sample_rate_ == 0) {
+                    samples.emplace_back((addr_type)row, (addr_type)pos);
+                }
+                if (pos == 0) break;
+                row = lf(row);
+            }
+            std::sort(samples.begin(), samples.end());
+
+            sa_marks_.resize(0);
+            sa_marks_.resize(num_mark_lines() * line_words + line_words - 1);
+            uint64_t *marks = (uint64_t *)mark_lines();
+            sa_samples_.resize(samples.size());
+            for (size_t i = 0; i != samples.size(); ++i) {
+                size_t row = samples[i].first;
+                marks[(row / rows_per_line) * line_words + 1 + row % rows_per_line / 64] |= (uint64_t)1 << (row % 64);
+                sa_samples_[i] = samples[i].second;
+            }
+            uint64_t total = 0;
+            for (size_t i = 0; i != num_mark_lines(); ++i) {
+                uint64_t *line = marks + i * line_words;
+                line[0] = total;
+                for (size_t j = 1; j != line_words; ++j) {
+                    total += popcnt(line[j], has_popcnt());
+                }
+            }
+        }
+
+        // Find the first row starting with each char from the total counts.
+        void make_cumulative_index() {
+            size_t total = 1;
+            cumulative_index_[0] = 0;
+            for (int code = 0; code != 4; ++code) {
+                cumulative_index_[code + 1] = (addr_type)total;
+                total += occ(code, num_rows_);
+            }
+            cumulative_index_[5] = (addr_type)total;
+        }
+
         // Note: order matters at the map constructor builds these in a certain order.
         
         // a reference to the dna_string.
         string_type *string_ = nullptr;
 
-        // The Burrows Wheeler transform of the string.
-        dna_string_type bwt_;
+        // The number of rows of the suffix array, one more than the size of the string.
+        size_t num_rows_ = 0;
 
         // The Burrows Wheeler transform start address.
         size_t inverse_sa0_ = 0;
-        
+
+        // The BWT interleaved with rank checkpoints, line_words at a time.
+        occ_array_type occ_;
+
+        // Every sa_sample_rate_ positions of the string have a suffix array sample.
+        size_t sa_sample_rate_ = 32;
+
+        // One bit for each row of the suffix array that has a sample, with rank checkpoints.
+        occ_array_type sa_marks_;
+
+        // The positions of the sampled rows, in row order.
+        addr_array_type sa_samples_;
+
         // The cumulative index of '$', 'A', 'C', 'G', 'T'
-        std::array<addr_type, 6> cumulative_index_;
+        std::array<addr_type, 6> cumulative_index_ = {{ 0, 0, 0, 0, 0, 0 }};
     };
 
     //! \brief Unmapped suffix array, typically used for construction.
@@ -136,6 +653,12 @@ namespace boost { namespace genetics {
     //! \brief Mapped suffix array, typically used for high performance loading.
     typedef basic_fm_index<mapped_traits> mapped_fm_index;
 
+    //! \brief Unmapped suffix array with 64 bit addresses for more than 4G bases.
+    typedef basic_fm_index<large_unmapped_traits> large_fm_index;
+
+    //! \brief Mapped suffix array with 64 bit addresses.
+    typedef basic_fm_index<large_mapped_traits> large_mapped_fm_index;
+
     //! \brief Stream write operator
     template <class charT, class traits, class Traits>
     std::basic_ostream<charT, traits>&
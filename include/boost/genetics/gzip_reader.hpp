@@ -0,0 +1,311 @@
+// Copyright Andy Thomason 2016
+// Distributed under the Boost Software License, Version 1.0. (See
+// accompanying file LICENSE_1_0.txt or copy at
+// http://www.boost.org/LICENSE_1_0.txt)
+
+#ifndef BOOST_GENETICS_GZIP_READER
+#define BOOST_GENETICS_GZIP_READER
+
+#include <cstring>
+#include <stdexcept>
+#include <exception>
+#include <vector>
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <limits>
+#include <boost/genetics/utils.hpp>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+// Define BOOST_GENETICS_HAS_ZLIB to 1 and link with zlib to read gzip
+// and BGZF files. Without it, gzip_reader throws on compressed input.
+#ifndef BOOST_GENETICS_HAS_ZLIB
+    #define BOOST_GENETICS_HAS_ZLIB 0
+#endif
+
+#if BOOST_GENETICS_HAS_ZLIB
+    #include <zlib.h>
+#endif
+
+namespace boost { namespace genetics {
+    //! \brief Decompress a gzip file on background threads.
+
+    //! The caller reads the text with next_chunk() or read() while the
+    //! threads decode the blocks that follow, so decoding overlaps with
+    //! whatever is done with the text.
+    //!
+    //! BGZF files, such as those made by bgzip, are a series of gzip
+    //! members of up to 64k each. Their members are decoded in parallel
+    //! on num_threads threads. Other gzip files are decoded on one thread.
+    class gzip_reader {
+    public:
+        //! Decode the gzip image [begin, end), which must outlive the reader.
+        gzip_reader(const char *begin, const char *end, size_t num_threads = 1) {
+            start(begin, end, num_threads);
+        }
+
+        //! Map and decode a gzip file.
+        gzip_reader(const std::string &filename, size_t num_threads = 1) {
+            using namespace boost::interprocess;
+            file_mapping fm(filename.c_str(), read_only);
+            region.reset(new mapped_region(fm, read_only));
+            const char *p = (const char*)region->get_address();
+            start(p, p + region->get_size(), num_threads);
+        }
+
+        gzip_reader(const gzip_reader &rhs) = delete;
+        gzip_reader &operator=(const gzip_reader &rhs) = delete;
+
+        ~gzip_reader() {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            changed.notify_all();
+            for (auto &t : threads) {
+                t.join();
+            }
+        }
+
+        //! True if [begin, end) starts with the gzip magic number.
+        static bool is_gzip(const char *begin, const char *end) {
+            return end - begin >= 2 && (uint8_t)begin[0] == 0x1f && (uint8_t)begin[1] == 0x8b;
+        }
+
+        //! Get the next chunk of text, valid until the next call.
+        //! Returns false at the end of the data.
+        bool next_chunk(const char *&b, const char *&e) {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (holding) {
+                // The caller is done with the last chunk, so its slot can be reused.
+                slots[num_consumed % slots.size()].ready = false;
+                ++num_consumed;
+                holding = false;
+                changed.notify_all();
+            }
+            slot &s = slots[num_consumed % slots.size()];
+            changed.wait(lock, [&] { return error || s.ready || num_consumed == num_chunks; });
+            if (error) {
+                std::rethrow_exception(error);
+            }
+            if (num_consumed == num_chunks) {
+                return false;
+            }
+            holding = true;
+            b = s.data.data();
+            e = b + s.size;
+            return true;
+        }
+
+        //! Copy up to size bytes of text to dest.
+        //! Returns the number of bytes copied, which is zero at the end.
+        size_t read(char *dest, size_t size) {
+            size_t done = 0;
+            while (done != size) {
+                if (read_ptr == read_end && !next_chunk(read_ptr, read_end)) {
+                    break;
+                }
+                size_t n = std::min(size - done, (size_t)(read_end - read_ptr));
+                memcpy(dest + done, read_ptr, n);
+                read_ptr += n;
+                done += n;
+            }
+            return done;
+        }
+    private:
+        // Decoded text is passed to the reader through a ring of slots.
+        struct slot {
+            std::vector<char> data;
+            size_t size = 0;
+            bool ready = false;
+        };
+
+        // Each chunk of a BGZF file is up to this many members (about 1MB of text).
+        static const size_t members_per_chunk = 16;
+
+        // Plain gzip files are decoded this many bytes at a time.
+        static const size_t chunk_size = 0x100000;
+
+        void start(const char *begin, const char *end, size_t num_threads) {
+            if (!is_gzip(begin, end)) {
+                throw std::invalid_argument("not a gzip file");
+            }
+            #if BOOST_GENETICS_HAS_ZLIB
+                num_threads = std::max((size_t)1, num_threads);
+                find_bgzf_members(begin, end);
+                if (members.empty()) {
+                    // One thread inflates the whole stream.
+                    slots.resize(4);
+                    threads.emplace_back([=]() { run(&gzip_reader::inflate_stream, begin, end); });
+                } else {
+                    num_chunks = (members.size() + members_per_chunk - 2) / members_per_chunk;
+                    slots.resize(num_threads * 2 + 2);
+                    for (size_t i = 0; i != num_threads; ++i) {
+                        threads.emplace_back([=]() { run(&gzip_reader::inflate_members, begin, end); });
+                    }
+                }
+            #else
+                (void)num_threads;
+                throw std::runtime_error("gzip input needs BOOST_GENETICS_HAS_ZLIB and zlib");
+            #endif
+        }
+
+        #if BOOST_GENETICS_HAS_ZLIB
+            // Run a decoder, passing any error to the reader.
+            void run(void (gzip_reader::*fn)(const char *, const char *), const char *begin, const char *end) {
+                try {
+                    (this->*fn)(begin, end);
+                } catch(...) {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    if (!error) error = std::current_exception();
+                    changed.notify_all();
+                }
+            }
+
+            // Wait for the slot of chunk to be free.
+            // Returns nullptr if the reader is being destroyed.
+            slot *wait_for_slot(size_t chunk) {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return stopping || chunk < num_consumed + slots.size(); });
+                return stopping ? nullptr : &slots[chunk % slots.size()];
+            }
+
+            void publish(slot *s, size_t size) {
+                std::unique_lock<std::mutex> lock(mutex);
+                s->size = size;
+                s->ready = true;
+                changed.notify_all();
+            }
+
+            // Record the members of a BGZF file. Each has a "BC" extra field
+            // giving its size. members stays empty for other gzip files.
+            void find_bgzf_members(const char *begin, const char *end) {
+                const uint8_t *p = (const uint8_t *)begin;
+                const uint8_t *e = (const uint8_t *)end;
+                while (p != e) {
+                    if (e - p < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || (p[3] & 4) == 0 ||
+                        p[10] != 6 || p[11] != 0 || p[12] != 'B' || p[13] != 'C' || p[14] != 2 || p[15] != 0
+                    ) {
+                        members.clear();
+                        return;
+                    }
+                    size_t size = (p[16] | p[17] << 8) + 1;
+                    if (size < 26 || size > (size_t)(e - p)) {
+                        throw std::runtime_error("bad BGZF block size");
+                    }
+                    members.push_back((const char *)p);
+                    p += size;
+                }
+                members.push_back(end);
+            }
+
+            // Take the next chunk of members until there are none left.
+            void inflate_members(const char *, const char *) {
+                z_stream zs = {};
+                if (inflateInit2(&zs, -MAX_WBITS) != Z_OK) {
+                    throw std::runtime_error("inflateInit2 failed");
+                }
+                std::unique_ptr<z_stream, int (*)(z_stream *)> zs_guard(&zs, inflateEnd);
+                for (;;) {
+                    size_t chunk = next_chunk_to_decode++;
+                    if (chunk >= num_chunks) break;
+                    slot *s = wait_for_slot(chunk);
+                    if (!s) break;
+
+                    size_t m0 = chunk * members_per_chunk;
+                    size_t m1 = std::min(m0 + members_per_chunk, members.size() - 1);
+                    size_t total = 0;
+                    for (size_t m = m0; m != m1; ++m) {
+                        const uint8_t *e = (const uint8_t *)members[m + 1];
+                        total += e[-4] | e[-3] << 8 | e[-2] << 16 | (size_t)e[-1] << 24;
+                    }
+                    if (s->data.size() < total + 1) s->data.resize(total + 1);
+
+                    char *dest = s->data.data();
+                    for (size_t m = m0; m != m1; ++m) {
+                        const uint8_t *p = (const uint8_t *)members[m];
+                        const uint8_t *e = (const uint8_t *)members[m + 1];
+                        uInt isize = e[-4] | e[-3] << 8 | e[-2] << 16 | (uInt)e[-1] << 24;
+                        uLong crc = e[-8] | e[-7] << 8 | e[-6] << 16 | (uLong)e[-5] << 24;
+                        inflateReset(&zs);
+                        zs.next_in = (Bytef *)p + 18;
+                        zs.avail_in = (uInt)(e - 8 - (p + 18));
+                        zs.next_out = (Bytef *)dest;
+                        zs.avail_out = isize;
+                        if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.avail_out != 0 ||
+                            crc32(crc32(0, Z_NULL, 0), (const Bytef *)dest, isize) != crc
+                        ) {
+                            throw std::runtime_error("bad BGZF block");
+                        }
+                        dest += isize;
+                    }
+                    publish(s, total);
+                }
+            }
+
+            // Inflate a gzip stream, which may have several members, in order.
+            void inflate_stream(const char *begin, const char *end) {
+                z_stream zs = {};
+                if (inflateInit2(&zs, MAX_WBITS + 16) != Z_OK) {
+                    throw std::runtime_error("inflateInit2 failed");
+                }
+                std::unique_ptr<z_stream, int (*)(z_stream *)> zs_guard(&zs, inflateEnd);
+                zs.next_in = (Bytef *)begin;
+                size_t chunk = 0;
+                bool done = false;
+                while (!done) {
+                    slot *s = wait_for_slot(chunk);
+                    if (!s) return;
+                    s->data.resize(chunk_size);
+                    zs.next_out = (Bytef *)s->data.data();
+                    zs.avail_out = (uInt)chunk_size;
+                    while (zs.avail_out != 0) {
+                        zs.avail_in = (uInt)std::min((size_t)(end - (const char *)zs.next_in), (size_t)std::numeric_limits<uInt>::max());
+                        int res = inflate(&zs, Z_NO_FLUSH);
+                        if (res == Z_STREAM_END) {
+                            // Another member may follow.
+                            if (!is_gzip((const char *)zs.next_in, end)) {
+                                done = true;
+                                break;
+                            }
+                            inflateReset(&zs);
+                        } else if (res != Z_OK) {
+                            throw std::runtime_error("bad gzip data");
+                        }
+                    }
+                    publish(s, chunk_size - zs.avail_out);
+                    ++chunk;
+                }
+                std::unique_lock<std::mutex> lock(mutex);
+                num_chunks = chunk;
+                changed.notify_all();
+            }
+        #endif
+
+        // Set by the decoders, protected by mutex.
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::vector<slot> slots;
+        size_t num_consumed = 0;
+        size_t num_chunks = std::numeric_limits<size_t>::max();
+        bool stopping = false;
+        std::exception_ptr error;
+
+        std::vector<const char *> members;
+        std::atomic<size_t> next_chunk_to_decode{0};
+        std::vector<std::thread> threads;
+        std::unique_ptr<boost::interprocess::mapped_region> region;
+
+        // Used only by the reader.
+        bool holding = false;
+        const char *read_ptr = nullptr;
+        const char *read_end = nullptr;
+    };
+}}
+
+#endif
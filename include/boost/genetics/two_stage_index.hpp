@@ -8,6 +8,8 @@
 
 #include <stdexcept>
 #include <type_traits>
+#include <cstdio>
+#include <queue>
 #include <boost/genetics/augmented_string.hpp>
 
 
@@ -24,13 +26,119 @@ namespace boost { namespace genetics {
         typedef typename Traits::TsiAddrArrayType::value_type addr_type;
 
         basic_two_stage_index(
-        ) : string(nullptr), num_indexed_chars(0) {
+        ) : string(nullptr), num_indexed_chars(0), seed_mask(0) {
         }
         
+        //! The seed mask, if any, is kept in the top half of the num_indexed_chars word.
         void write_binary(writer &wr) const {
-            wr.write64(num_indexed_chars);
+            wr.write64(num_indexed_chars | (uint64_t)seed_mask << 32);
             wr.write(index);
-            wr.write(addr);
+            write_addr(wr, addr);
+        }
+
+        //! Build an index of str and write it straight to wr in the same
+        //! layout as write_binary(wr) on an index built in memory.
+        //! At most params.max_memory bytes of (k-mer, address) pairs are
+        //! kept in memory. Larger references are sorted in runs which are
+        //! spilled to temporary files and then merged into the output.
+        //! Each run is sorted on params.num_threads threads.
+        //! With no memory limit, the index is built in memory by counting,
+        //! which needs less memory than sorting pairs.
+        static void write_binary(writer &wr, const string_type &str, size_t num_indexed_chars, const index_params &params) {
+            check_args(str, num_indexed_chars, params.seed_mask);
+
+            if (params.max_memory == 0 || is_compressed((const addr_array_type*)nullptr)) {
+                // Compressed addresses are also encoded in memory.
+                basic_two_stage_index tsi(const_cast<string_type &>(str), num_indexed_chars, params);
+                tsi.write_binary(wr);
+                return;
+            }
+
+            size_t index_size = (size_t)1 << (num_indexed_chars*2);
+            size_t num_positions = str.size() - seed_span(num_indexed_chars, params.seed_mask) + 1;
+            wr.write64(num_indexed_chars | (uint64_t)params.seed_mask << 32);
+            index_type *index = wr.template alloc_vector<index_type>(index_size+1);
+            addr_type *addr = wr.template alloc_vector<addr_type>(str.size());
+            if (index == nullptr || addr == nullptr) {
+                // Only measuring the size.
+                return;
+            }
+
+            size_t run_size = std::max(params.max_memory / sizeof(kmer_addr), (size_t)256);
+            size_t num_threads = std::max((size_t)1, std::min(params.num_threads, run_size / 64));
+
+            // Emit addresses in (k-mer, address) order, filling in the index as we go.
+            size_t next_bucket = 0;
+            addr_type out = 0;
+            auto emit = [&](const kmer_addr &e) {
+                while (next_bucket <= e.kmer) index[next_bucket++] = out;
+                addr[out++] = e.addr;
+            };
+
+            // Run phase: each thread sorts its share of a chunk of the string.
+            // If the string fits in one chunk the runs are merged in memory,
+            // otherwise they are spilled.
+            bool in_memory = num_positions <= run_size;
+            temp_runs runs;
+            std::vector<std::vector<kmer_addr> > buffers(num_threads);
+            for (size_t begin = 0; begin < num_positions; begin += run_size) {
+                size_t end = std::min(begin + run_size, num_positions);
+                run_threads(num_threads, [&](size_t tid) {
+                    std::vector<kmer_addr> &buffer = buffers[tid];
+                    size_t run_begin = begin + (end - begin) * tid / num_threads;
+                    size_t run_end = begin + (end - begin) * (tid + 1) / num_threads;
+                    buffer.resize(0);
+                    buffer.reserve(run_end - run_begin);
+                    for_each_kmer(str, num_indexed_chars, params.seed_mask, run_begin, run_end, [&buffer](size_t acc, size_t pos) {
+                        kmer_addr e = { (uint64_t)acc, (addr_type)pos };
+                        buffer.push_back(e);
+                    });
+                    std::sort(buffer.begin(), buffer.end());
+                });
+                if (!in_memory) {
+                    for (auto &buffer : buffers) {
+                        if (!buffer.empty()) runs.add(params.temp_directory, buffer);
+                    }
+                }
+            }
+
+            // Merge phase: read each run through a buffer and merge them with a heap.
+            std::vector<std::vector<kmer_addr> > inputs;
+            size_t read_size = 0;
+            if (in_memory) {
+                inputs.swap(buffers);
+            } else {
+                std::vector<std::vector<kmer_addr> >().swap(buffers);
+                inputs.resize(runs.files.size());
+                read_size = std::max(run_size / std::max(inputs.size(), (size_t)1), (size_t)64);
+                for (size_t r = 0; r != inputs.size(); ++r) {
+                    std::rewind(runs.files[r]);
+                    runs.read(r, inputs[r], read_size);
+                }
+            }
+
+            size_t num_runs = inputs.size();
+            std::vector<size_t> input_pos(num_runs);
+            typedef std::pair<kmer_addr, size_t> heap_entry;
+            std::priority_queue<heap_entry, std::vector<heap_entry>, std::greater<heap_entry> > heap;
+            for (size_t r = 0; r != num_runs; ++r) {
+                if (!inputs[r].empty()) {
+                    heap.push(heap_entry(inputs[r][0], r));
+                }
+            }
+            while (!heap.empty()) {
+                size_t r = heap.top().second;
+                emit(heap.top().first);
+                heap.pop();
+                if (++input_pos[r] == inputs[r].size()) {
+                    input_pos[r] = 0;
+                    if (in_memory || !runs.read(r, inputs[r], read_size)) continue;
+                }
+                heap.push(heap_entry(inputs[r][input_pos[r]], r));
+            }
+
+            while (next_bucket <= index_size) index[next_bucket++] = out;
+            memset(addr + out, 0, sizeof(addr_type) * (str.size() - out));
         }
 
         basic_two_stage_index &operator =(basic_two_stage_index &&rhs) {
@@ -38,6 +146,7 @@ namespace boost { namespace genetics {
             index = std::move(rhs.index);
             addr = std::move(rhs.addr);
             num_indexed_chars = rhs.num_indexed_chars;
+            seed_mask = rhs.seed_mask;
             return *this;
         }
 
@@ -52,87 +161,70 @@ namespace boost { namespace genetics {
             index(map),
             addr(map)
         {
+            seed_mask = (uint32_t)(num_indexed_chars >> 32);
+            num_indexed_chars &= 0xffffffff;
         }
         
         basic_two_stage_index(
             string_type &str,
-            size_t num_indexed_chars
-        ) : string(&str), num_indexed_chars(num_indexed_chars) {
-            // Todo: use threads to speed this up.
-            //       consider using std::sort for better cache performance.
-            if (
-                num_indexed_chars <= 1 ||
-                num_indexed_chars > 32 ||
-                string->size() < num_indexed_chars ||
-                (addr_type)string->size() != string->size()
-            ) {
-                throw std::invalid_argument("two_stage_index::reindex()");
-            }
+            size_t num_indexed_chars,
+            const index_params &params = index_params()
+        ) : string(&str), num_indexed_chars(num_indexed_chars), seed_mask(params.seed_mask) {
+            check_args(str, num_indexed_chars, seed_mask);
 
             size_t str_size = string->size();
             size_t index_size = (size_t)1 << (num_indexed_chars*2);
 
             index.resize(0);
             index.resize(index_size+1);
-            addr.resize(str_size);
 
-            // Lead-in: fill acc0 with first DNA codes (0-3).
-            size_t acc0 = 0;
-            for (size_t i = 0; i != num_indexed_chars-1; ++i) {
-                acc0 = acc0 * 4 + get_code(*string, i);
+            // Addresses are built uncompressed and then stored in addr.
+            std::vector<addr_type> values(str_size);
+            addr_type *dest = values.data();
+
+            size_t num_positions = str_size - seed_span() + 1;
+            size_t num_threads = std::max((size_t)1, std::min(params.num_threads, num_positions));
+
+            // Each thread of a parallel direct build has a histogram of the whole index.
+            // If these would take more memory than the addresses, or than params.max_memory,
+            // partition instead. That needs only a small buffer per thread.
+            size_t budget = params.max_memory ? params.max_memory : str_size * sizeof(addr_type);
+            bool histograms_fit = index_size <= budget / sizeof(index_type) / num_threads;
+            if (params.strategy == radix_partition || (num_threads > 1 && !histograms_fit)) {
+                radix_build(num_threads, dest);
+                assign_addr(addr, index, index_size, values);
+                return;
+            } else if (num_threads > 1) {
+                parallel_build(num_threads, dest);
+                assign_addr(addr, index, index_size, values);
+                return;
             }
 
             // Count phase: count bucket sizes
-            size_t acc = acc0;
-            size_t poly_A = 0, poly_T = ~0 & (index_size-1);
-            for (size_t i = num_indexed_chars; i != str_size; ++i) {
-                acc = (acc * 4 + get_code(*string, i)) & (index_size-1);
-                if (acc != poly_A && acc != poly_T) {
-                    index[acc]++;
-                }
-                if (i % 0x100000 == 0) printf("c %5.2f\n", (double)i * (100.0/str_size));
-            }
+            for_each_kmer(0, num_positions, [this](size_t acc, size_t) {
+                index[acc]++;
+            });
             
             // Compute running sum of buckets to convert counts to offsets.
-            size_t hist[6] = { 0 };
             addr_type cur = 0;
             for (size_t i = 0; i != index_size; ++i) {
                 addr_type val = index[i];
-                hist[val == 0 ? 0 : val == 1 ? 1 : val < 16 ? 2 : val < 256 ? 3 : val < 4096 ? 4 : 5]++;
                 index[i] = cur;
                 cur += val;
             }
             index[index_size] = cur;
-            /*std::cerr << "0 " << hist[0] << "\n";
-            std::cerr << "1 " << hist[1] << "\n";
-            std::cerr << "<16 " << hist[2] << "\n";
-            std::cerr << "<256 " << hist[3] << "\n";
-            std::cerr << "<4096 " << hist[4] << "\n";
-            std::cerr << ">=4096 " << hist[5] << "\n";*/
 
             // Store phase: fill "addr" with addresses of values.
-            acc = acc0;
-            for (size_t i = num_indexed_chars; i != str_size; ++i) {
-                acc = (acc * 4 + get_code(*string, i)) & (index_size-1);
-                if (acc != poly_A && acc != poly_T) {
-                    addr[index[acc]++] = (addr_type)(i - num_indexed_chars + 1);
-                }
-                //if (i % 0x100000 == 0) printf("s %5.2f\n", (double)i * (100.0/str_size));
-            }
+            for_each_kmer(0, num_positions, [this, dest](size_t acc, size_t pos) {
+                dest[index[acc]++] = (addr_type)pos;
+            });
 
             // Shift the index up one so ends become starts.
             addr_type prev = 0;
             for (size_t i = 0; i != index_size; ++i) {
                 std::swap(prev, index[i]);
             }
-
-            size_t largest_bucket = 0;
-            for (size_t i = 0; i != index_size; ++i) {
-                if (largest_bucket < (size_t)(index[i+1] - index[i])) {
-                    largest_bucket = (size_t)(index[i+1] - index[i]);
-                }
-            }
-            //std::cerr << "largest_bucket=" << largest_bucket_idx << "/" << largest_bucket << "\n";
+            assign_addr(addr, index, index_size, values);
         }
 
         size_t end() const {
@@ -145,12 +237,45 @@ namespace boost { namespace genetics {
             }
 
             iterator(const basic_two_stage_index *tsi, const std::string& search_str, size_t min_pos, search_params &params, search_stats &stats) :
-                tsi(tsi), search_str(search_str), params(params), stats(stats)
+                tsi(tsi), search_str(search_str), params(params), stats(stats), pos(min_pos)
             {
+                lookup_seeds();
+                lookup_addresses();
+                start();
+            }
+
+            //! Construct a search but do not start it.
+            //! Call lookup_seeds(), lookup_addresses() and start() in order.
+            //! Doing each phase for many searches before the next lets
+            //! their cache misses overlap (see find_inexact_batch).
+            //! The bool only selects this constructor.
+            iterator(const basic_two_stage_index *tsi, const std::string& search_str, size_t min_pos, search_params &params, search_stats &stats, bool) :
+                tsi(tsi), search_str(search_str), params(params), stats(stats), pos(min_pos)
+            {
+            }
+
+            //! Setup phase 1: find the seeds and prefetch their index entries.
+            void lookup_seeds() {
+                min_pos = pos;
                 dna_search_str = search_str;
                 num_indexed_chars = tsi->num_indexed_chars;
-                size_t max_seeds = search_str.size() / num_indexed_chars;
-                if (max_seeds <= params.max_distance) {
+                seed_mask = tsi->seed_mask;
+                seed_span = tsi->seed_span();
+                seed_stride = params.seed_stride ? params.seed_stride : seed_span;
+
+                // Overlapping seeds share chars, so one error may spoil several.
+                // Find the most indexed chars that are a multiple of the stride apart.
+                seeds_per_error = 0;
+                for (size_t r = 0; r < seed_stride && r < seed_span; ++r) {
+                    size_t count = 0;
+                    for (size_t i = r; i < seed_span; i += seed_stride) {
+                        count += seed_mask == 0 || ((seed_mask >> i) & 1);
+                    }
+                    seeds_per_error = std::max(seeds_per_error, count);
+                }
+
+                size_t max_seeds = num_seeds(0);
+                if (max_seeds <= params.max_distance * seeds_per_error) {
                     is_brute_force = true;
                     if (params.never_brute_force) {
                         pos = dna_string::npos;
@@ -161,110 +286,92 @@ namespace boost { namespace genetics {
                 }
 
                 if (this->is_brute_force) {
-                    pos = min_pos;
                     find_next(true);
                     return;
-                } else {
-                    active.resize(0);
-                    if (max_seeds == 0) {
-                        pos = dna_string::npos;
-                        return;
-                    }
+                }
 
-                    //long long t0 = __rdtsc();
-                    // Get seed values from string.
-                    // Touch the index in num_seeds places (with NTA hint).
-                    // If there are any 'N's in a seed, 
-                    const char *str = search_str.data();
-                    size_t total_N = 0;
-                    size_t index_size = (size_t)1 << (num_indexed_chars*2);
-                    size_t poly_A = 0, poly_T = ~0 & (index_size-1);
-                    for (size_t i = 0; i != max_seeds; ++i) {
-                        const char *b = str + i * num_indexed_chars;
-                        const char *e = b + num_indexed_chars;
-                        size_t num_N = std::count(b, e, 'N');
-                        total_N += num_N;
-                        if (num_N == 0) {
-                            active_state s;
-                            s.elem = (addr_type)i;
-                            s.idx = (index_type)get_index(dna_search_str, i * num_indexed_chars, num_indexed_chars);
-                            if (s.idx != poly_A || s.idx != poly_T) {
-                                //touch_nta(tsi->addr.data() + tsi->index[i]);
-                                active.push_back(s);
-                            }
-                        }
-                    }
+                active.resize(0);
+                if (max_seeds == 0) {
+                    pos = dna_string::npos;
+                    return;
+                }
 
-                    // Get seed values from string.
-                    // Touch the address vector in num_seeds places (with stream hint).
-                    for (size_t i = 0; i != active.size(); ++i) {
-                        active_state &s = active[i];
-                        const addr_type *ptr = tsi->addr.data() + tsi->index[s.idx];
-                        const addr_type *end = tsi->addr.data() + tsi->index[s.idx+1];
-                        s.ptr = ptr;
-                        s.end = end;
-                        //if (ptr != end) touch_stream(ptr);
-                    }
+                add_seeds(0);
+            }
 
-                    std::sort(
-                        active.data(), active.data() + active.size(),
-                        [](const active_state &a, const active_state &b) {
-                            return a.end - a.ptr < b.end - b.ptr; 
-                        }
-                    );
+            //! Setup phase 2: read the bucket ranges and prefetch the addresses.
+            void lookup_addresses() {
+                if (pos == dna_string::npos || is_brute_force) return;
 
-                    for (size_t i = 0; i != active.size(); ++i) {
-                        active_state &s = active[i];
-                        if (s.end - s.ptr > 100) {
-                            active.resize(i);
-                            break;
-                        }
-                    }
+                // Touch the address vector in num_seeds places (with stream hint).
+                for (size_t i = 0; i != active.size(); ++i) {
+                    active_state &s = active[i];
+                    s.begin = tsi->index[s.idx];
+                    s.end = tsi->index[s.idx+1];
+                    if (params.prefetch && s.begin != s.end) cursor_type::prefetch(tsi->addr, s.begin);
+                }
+            }
 
-                    /*if (active.size() > params.max_distance + 1) {
-                        active.resize(params.max_distance + 1);
-                    }*/
+            //! Setup phase 3: merge the seeds to find the first match.
+            void start() {
+                if (pos == dna_string::npos || is_brute_force) return;
 
-                    /*char tmp[1024], *p = tmp;
-                    for (size_t i = 0; i != active.size(); ++i) {
-                        active_state &s = active[i];
-                        p += sprintf(p, "%d,", (int)(s.end - s.ptr));
-                    }
-                    puts(tmp);*/
+                select_seeds();
 
-                    /*for (size_t i = 0; i != active.size(); ++i) {
-                        active_state &s = active[i];
-                        if (s.end - s.ptr > 100) {
-                            pos = dna_string::npos;
-                            return;
-                        }
-                    }*/
+                // If too many seeds are repetitive, try seeds starting further along the read.
+                for (size_t shift = 1; active.size() <= params.max_distance * seeds_per_error && shift <= params.max_seed_shifts && shift < seed_stride; ++shift) {
+                    stats.seed_shifts_done++;
+                    add_seeds(shift);
+                    lookup_addresses();
+                    select_seeds();
+                }
+
+                /*if (active.size() > params.max_distance + 1) {
+                    active.resize(params.max_distance + 1);
+                }*/
+
+                /*char tmp[1024], *p = tmp;
+                for (size_t i = 0; i != active.size(); ++i) {
+                    active_state &s = active[i];
+                    p += sprintf(p, "%d,", (int)(s.end - s.begin));
+                }
+                puts(tmp);*/
+
+                for (size_t i = 0; i != active.size(); ++i) {
+                    active_state &s = active[i];
+                    s.cursor = cursor_type(tsi->addr, s.begin, s.end);
+                    addr_type skip = (addr_type)(s.offset + min_pos);
+                    s.cursor.seek(skip);
+                    s.start = s.cursor.size() == 0 ? (addr_type)-1 : (addr_type)(*s.cursor - s.offset);
+                    s.prev = (addr_type)-1;
+                }
 
+                if (active.size() <= params.max_distance * seeds_per_error) {
+                    pos = dna_string::npos;
+                    return;
+                }
+
+                required_seed_matches = active.size() - params.max_distance * seeds_per_error;
+                max_error = search_str.size() - params.max_distance - total_N;
+
+                // Gapped matches are found from nearby starts, so need the sorted starts.
+                is_sort_merge = params.merge == sort_merge || params.max_gap != 0;
+                last_gapped_pos = dna_string::npos;
+                if (is_sort_merge) {
+                    // Sort the starts from all the seeds so that equal starts are together.
+                    candidates.resize(0);
                     for (size_t i = 0; i != active.size(); ++i) {
                         active_state &s = active[i];
-                        const addr_type *ptr = s.ptr;
-                        const addr_type *end = s.end;
-                        addr_type skip = (addr_type)(s.elem * num_indexed_chars + min_pos);
-                        while (ptr != end && *ptr < skip) {
-                            ++ptr;
+                        for (cursor_type c = s.cursor; c.size() != 0; ++c) {
+                            candidates.push_back((addr_type)(*c - s.offset));
                         }
-                        s.start = ptr == end ? (addr_type)-1 : (addr_type)(*ptr - (s.elem * num_indexed_chars));
-                        s.prev = (addr_type)-1;
-                        s.ptr = ptr;
                     }
-
-                    if (active.size() <= params.max_distance) {
-                        pos = dna_string::npos;
-                        return;
-                    }
-
-                    required_seed_matches = active.size() - params.max_distance;
-                    max_error = search_str.size() - params.max_distance - total_N;
-
+                    std::sort(candidates.begin(), candidates.end());
+                    next_candidate = 0;
+                } else {
                     std::make_heap(active.begin(), active.end());
-                    pos = min_pos;
-                    find_next(true);
                 }
+                find_next(true);
             }
 
             operator size_t() const {
@@ -284,7 +391,67 @@ namespace boost { namespace genetics {
             size_t distance() const {
                 return distance_;
             }
+
+            //! CIGAR string of a match with gaps, empty if the match has no gaps.
+            //! Only set when search_params::max_gap is non-zero.
+            const std::string &cigar() const {
+                return cigar_;
+            }
         private:
+            // Number of seeds that fit in the string, starting shift chars into it.
+            size_t num_seeds(size_t shift) const {
+                size_t size = search_str.size();
+                return size >= shift + seed_span ? (size - shift - seed_span) / seed_stride + 1 : 0;
+            }
+
+            // Get seed values from string, starting shift chars into it.
+            // Touch the index in num_seeds places (with NTA hint).
+            // Seeds with 'N's in them are not used.
+            void add_seeds(size_t shift) {
+                active.resize(0);
+                const char *str = search_str.data();
+                total_N = 0;
+                size_t max_seeds = num_seeds(shift);
+                size_t index_size = (size_t)1 << (num_indexed_chars*2);
+                size_t poly_A = 0, poly_T = ~0 & (index_size-1);
+                const char *counted = str;
+                for (size_t i = 0; i != max_seeds; ++i) {
+                    size_t offset = shift + i * seed_stride;
+                    const char *b = str + offset;
+                    const char *e = b + seed_span;
+                    size_t num_N = std::count(b, e, 'N');
+                    total_N += std::count(std::max(b, counted), e, 'N');
+                    counted = e;
+                    if (num_N == 0) {
+                        active_state s;
+                        s.offset = (addr_type)offset;
+                        s.idx = (index_type)seed_key(dna_search_str, offset, num_indexed_chars, seed_mask);
+                        if (s.idx != poly_A || s.idx != poly_T) {
+                            if (params.prefetch) touch_nta(&tsi->index[s.idx]);
+                            active.push_back(s);
+                        }
+                    }
+                }
+            }
+
+            // Drop the seeds with too many hits, keeping the rarest.
+            void select_seeds() {
+                std::sort(
+                    active.data(), active.data() + active.size(),
+                    [](const active_state &a, const active_state &b) {
+                        return a.end - a.begin < b.end - b.begin; 
+                    }
+                );
+
+                for (size_t i = 0; i != active.size(); ++i) {
+                    active_state &s = active[i];
+                    if ((size_t)(s.end - s.begin) > params.max_bucket_size) {
+                        active.resize(i);
+                        break;
+                    }
+                }
+            }
+
             void find_next(bool is_start) {
                 if (pos == dna_string::npos) {
                     // If we have already reached the end, stop.
@@ -294,7 +461,45 @@ namespace boost { namespace genetics {
                     if (start + search_str.size() > tsi->string->size()) {
                         pos = dna_string::npos;
                     } else {
-                        pos = tsi->string->find_inexact(search_str, start, ~(size_t)0, params.max_distance);
+                        pos = tsi->string->find_inexact(search_str, start, ~(size_t)0, params.max_distance, params.simd);
+                    }
+                    return;
+                } else if (is_sort_merge) {
+                    // Count the starts within max_gap of each start in the sorted candidates.
+                    // Without gaps, these are runs of equal starts.
+                    pos = dna_string::npos;
+                    size_t max_gap = params.max_gap;
+                    while (next_candidate != candidates.size()) {
+                        addr_type start = candidates[next_candidate];
+                        size_t end = next_candidate + 1;
+                        while (end != candidates.size() && candidates[end] - start <= max_gap) ++end;
+                        size_t repeat_count = end - next_candidate;
+                        if (repeat_count < required_seed_matches) {
+                            // Move on to the next distinct start.
+                            size_t next = next_candidate + 1;
+                            while (next != end && candidates[next] == start) ++next;
+                            stats.merges_done += next - next_candidate;
+                            next_candidate = next;
+                            continue;
+                        }
+
+                        stats.merges_done += repeat_count;
+                        next_candidate = end;
+                        stats.compares_done++;
+                        if (max_gap == 0) {
+                            distance_ = tsi->string->distance(start, dna_search_str.size(), dna_search_str);
+                            if (distance_ <= max_error) {
+                                pos = start;
+                                return;
+                            }
+                        } else {
+                            size_t match_pos = 0;
+                            distance_ = tsi->string->edit_distance(start, dna_search_str, max_gap, params.max_distance, match_pos, cigar_);
+                            if (distance_ != dna_string::npos && match_pos != last_gapped_pos) {
+                                pos = last_gapped_pos = match_pos;
+                                return;
+                            }
+                        }
                     }
                     return;
                 } else {
@@ -319,17 +524,20 @@ namespace boost { namespace genetics {
                             }
                             repeat_count = 0;
                             prev_start = s.start;
+
+                            // Start loading the reference for this candidate while we merge.
+                            if (params.prefetch && s.start != (addr_type)-1) {
+                                tsi->string->prefetch(s.start, dna_search_str.size());
+                            }
                         }
 
                         if (s.start == (addr_type)-1) {
                             return;
                         }
 
-                        const addr_type *ptr = s.ptr + 1;
-                        const addr_type *end = s.end;
+                        ++s.cursor;
                         s.prev = s.start;
-                        s.start = ptr == end ? (addr_type)-1 : (addr_type)(*ptr - s.elem * num_indexed_chars);
-                        s.ptr = ptr;
+                        s.start = s.cursor.size() == 0 ? (addr_type)-1 : (addr_type)(*s.cursor - s.offset);
                         std::pop_heap(active.begin(), active.end());
                         active.back() = s;
                         std::push_heap(active.begin(), active.end());
@@ -338,14 +546,17 @@ namespace boost { namespace genetics {
                 }
             }
 
+            typedef addr_cursor<addr_array_type> cursor_type;
+
             // search state
             struct active_state {
-                const addr_type *ptr;
-                const addr_type *end;
+                cursor_type cursor;
                 index_type idx;
+                index_type begin;
+                index_type end;
                 addr_type start;
                 addr_type prev;
-                addr_type elem;
+                addr_type offset;
 
                 bool operator<(const active_state &rhs) {
                     return start > rhs.start;
@@ -358,6 +569,21 @@ namespace boost { namespace genetics {
             // array of active pointers for each seed
             std::vector<active_state> active;
 
+            // using the sort_merge engine.
+            bool is_sort_merge;
+
+            // sorted starts from all seeds for sort_merge.
+            std::vector<addr_type> candidates;
+
+            // next start to count in candidates.
+            size_t next_candidate;
+
+            // alignment of the current match with gaps.
+            std::string cigar_;
+
+            // last match with gaps, as nearby starts may find the same one.
+            size_t last_gapped_pos;
+
             // dna string
             const std::string &search_str;
             dna_string dna_search_str;
@@ -377,6 +603,12 @@ namespace boost { namespace genetics {
             // current search position.
             size_t pos;
 
+            // first position to search from.
+            size_t min_pos;
+
+            // number of 'N's in the seeds.
+            size_t total_N;
+
             // Total maximum error, including 'N's.
             size_t max_error;
 
@@ -385,13 +617,60 @@ namespace boost { namespace genetics {
 
             // number of chars per index location
             size_t num_indexed_chars;
+
+            // spaced seed mask of the index, zero for contiguous seeds.
+            uint32_t seed_mask;
+
+            // number of chars covered by each seed.
+            size_t seed_span;
+
+            // distance between seeds in the search string.
+            size_t seed_stride;
+
+            // most seeds that one error can spoil.
+            size_t seeds_per_error;
         };
 
+        //! True if the index has not been built.
+        bool empty() const {
+            return num_indexed_chars == 0;
+        }
+
         /// find the next dna string which is close to the search string allowing max_distance errors and max_gap gaps between exons.
         iterator find_inexact(const std::string& search_str, size_t pos, search_params &params, search_stats &stats) const {
             return iterator(this, search_str, pos, params, stats);
         }
 
+        /// start searches for num_strs strings at once, giving one iterator for each.
+        /// Each setup phase is done for every search before the next so that
+        /// the index and address lookups of all the searches are in flight together.
+        /// The search strings must outlive the iterators.
+        void find_inexact_batch(std::vector<iterator> &result, const std::string *search_strs, size_t num_strs, size_t pos, search_params &params, search_stats &stats) const {
+            result.clear();
+            result.reserve(num_strs);
+            for (size_t i = 0; i != num_strs; ++i) {
+                result.emplace_back(this, search_strs[i], pos, params, stats, true);
+            }
+            for (auto &i : result) i.lookup_seeds();
+            for (auto &i : result) i.lookup_addresses();
+            for (auto &i : result) i.start();
+        }
+
+        //! Count the buckets of each size in power of two bins.
+        //! hist[0] counts the empty buckets and hist[k] those with 2^(k-1) to 2^k-1 addresses.
+        //! This shows how repetitive the reference is when choosing search_params::max_bucket_size.
+        void occupancy_histogram(std::vector<size_t> &hist) const {
+            hist.resize(0);
+            size_t index_size = (size_t)1 << (num_indexed_chars*2);
+            for (size_t i = 0; i != index_size; ++i) {
+                size_t size = (size_t)(index[i+1] - index[i]);
+                size_t bin = 0;
+                while (size >> bin) ++bin;
+                if (bin >= hist.size()) hist.resize(bin + 1);
+                hist[bin]++;
+            }
+        }
+
         template <class charT, class traits>
         void write_ascii(std::basic_ostream<charT, traits>& os) const {
             auto save = os.flags();
@@ -399,7 +678,7 @@ namespace boost { namespace genetics {
             for (size_t i = 0; i != index_size; ++i) {
                 for (index_type j = index[i]; j != index[i+1]; ++j) {
                     addr_type a = addr[j];
-                    os << "[" << a << " " << string->substr(a, num_indexed_chars) << "]";
+                    os << "[" << a << " " << string->substr(a, seed_span()) << "]";
                 }
                 os << "\n";
             }
@@ -409,20 +688,354 @@ namespace boost { namespace genetics {
         void swap(basic_two_stage_index &rhs) {
             std::swap(string, rhs.string);
             std::swap(num_indexed_chars, rhs.num_indexed_chars);
+            std::swap(seed_mask, rhs.seed_mask);
             index.swap(rhs.index);
             addr.swap(rhs.addr);
         }
 
     private:
+        // Store the addresses built in values.
+        static void assign_addr(std::vector<addr_type> &addr, const index_array_type &, size_t, std::vector<addr_type> &values) {
+            addr.swap(values);
+        }
+
+        static void assign_addr(mapped_vector<addr_type> &, const index_array_type &, size_t, std::vector<addr_type> &) {
+            throw std::runtime_error("two_stage_index: can't build into a mapped array");
+        }
+
+        template <class WordArrayType>
+        static void assign_addr(basic_compressed_addr_array<WordArrayType> &addr, const index_array_type &index, size_t index_size, std::vector<addr_type> &values) {
+            addr.assign(index, index_size, values);
+        }
+
+        template <class ArrayType>
+        static void write_addr(writer &wr, const ArrayType &addr) {
+            wr.write(addr);
+        }
+
+        template <class WordArrayType>
+        static void write_addr(writer &wr, const basic_compressed_addr_array<WordArrayType> &addr) {
+            addr.write_binary(wr);
+        }
+
+        template <class WordArrayType>
+        static bool is_compressed(const basic_compressed_addr_array<WordArrayType> *) {
+            return true;
+        }
+
+        static bool is_compressed(const void *) {
+            return false;
+        }
+
+        static void check_args(const string_type &str, size_t num_indexed_chars, uint32_t seed_mask) {
+            if (
+                num_indexed_chars <= 1 ||
+                num_indexed_chars > 32 ||
+                (seed_mask != 0 && seed_mask_chars(seed_mask) != num_indexed_chars) ||
+                str.size() < seed_span(num_indexed_chars, seed_mask) ||
+                (addr_type)str.size() != str.size()
+            ) {
+                throw std::invalid_argument("two_stage_index::reindex()");
+            }
+        }
+
+        // Call fn(acc, pos) for every indexed k-mer starting in [begin, end).
+        template <class Fn>
+        void for_each_kmer(size_t begin, size_t end, Fn fn) const {
+            for_each_kmer(*string, num_indexed_chars, seed_mask, begin, end, fn);
+        }
+
+        template <class Fn>
+        static void for_each_kmer(const string_type &str, size_t num_indexed_chars, uint32_t seed_mask, size_t begin, size_t end, Fn fn) {
+            size_t index_size = (size_t)1 << (num_indexed_chars*2);
+            size_t poly_A = 0, poly_T = ~0 & (index_size-1);
+            size_t span = seed_span(num_indexed_chars, seed_mask);
+            typename string_type::kmer_iterator i(str, begin, span);
+            for (size_t pos = begin; pos != end; ++pos, ++i) {
+                size_t acc = seed_mask ? gather_seed(*i, span, seed_mask) : (size_t)*i;
+                if (acc != poly_A && acc != poly_T) {
+                    fn(acc, pos);
+                }
+            }
+        }
+
+        // Number of chars covered by each seed.
+        static size_t seed_span(size_t num_indexed_chars, uint32_t seed_mask) {
+            return seed_mask ? seed_mask_span(seed_mask) : num_indexed_chars;
+        }
+
+        size_t seed_span() const {
+            return seed_span(num_indexed_chars, seed_mask);
+        }
+
+        // Pack the chars of a span-char window selected by seed_mask into an index key.
+        static size_t gather_seed(uint64_t window, size_t span, uint32_t seed_mask) {
+            size_t key = 0;
+            for (size_t i = 0; i != span; ++i) {
+                if ((seed_mask >> i) & 1) {
+                    key = (key << 2) | (size_t)((window >> (span - 1 - i) * 2) & 3);
+                }
+            }
+            return key;
+        }
+
+        // The index key of the seed starting at pos in str.
+        template <class StringType>
+        static size_t seed_key(const StringType &str, size_t pos, size_t num_indexed_chars, uint32_t seed_mask) {
+            if (seed_mask == 0) {
+                return (size_t)get_index(str, pos, num_indexed_chars);
+            }
+            size_t span = seed_mask_span(seed_mask);
+            return gather_seed(get_index(str, pos, span), span, seed_mask);
+        }
+
+        // Build the index on several threads. Each thread counts and stores
+        // a contiguous chunk of the string using its own histogram so that
+        // buckets are filled in address order, as they are in the serial build.
+        // This uses num_threads * 4^num_indexed_chars extra index entries, so the
+        // constructor only calls it when they fit in its memory budget.
+        void parallel_build(size_t num_threads, addr_type *dest) {
+            size_t index_size = (size_t)1 << (num_indexed_chars*2);
+            size_t num_positions = string->size() - seed_span() + 1;
+            std::vector<std::vector<index_type> > counts(num_threads);
+            std::vector<addr_type> totals(num_threads + 1);
+
+            // Count phase: each thread counts bucket sizes for its own chunk.
+            run_threads(num_threads, [&](size_t tid) {
+                std::vector<index_type> &count = counts[tid];
+                count.resize(index_size);
+                for_each_kmer(
+                    num_positions * tid / num_threads,
+                    num_positions * (tid + 1) / num_threads,
+                    [&count](size_t acc, size_t) { count[acc]++; }
+                );
+            });
+
+            // Prefix sum phase: each thread sums a range of buckets, then
+            // the range totals are summed and each thread converts its range
+            // of counts into offsets for each chunk.
+            run_threads(num_threads, [&](size_t tid) {
+                size_t begin = index_size * tid / num_threads;
+                size_t end = index_size * (tid + 1) / num_threads;
+                addr_type total = 0;
+                for (size_t i = begin; i != end; ++i) {
+                    for (size_t t = 0; t != num_threads; ++t) {
+                        total += counts[t][i];
+                    }
+                }
+                totals[tid + 1] = total;
+            });
+
+            for (size_t t = 0; t != num_threads; ++t) {
+                totals[t + 1] += totals[t];
+            }
+
+            run_threads(num_threads, [&](size_t tid) {
+                size_t begin = index_size * tid / num_threads;
+                size_t end = index_size * (tid + 1) / num_threads;
+                addr_type cur = totals[tid];
+                for (size_t i = begin; i != end; ++i) {
+                    index[i] = cur;
+                    for (size_t t = 0; t != num_threads; ++t) {
+                        addr_type val = counts[t][i];
+                        counts[t][i] = cur;
+                        cur += val;
+                    }
+                }
+            });
+            index[index_size] = totals[num_threads];
+
+            // Store phase: each thread fills "addr" for its own chunk.
+            run_threads(num_threads, [&](size_t tid) {
+                std::vector<index_type> &offset = counts[tid];
+                for_each_kmer(
+                    num_positions * tid / num_threads,
+                    num_positions * (tid + 1) / num_threads,
+                    [&offset, dest](size_t acc, size_t pos) { dest[offset[acc]++] = (addr_type)pos; }
+                );
+            });
+        }
+
+        // Build the index by partitioning addresses on the top bits of their
+        // k-mers before filling the buckets. Writing to a few hundred partitions
+        // through cache-line sized buffers avoids a cache and TLB miss per
+        // address on large indices. Each partition is then sorted into its
+        // buckets while its part of the index is in cache. The low bits of each
+        // k-mer are kept next to its address so that this does not read the string.
+        void radix_build(size_t num_threads, addr_type *dest) {
+            const size_t buffer_size = 64 / sizeof(addr_type);
+            size_t index_size = (size_t)1 << (num_indexed_chars*2);
+            size_t num_positions = string->size() - seed_span() + 1;
+            size_t partition_bits = std::min((size_t)8, num_indexed_chars*2);
+            size_t num_partitions = (size_t)1 << partition_bits;
+            size_t partition_shift = num_indexed_chars*2 - partition_bits;
+            size_t partition_size = index_size / num_partitions;
+
+            // Bucket within the partition of each address in dest.
+            // A 32 bit key covers up to 20 indexed chars, far more than fit in memory.
+            std::vector<uint32_t> keys(num_positions);
+
+            // Partition phase: count and then store each chunk's addresses in partition order.
+            std::vector<std::vector<addr_type> > offsets(num_threads);
+            run_threads(num_threads, [&](size_t tid) {
+                std::vector<addr_type> &count = offsets[tid];
+                count.resize(num_partitions);
+                for_each_kmer(
+                    num_positions * tid / num_threads,
+                    num_positions * (tid + 1) / num_threads,
+                    [&count, partition_shift](size_t acc, size_t) { count[acc >> partition_shift]++; }
+                );
+            });
+
+            std::vector<addr_type> partition_start(num_partitions + 1);
+            addr_type cur = 0;
+            for (size_t p = 0; p != num_partitions; ++p) {
+                partition_start[p] = cur;
+                for (size_t t = 0; t != num_threads; ++t) {
+                    addr_type val = offsets[t][p];
+                    offsets[t][p] = cur;
+                    cur += val;
+                }
+            }
+            partition_start[num_partitions] = cur;
+
+            run_threads(num_threads, [&](size_t tid) {
+                std::vector<addr_type> &offset = offsets[tid];
+                std::vector<addr_type> buffers(num_partitions * buffer_size);
+                std::vector<uint32_t> key_buffers(num_partitions * buffer_size);
+                std::vector<uint8_t> fill(num_partitions);
+                for_each_kmer(
+                    num_positions * tid / num_threads,
+                    num_positions * (tid + 1) / num_threads,
+                    [&](size_t acc, size_t pos) {
+                        size_t p = acc >> partition_shift;
+                        addr_type *buffer = buffers.data() + p * buffer_size;
+                        uint32_t *key_buffer = key_buffers.data() + p * buffer_size;
+                        key_buffer[fill[p]] = (uint32_t)(acc & (partition_size-1));
+                        buffer[fill[p]++] = (addr_type)pos;
+                        if (fill[p] == buffer_size) {
+                            memcpy(dest + offset[p], buffer, sizeof(addr_type) * buffer_size);
+                            memcpy(keys.data() + offset[p], key_buffer, sizeof(uint32_t) * buffer_size);
+                            offset[p] += (addr_type)buffer_size;
+                            fill[p] = 0;
+                        }
+                    }
+                );
+                for (size_t p = 0; p != num_partitions; ++p) {
+                    memcpy(dest + offset[p], buffers.data() + p * buffer_size, sizeof(addr_type) * fill[p]);
+                    memcpy(keys.data() + offset[p], key_buffers.data() + p * buffer_size, sizeof(uint32_t) * fill[p]);
+                }
+            });
+
+            // Bucket phase: sort each partition into its buckets.
+            run_threads(num_threads, [&](size_t tid) {
+                std::vector<addr_type> positions;
+                for (size_t p = tid; p < num_partitions; p += num_threads) {
+                    addr_type begin = partition_start[p];
+                    addr_type end = partition_start[p+1];
+                    index_type *part_index = &index[p * partition_size];
+                    const uint32_t *buckets = keys.data() + begin;
+                    positions.assign(dest + begin, dest + end);
+                    for (size_t i = 0; i != positions.size(); ++i) {
+                        part_index[buckets[i]]++;
+                    }
+
+                    addr_type cur = begin;
+                    for (size_t i = 0; i != partition_size; ++i) {
+                        addr_type val = part_index[i];
+                        part_index[i] = cur;
+                        cur += val;
+                    }
+
+                    for (size_t i = 0; i != positions.size(); ++i) {
+                        dest[part_index[buckets[i]]++] = positions[i];
+                    }
+
+                    // Shift this part of the index so ends become starts.
+                    for (size_t i = partition_size; i-- > 1; ) {
+                        part_index[i] = part_index[i-1];
+                    }
+                    part_index[0] = begin;
+                }
+            });
+            index[index_size] = partition_start[num_partitions];
+        }
+
+        // A k-mer and its address, sorted by k-mer and then address.
+        struct kmer_addr {
+            uint64_t kmer;
+            addr_type addr;
+
+            bool operator<(const kmer_addr &rhs) const {
+                return kmer != rhs.kmer ? kmer < rhs.kmer : addr < rhs.addr;
+            }
+
+            bool operator>(const kmer_addr &rhs) const {
+                return rhs < *this;
+            }
+        };
+
+        // Sorted runs spilled to temporary files, removed on destruction.
+        struct temp_runs {
+            std::vector<std::FILE *> files;
+            std::vector<std::string> names;
+
+            // Write a sorted run to a new temporary file.
+            void add(const std::string &temp_directory, const std::vector<kmer_addr> &run) {
+                std::string name;
+                std::FILE *file = nullptr;
+                if (temp_directory.empty()) {
+                    file = std::tmpfile();
+                } else {
+                    name = temp_directory + "/two_stage_index." +
+                        std::to_string((uint64_t)std::chrono::system_clock::now().time_since_epoch().count()) +
+                        "." + std::to_string(files.size()) + ".tmp";
+                    file = std::fopen(name.c_str(), "w+b");
+                }
+                if (file == nullptr) {
+                    throw std::runtime_error("two_stage_index: unable to create temporary file");
+                }
+                files.push_back(file);
+                names.push_back(name);
+                if (std::fwrite(run.data(), sizeof(kmer_addr), run.size(), file) != run.size()) {
+                    throw std::runtime_error("two_stage_index: unable to write temporary file");
+                }
+            }
+
+            // Read up to size entries of run r, returning false at the end of the run.
+            bool read(size_t r, std::vector<kmer_addr> &buffer, size_t size) {
+                buffer.resize(size);
+                buffer.resize(std::fread(buffer.data(), sizeof(kmer_addr), size, files[r]));
+                if (buffer.empty() && std::ferror(files[r])) {
+                    throw std::runtime_error("two_stage_index: unable to read temporary file");
+                }
+                return !buffer.empty();
+            }
+
+            ~temp_runs() {
+                for (size_t r = 0; r != files.size(); ++r) {
+                    std::fclose(files[r]);
+                    if (!names[r].empty()) std::remove(names[r].c_str());
+                }
+            }
+        };
+
         // Note: order matters
         string_type *string;
         size_t num_indexed_chars;
         index_array_type index;
         addr_array_type addr;
+
+        // Spaced seed mask, zero for contiguous seeds.
+        uint32_t seed_mask;
     };
 
     typedef basic_two_stage_index<unmapped_traits> two_stage_index;
     typedef basic_two_stage_index<mapped_traits> mapped_two_stage_index;
+    typedef basic_two_stage_index<compressed_traits> compressed_two_stage_index;
+    typedef basic_two_stage_index<compressed_mapped_traits> compressed_mapped_two_stage_index;
+    typedef basic_two_stage_index<large_unmapped_traits> large_two_stage_index;
+    typedef basic_two_stage_index<large_mapped_traits> large_mapped_two_stage_index;
 
     template <class charT, class traits, class Traits>
     std::basic_ostream<charT, traits>&
@@ -17,6 +17,9 @@
 #include <algorithm>
 #include <stdexcept>
 #include <chrono>
+#include <thread>
+#include <atomic>
+#include <type_traits>
 
 #if !defined(_CRAYC) && !defined(__CUDACC__) && (!defined(__GNUC__) || (__GNUC__ > 3) || ((__GNUC__ == 3) && (__GNUC_MINOR__ > 3)))
     #if (defined(_M_IX86_FP) && (_M_IX86_FP >= 2)) || defined(__SSE2__)
@@ -30,6 +33,25 @@
     #define BOOST_GENETICS_IS_WIN64 0
 #endif
 
+#if defined(_MSC_VER) && (defined(_M_AMD64) || defined(_M_IX86))
+    #include <intrin.h>
+#endif
+
+// Vector kernels are compiled for their own instruction sets and
+// chosen at run time, so no compiler flags are needed to use them.
+#if defined(__GNUC__) && defined(__x86_64__)
+    #include <immintrin.h>
+    #define BOOST_GENETICS_HAS_X86_SIMD 1
+    #define BOOST_GENETICS_TARGET(isa) __attribute__((target(isa)))
+#elif defined(_MSC_VER) && defined(_M_AMD64)
+    #include <immintrin.h>
+    #define BOOST_GENETICS_HAS_X86_SIMD 1
+    #define BOOST_GENETICS_TARGET(isa)
+#else
+    #define BOOST_GENETICS_HAS_X86_SIMD 0
+    #define BOOST_GENETICS_TARGET(isa)
+#endif
+
 namespace boost { namespace genetics {
     typedef unsigned char uint8_t;
     typedef unsigned short uint16_t;
@@ -66,18 +88,46 @@ namespace boost { namespace genetics {
         return (unsigned)(chr & 0xff) <= ' ';
     }
 
+    //! How long prefetched data should stay in the cache.
+    enum prefetch_locality {
+        //! use once, avoiding cache pollution.
+        prefetch_nta = 0,
+
+        //! keep in the last level cache.
+        prefetch_l3 = 1,
+
+        //! keep in the L2 cache and above.
+        prefetch_l2 = 2,
+
+        //! keep in all caches.
+        prefetch_l1 = 3
+    };
+
+    //! Start loading the cache line containing ptr for reading.
+    //! This is a hint and does nothing on compilers we don't know.
+    template <prefetch_locality Locality, class Ptr>
+    inline void prefetch(Ptr ptr) {
+        #if defined(__GNUC__)
+            __builtin_prefetch((const void *)ptr, 0, (int)Locality);
+        #elif defined(_MSC_VER) && (defined(_M_AMD64) || defined(_M_IX86))
+            _mm_prefetch((const char *)ptr,
+                Locality == prefetch_nta ? _MM_HINT_NTA :
+                Locality == prefetch_l3 ? _MM_HINT_T2 :
+                Locality == prefetch_l2 ? _MM_HINT_T1 : _MM_HINT_T0
+            );
+        #endif
+    }
+
+    //! Prefetch data that will be used once.
     template <class Ptr>
     void touch_nta(Ptr ptr) {
-        #if BOOST_GENETICS_IS_WIN64
-            _mm_prefetch((const char *)ptr, _MM_HINT_NTA);
-        #endif
+        prefetch<prefetch_nta>(ptr);
     }
 
+    //! Prefetch data that will be read sequentially.
     template <class Ptr>
     void touch_stream(Ptr ptr) {
-        #if BOOST_GENETICS_IS_WIN64
-            _mm_prefetch((const char *)ptr, _MM_HINT_T1);
-        #endif
+        prefetch<prefetch_l2>(ptr);
     }
 
     template <class StringType>
@@ -89,6 +139,37 @@ namespace boost { namespace genetics {
         return result;
     }
 
+    //! Number of chars spanned by a spaced seed mask.
+    //! Bit i of the mask is set if char i of the seed is indexed.
+    inline size_t seed_mask_span(uint32_t seed_mask) {
+        size_t span = 0;
+        while (seed_mask >> span) ++span;
+        return span;
+    }
+
+    //! Number of chars indexed by a spaced seed mask.
+    inline size_t seed_mask_chars(uint32_t seed_mask) {
+        size_t num_chars = 0;
+        for (; seed_mask; seed_mask &= seed_mask - 1) ++num_chars;
+        return num_chars;
+    }
+
+    //! Convert a seed mask like "110110110" to bits, first char in bit 0.
+    inline uint32_t parse_seed_mask(const std::string &str) {
+        uint32_t seed_mask = 0;
+        if (str.size() > 32) {
+            throw std::invalid_argument("parse_seed_mask(): mask is longer than 32 chars");
+        }
+        for (size_t i = 0; i != str.size(); ++i) {
+            if (str[i] == '1') {
+                seed_mask |= (uint32_t)1 << i;
+            } else if (str[i] != '0') {
+                throw std::invalid_argument("parse_seed_mask(): expected 0 or 1");
+            }
+        }
+        return seed_mask;
+    }
+
     // Some older hardware treats lzcnt like bsr.
     static inline bool has_lzcnt() {
         #if BOOST_GENETICS_IS_WIN64
@@ -116,6 +197,46 @@ namespace boost { namespace genetics {
         #endif
     }
 
+    //! Vector instruction sets for brute force scans.
+    enum simd_level {
+        //! one 64 bit word at a time.
+        simd_none,
+
+        //! four words at a time with AVX2.
+        simd_avx2,
+
+        //! eight words at a time with AVX-512 VPOPCNTQ.
+        simd_avx512,
+
+        //! the best that the CPU supports.
+        simd_best = simd_avx512
+    };
+
+    //! The best vector instruction set that this CPU and OS support.
+    static inline simd_level cpu_simd_level() {
+        #if BOOST_GENETICS_HAS_X86_SIMD && defined(__GNUC__)
+            static const simd_level level =
+                __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq") ? simd_avx512 :
+                __builtin_cpu_supports("avx2") ? simd_avx2 : simd_none
+            ;
+            return level;
+        #elif BOOST_GENETICS_HAS_X86_SIMD
+            static const simd_level level = []() {
+                int leaf1[4], leaf7[4];
+                __cpuidex(leaf1, 1, 0);
+                __cpuidex(leaf7, 7, 0);
+                bool has_xsave = (leaf1[2] & (1 << 27)) != 0;
+                uint64_t xcr0 = has_xsave ? _xgetbv(0) : 0;
+                bool has_avx2 = (xcr0 & 0x06) == 0x06 && (leaf7[1] & (1 << 5)) != 0;
+                bool has_avx512 = (xcr0 & 0xe6) == 0xe6 && (leaf7[1] & (1 << 16)) != 0 && (leaf7[2] & (1 << 14)) != 0;
+                return has_avx512 ? simd_avx512 : has_avx2 ? simd_avx2 : simd_none;
+            }();
+            return level;
+        #else
+            return simd_none;
+        #endif
+    }
+
     static inline int soft_lzcnt(uint64_t value) {
         int result = 0;
         result = (value >> 32) ? result : result + 32;
@@ -201,6 +322,237 @@ namespace boost { namespace genetics {
         return popcnt(x, has_popcnt);
     }
 
+    //! Gather the codes in the low two bits of eight bytes into
+    //! sixteen bits with the first byte in the top bits.
+    static inline uint32_t pack_codes8(uint64_t x) {
+        x = ((x << 2) | (x >> 8)) & 0x000F000F000F000Full;
+        x = ((x << 4) | (x >> 16)) & 0x000000FF000000FFull;
+        return (uint32_t)(((x << 8) | (x >> 32)) & 0xFFFF);
+    }
+
+    //! Decode the sixteen chars at p, which must be readable, as far as the first
+    //! that is not a base (A, C, G or T in either case), returning the number of bases.
+    //! codes gets their codes with the first in the top bits.
+    //! This is the fast path for decoding the lines of a FASTA file.
+    static inline size_t ascii_to_codes16(const char *p, uint32_t &codes) {
+        uint64_t lo, hi;
+        unsigned base_mask;
+        #if BOOST_GENETICS_HAS_X86_SIMD
+            // SSE2 is part of x86-64, so needs no check.
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+            __m128i u = _mm_and_si128(v, _mm_set1_epi8((char)~0x20));
+            __m128i base = _mm_or_si128(
+                _mm_or_si128(_mm_cmpeq_epi8(u, _mm_set1_epi8('A')), _mm_cmpeq_epi8(u, _mm_set1_epi8('C'))),
+                _mm_or_si128(_mm_cmpeq_epi8(u, _mm_set1_epi8('G')), _mm_cmpeq_epi8(u, _mm_set1_epi8('T')))
+            );
+            base_mask = (unsigned)_mm_movemask_epi8(base);
+            // A=0x41, C=0x43, G=0x47, T=0x54: the code is bits 1-2 with bit 1 flipped by bit 2.
+            __m128i c = _mm_xor_si128(
+                _mm_and_si128(_mm_srli_epi16(v, 1), _mm_set1_epi8(3)),
+                _mm_and_si128(_mm_srli_epi16(v, 2), _mm_set1_epi8(1))
+            );
+            lo = (uint64_t)_mm_cvtsi128_si64(c);
+            hi = (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(c, c));
+        #else
+            uint64_t words[2];
+            memcpy(words, p, sizeof(words));
+            base_mask = 0;
+            for (size_t i = 0; i != 16; ++i) {
+                base_mask |= (unsigned)is_base((unsigned char)p[i]) << i;
+            }
+            for (uint64_t &w : words) {
+                w = ((w >> 1) & 0x0303030303030303ull) ^ ((w >> 2) & 0x0101010101010101ull);
+            }
+            lo = words[0];
+            hi = words[1];
+        #endif
+        codes = pack_codes8(lo) << 16 | pack_codes8(hi);
+        if (base_mask == 0xffff) {
+            return 16;
+        }
+        // Count the bases before the first other char.
+        return (size_t)soft_popcnt(base_mask & ~(base_mask + 1));
+    }
+
+    //! True if the sixteen chars at p, which must be readable, are all the same.
+    static inline bool is_run16(const char *p) {
+        #if BOOST_GENETICS_HAS_X86_SIMD
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+            return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(p[0]))) == 0xffff;
+        #else
+            return memcmp(p, p + 1, 15) == 0;
+        #endif
+    }
+
+    #if BOOST_GENETICS_HAS_X86_SIMD
+        //! Find the first word i in [begin, end) where the 32 base window
+        //! starting at any of its bases is within max_distance of s0,
+        //! masked by s0mask. words[i+1] must be readable.
+        //! This checks four words at a time, returning the first unchecked word
+        //! if fewer than four remain.
+        BOOST_GENETICS_TARGET("avx2")
+        static inline size_t scan_windows_avx2(const uint64_t *words, size_t begin, size_t end, uint64_t s0, uint64_t s0mask, size_t max_distance) {
+            // Nibble population count table for pshufb.
+            const __m256i table = _mm256_setr_epi8(
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4
+            );
+            const __m256i nibbles = _mm256_set1_epi8(0x0f);
+            const __m256i low_bits = _mm256_set1_epi64x(0x5555555555555555ll);
+            const __m256i str = _mm256_set1_epi64x((long long)s0);
+            const __m256i mask = _mm256_set1_epi64x((long long)s0mask);
+            const __m256i limit = _mm256_set1_epi64x((long long)max_distance + 1);
+            const __m256i zero = _mm256_setzero_si256();
+            size_t i = begin;
+            for (; i + 4 <= end; i += 4) {
+                __m256i v0 = _mm256_loadu_si256((const __m256i*)(words + i));
+                __m256i v1 = _mm256_loadu_si256((const __m256i*)(words + i + 1));
+                __m256i hits = zero;
+                for (int j = 0; j != 32; ++j) {
+                    // Shifts of 64 bits give zero.
+                    __m256i w = _mm256_or_si256(
+                        _mm256_sll_epi64(v0, _mm_cvtsi32_si128(j*2)),
+                        _mm256_srl_epi64(v1, _mm_cvtsi32_si128(64-j*2))
+                    );
+                    __m256i x = _mm256_and_si256(_mm256_xor_si256(w, str), mask);
+                    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_srli_epi64(x, 1)), low_bits);
+                    __m256i count = _mm256_add_epi8(
+                        _mm256_shuffle_epi8(table, _mm256_and_si256(x, nibbles)),
+                        _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(x, 4), nibbles))
+                    );
+                    count = _mm256_sad_epu8(count, zero);
+                    hits = _mm256_or_si256(hits, _mm256_cmpgt_epi64(limit, count));
+                }
+                int lanes = _mm256_movemask_pd(_mm256_castsi256_pd(hits));
+                if (lanes) {
+                    size_t lane = 0;
+                    while (!((lanes >> lane) & 1)) ++lane;
+                    return i + lane;
+                }
+            }
+            return i;
+        }
+
+        //! As scan_windows_avx2, eight words at a time with VPOPCNTQ.
+        BOOST_GENETICS_TARGET("avx512f,avx512vpopcntdq")
+        static inline size_t scan_windows_avx512(const uint64_t *words, size_t begin, size_t end, uint64_t s0, uint64_t s0mask, size_t max_distance) {
+            // The zero-masked shifts merge into zero rather than an undefined vector.
+            const __mmask8 all = 0xff;
+            const __m512i low_bits = _mm512_set1_epi64(0x5555555555555555ll);
+            const __m512i str = _mm512_set1_epi64((long long)s0);
+            const __m512i mask = _mm512_set1_epi64((long long)s0mask);
+            const __m512i limit = _mm512_set1_epi64((long long)max_distance);
+            size_t i = begin;
+            for (; i + 8 <= end; i += 8) {
+                __m512i v0 = _mm512_loadu_si512((const void*)(words + i));
+                __m512i v1 = _mm512_loadu_si512((const void*)(words + i + 1));
+                __mmask8 hits = 0;
+                for (int j = 0; j != 32; ++j) {
+                    __m512i w = _mm512_or_si512(
+                        _mm512_maskz_sll_epi64(all, v0, _mm_cvtsi32_si128(j*2)),
+                        _mm512_maskz_srl_epi64(all, v1, _mm_cvtsi32_si128(64-j*2))
+                    );
+                    __m512i x = _mm512_and_si512(_mm512_xor_si512(w, str), mask);
+                    x = _mm512_and_si512(_mm512_or_si512(x, _mm512_maskz_srli_epi64(all, x, 1)), low_bits);
+                    hits |= _mm512_cmple_epu64_mask(_mm512_popcnt_epi64(x), limit);
+                }
+                if (hits) {
+                    size_t lane = 0;
+                    while (!((hits >> lane) & 1)) ++lane;
+                    return i + lane;
+                }
+            }
+            return i;
+        }
+
+        //! Find the first word i in [begin, end) where any base starts the four
+        //! bases whose inverses are repeated in rep0-rep3. words[i+1] must be readable.
+        //! Returns the first unchecked word if fewer than four remain.
+        BOOST_GENETICS_TARGET("avx2")
+        static inline size_t scan_prefix4_avx2(const uint64_t *words, size_t begin, size_t end, uint64_t rep0, uint64_t rep1, uint64_t rep2, uint64_t rep3) {
+            const __m256i r0 = _mm256_set1_epi64x((long long)rep0);
+            const __m256i r1 = _mm256_set1_epi64x((long long)rep1);
+            const __m256i r2 = _mm256_set1_epi64x((long long)rep2);
+            const __m256i r3 = _mm256_set1_epi64x((long long)rep3);
+            const __m256i high_bits = _mm256_set1_epi64x((long long)0xaaaaaaaaaaaaaaaaull);
+            size_t i = begin;
+            for (; i + 4 <= end; i += 4) {
+                __m256i v0 = _mm256_loadu_si256((const __m256i*)(words + i));
+                __m256i v1 = _mm256_loadu_si256((const __m256i*)(words + i + 1));
+                __m256i mask = _mm256_xor_si256(v0, r0);
+                mask = _mm256_and_si256(mask, _mm256_xor_si256(_mm256_or_si256(_mm256_slli_epi64(v0, 2), _mm256_srli_epi64(v1, 62)), r1));
+                mask = _mm256_and_si256(mask, _mm256_xor_si256(_mm256_or_si256(_mm256_slli_epi64(v0, 4), _mm256_srli_epi64(v1, 60)), r2));
+                mask = _mm256_and_si256(mask, _mm256_xor_si256(_mm256_or_si256(_mm256_slli_epi64(v0, 6), _mm256_srli_epi64(v1, 58)), r3));
+                mask = _mm256_and_si256(_mm256_and_si256(mask, _mm256_slli_epi64(mask, 1)), high_bits);
+                int lanes = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(mask, _mm256_setzero_si256()))) ^ 0xf;
+                if (lanes) {
+                    size_t lane = 0;
+                    while (!((lanes >> lane) & 1)) ++lane;
+                    return i + lane;
+                }
+            }
+            return i;
+        }
+
+        //! As scan_prefix4_avx2, eight words at a time.
+        BOOST_GENETICS_TARGET("avx512f")
+        static inline size_t scan_prefix4_avx512(const uint64_t *words, size_t begin, size_t end, uint64_t rep0, uint64_t rep1, uint64_t rep2, uint64_t rep3) {
+            // Zero-masked shifts, as in scan_windows_avx512.
+            const __mmask8 all = 0xff;
+            const __m512i r0 = _mm512_set1_epi64((long long)rep0);
+            const __m512i r1 = _mm512_set1_epi64((long long)rep1);
+            const __m512i r2 = _mm512_set1_epi64((long long)rep2);
+            const __m512i r3 = _mm512_set1_epi64((long long)rep3);
+            const __m512i high_bits = _mm512_set1_epi64((long long)0xaaaaaaaaaaaaaaaaull);
+            size_t i = begin;
+            for (; i + 8 <= end; i += 8) {
+                __m512i v0 = _mm512_loadu_si512((const void*)(words + i));
+                __m512i v1 = _mm512_loadu_si512((const void*)(words + i + 1));
+                __m512i mask = _mm512_xor_si512(v0, r0);
+                mask = _mm512_and_si512(mask, _mm512_xor_si512(_mm512_or_si512(_mm512_maskz_slli_epi64(all, v0, 2), _mm512_maskz_srli_epi64(all, v1, 62)), r1));
+                mask = _mm512_and_si512(mask, _mm512_xor_si512(_mm512_or_si512(_mm512_maskz_slli_epi64(all, v0, 4), _mm512_maskz_srli_epi64(all, v1, 60)), r2));
+                mask = _mm512_and_si512(mask, _mm512_xor_si512(_mm512_or_si512(_mm512_maskz_slli_epi64(all, v0, 6), _mm512_maskz_srli_epi64(all, v1, 58)), r3));
+                __mmask8 hits = _mm512_test_epi64_mask(_mm512_and_si512(mask, _mm512_maskz_slli_epi64(all, mask, 1)), high_bits);
+                if (hits) {
+                    size_t lane = 0;
+                    while (!((hits >> lane) & 1)) ++lane;
+                    return i + lane;
+                }
+            }
+            return i;
+        }
+    #endif
+
+    //! Find the first word in [begin, end) that may contain a match for s0
+    //! (see scan_windows_avx2) using the best of level and the CPU's instructions.
+    //! Returns begin if there are no vector instructions or too few words to scan.
+    static inline size_t scan_windows(simd_level level, const uint64_t *words, size_t begin, size_t end, uint64_t s0, uint64_t s0mask, size_t max_distance) {
+        #if BOOST_GENETICS_HAS_X86_SIMD
+            level = std::min(level, cpu_simd_level());
+            if (level == simd_avx512) {
+                return scan_windows_avx512(words, begin, end, s0, s0mask, max_distance);
+            } else if (level == simd_avx2) {
+                return scan_windows_avx2(words, begin, end, s0, s0mask, max_distance);
+            }
+        #endif
+        return begin;
+    }
+
+    //! Find the first word in [begin, end) that may contain the four bases
+    //! given by rep0-rep3 (see scan_prefix4_avx2).
+    //! Returns begin if there are no vector instructions or too few words to scan.
+    static inline size_t scan_prefix4(simd_level level, const uint64_t *words, size_t begin, size_t end, uint64_t rep0, uint64_t rep1, uint64_t rep2, uint64_t rep3) {
+        #if BOOST_GENETICS_HAS_X86_SIMD
+            level = std::min(level, cpu_simd_level());
+            if (level == simd_avx512) {
+                return scan_prefix4_avx512(words, begin, end, rep0, rep1, rep2, rep3);
+            } else if (level == simd_avx2) {
+                return scan_prefix4_avx2(words, begin, end, rep0, rep1, rep2, rep3);
+            }
+        #endif
+        return begin;
+    }
+
     template<class OutIter>
     OutIter make_int(OutIter &dest, uint64_t val) {
         static const uint64_t p10[] = {
@@ -253,6 +605,44 @@ namespace boost { namespace genetics {
         return dest;
     }
 
+    // format SAM MD field for an alignment with gaps.
+    // ref_str is the aligned reference and read_str the read in the same direction.
+    template<class OutIter, class String>
+    OutIter make_gapped_MD_field(OutIter dest, String &ref_str, String &read_str, const std::string &cigar) {
+        size_t ref_pos = 0, read_pos = 0;
+        std::uint32_t matches = 0;
+        for (size_t i = 0; i != cigar.size(); ++i) {
+            size_t run = 0;
+            for (; i != cigar.size() && cigar[i] >= '0' && cigar[i] <= '9'; ++i) {
+                run = run * 10 + (cigar[i] - '0');
+            }
+            if (i == cigar.size() || ref_pos + run > ref_str.size() || read_pos + run > read_str.size()) {
+                throw std::runtime_error("make_gapped_MD_field bad cigar");
+            }
+            if (cigar[i] == 'M') {
+                for (size_t j = 0; j != run; ++j, ++ref_pos, ++read_pos) {
+                    if (ref_str[ref_pos] == read_str[read_pos]) {
+                        ++matches;
+                    } else {
+                        dest = make_int(dest, matches);
+                        *dest++ = ref_str[ref_pos];
+                        matches = 0;
+                    }
+                }
+            } else if (cigar[i] == 'D') {
+                dest = make_int(dest, matches);
+                *dest++ = '^';
+                for (size_t j = 0; j != run; ++j) {
+                    *dest++ = ref_str[ref_pos++];
+                }
+                matches = 0;
+            } else {
+                read_pos += run;
+            }
+        }
+        return make_int(dest, matches);
+    }
+
     template<class OutIter, class String>
     OutIter make_rev_comp(OutIter dest, String &string) {
         auto i = string.end(), b = string.begin();
@@ -347,6 +737,30 @@ namespace boost { namespace genetics {
         void write64(uint64_t value) {
             write(&value, 1, sizeof(value));
         }
+
+        //! Reserve space for size objects and return a pointer to it
+        //! so that the caller can fill it in place.
+        //! Returns nullptr if this writer is only measuring the size.
+        template <class Type>
+        Type *alloc(size_t size, size_t align = sizeof(Type)) {
+            char *aptr = begin + ((ptr - begin + align - 1) & (0-align));
+            Type *result = nullptr;
+            if (end != nullptr && aptr + sizeof(Type) * size <= end) {
+                if (aptr != ptr) memset(ptr, 0, aptr - ptr);
+                result = (Type*)aptr;
+            }
+            ptr = aptr + sizeof(Type) * size;
+            return result;
+        }
+
+        //! Reserve space for a vector of size objects in the same
+        //! layout as write(vec).
+        template <class Type>
+        Type *alloc_vector(size_t size, size_t align = sizeof(Type)) {
+            write64(sizeof(Type));
+            write64(size);
+            return alloc<Type>(size, align);
+        }
         
         void write(const std::string &str) {
             write(str.c_str(), str.size(), 1);
@@ -417,13 +831,14 @@ namespace boost { namespace genetics {
             dat = nullptr;
         }
         
-        mapped_vector(mapper &map) {
+        //! Map a vector written with writer::write(vec, align).
+        mapped_vector(mapper &map, size_t align = sizeof(value_type)) {
             size_t value_size = (size_t)map.read64();
             if (value_size != sizeof(value_type)) {
                 throw(std::runtime_error("mapped file: item size mismatch (check file format)"));
             }
             sz = (size_t)map.read64();
-            dat = map.map<value_type>(sz, sizeof(value_type));
+            dat = map.map<value_type>(sz, align);
         }
         
         size_t size() const {
@@ -438,11 +853,11 @@ namespace boost { namespace genetics {
             return dat[idx];
         }
         
-        void resize(size_t new_size) {
+        void resize(size_t) {
             // todo: throw something
         }
         
-        void push_back(const value_type &val) {
+        void push_back(const value_type &) {
             // todo: throw something
         }
         
@@ -462,6 +877,282 @@ namespace boost { namespace genetics {
         value_type *dat;
     };
 
+    //! Addresses of a two_stage_index, delta coded within each bucket.
+    //! Entries are grouped in blocks of skip_interval. Each block starts with
+    //! its delta width and each entry has a flag bit saying whether it is an
+    //! absolute address (first in its block or bucket) or a delta from the
+    //! previous one. The bit offset of each block is kept so that a cursor
+    //! can start at any entry or skip forward a block at a time.
+    template <class WordArrayType>
+    class basic_compressed_addr_array {
+    public:
+        typedef uint32_t value_type;
+
+        static const size_t skip_interval = 32;
+
+        basic_compressed_addr_array() : sz(0), value_bits(0) {
+        }
+
+        template <class Mapper>
+        basic_compressed_addr_array(
+            Mapper &map,
+            typename Mapper::is_mapper * = 0
+        ) :
+            sz((size_t)map.read64()),
+            value_bits((size_t)map.read64()),
+            blocks(map),
+            words(map)
+        {
+        }
+
+        //! Encode values, where bucket b is values[index[b]..index[b+1]).
+        //! Values after the last bucket are not stored.
+        template <class IndexArrayType>
+        void assign(const IndexArrayType &index, size_t index_size, const std::vector<value_type> &values) {
+            if (!std::is_same<WordArrayType, std::vector<uint64_t> >::value) {
+                throw std::runtime_error("compressed_addr_array: can't encode a mapped array");
+            }
+            sz = (size_t)index[index_size];
+            value_type max_value = 0;
+            for (size_t j = 0; j != sz; ++j) max_value = std::max(max_value, values[j]);
+            value_bits = bit_width(max_value);
+
+            // Entries that start a bucket.
+            std::vector<bool> is_bucket_start(sz + 1);
+            for (size_t b = 0; b != index_size; ++b) {
+                is_bucket_start[index[b]] = true;
+            }
+
+            blocks.resize(0);
+            words.resize(0);
+            size_t bit = 0;
+            for (size_t begin = 0; begin < sz; begin += skip_interval) {
+                size_t end = std::min(begin + skip_interval, sz);
+                size_t width = 0;
+                for (size_t j = begin + 1; j < end; ++j) {
+                    if (!is_bucket_start[j]) width = std::max(width, bit_width(values[j] - values[j-1] - 1));
+                }
+                blocks.push_back(bit);
+                put_bits(bit, width, 6);
+                for (size_t j = begin; j < end; ++j) {
+                    if (j == begin || is_bucket_start[j]) {
+                        put_bits(bit, 1, 1);
+                        put_bits(bit, values[j], value_bits);
+                    } else {
+                        put_bits(bit, 0, 1);
+                        put_bits(bit, values[j] - values[j-1] - 1, width);
+                    }
+                }
+            }
+            blocks.push_back(bit);
+        }
+
+        void write_binary(writer &wr) const {
+            wr.write64(sz);
+            wr.write64(value_bits);
+            wr.write(blocks);
+            wr.write(words);
+        }
+
+        size_t size() const {
+            return sz;
+        }
+
+        //! Start loading the block containing an entry.
+        //! This reads the block's bit offset to find its words, so it is best
+        //! done well before the entry is decoded.
+        void prefetch(size_t idx) const {
+            if (idx / skip_interval < blocks.size()) {
+                size_t bit = (size_t)blocks[idx / skip_interval];
+                touch_stream(words.data() + bit / 64);
+            }
+        }
+
+        //! Decode a single entry.
+        value_type operator[](size_t idx) const {
+            return *cursor(*this, idx, idx + 1);
+        }
+
+        void swap(basic_compressed_addr_array &rhs) {
+            std::swap(sz, rhs.sz);
+            std::swap(value_bits, rhs.value_bits);
+            blocks.swap(rhs.blocks);
+            words.swap(rhs.words);
+        }
+
+        //! Decodes the entries [begin, end) in order.
+        class cursor {
+        public:
+            cursor() {
+            }
+
+            cursor(const basic_compressed_addr_array &array, size_t begin, size_t end) :
+                array(&array), entry(begin), remaining(end - begin)
+            {
+                if (remaining) {
+                    // Decode from the start of the block up to begin.
+                    start_block(begin / skip_interval);
+                    for (size_t j = begin - begin % skip_interval; j <= begin; ++j) {
+                        decode();
+                    }
+                }
+            }
+
+            value_type operator*() const {
+                return value;
+            }
+
+            //! Number of entries left, including this one.
+            size_t size() const {
+                return remaining;
+            }
+
+            cursor &operator++() {
+                if (--remaining) {
+                    if (++entry % skip_interval == 0) {
+                        start_block(entry / skip_interval);
+                    }
+                    decode();
+                }
+                return *this;
+            }
+
+            //! Skip entries less than target.
+            void seek(value_type target) {
+                while (remaining && value < target) {
+                    // Skip whole blocks if the next block starts at or before target.
+                    size_t next = entry - entry % skip_interval + skip_interval;
+                    if (next < entry + remaining) {
+                        size_t bit = array->blocks[next / skip_interval] + 7;
+                        value_type next_value = (value_type)array->get_bits(bit, array->value_bits);
+                        if (next_value <= target) {
+                            remaining -= next - entry;
+                            entry = next;
+                            start_block(next / skip_interval);
+                            decode();
+                            continue;
+                        }
+                    }
+                    ++*this;
+                }
+            }
+        private:
+            void start_block(size_t block) {
+                bit = array->blocks[block];
+                width = (size_t)array->get_bits(bit, 6);
+                bit += 6;
+            }
+
+            void decode() {
+                bool is_absolute = array->get_bits(bit, 1) != 0;
+                bit += 1;
+                if (is_absolute) {
+                    value = (value_type)array->get_bits(bit, array->value_bits);
+                    bit += array->value_bits;
+                } else {
+                    value += (value_type)array->get_bits(bit, width) + 1;
+                    bit += width;
+                }
+            }
+
+            const basic_compressed_addr_array *array = nullptr;
+            size_t entry = 0;
+            size_t remaining = 0;
+            size_t bit = 0;
+            size_t width = 0;
+            value_type value = 0;
+        };
+    private:
+        static size_t bit_width(uint64_t value) {
+            return (size_t)(64 - soft_lzcnt(value));
+        }
+
+        uint64_t get_bits(size_t bit, size_t width) const {
+            if (width == 0) return 0;
+            size_t idx = bit / 64, shift = bit % 64;
+            uint64_t result = words[idx] >> shift;
+            if (shift + width > 64) result |= words[idx+1] << (64 - shift);
+            return result & ((uint64_t)-1 >> (64 - width));
+        }
+
+        void put_bits(size_t &bit, uint64_t value, size_t width) {
+            if (width == 0) return;
+            size_t idx = bit / 64, shift = bit % 64;
+            if (idx + 1 >= words.size()) words.resize(idx + 2);
+            words[idx] |= value << shift;
+            if (shift + width > 64) words[idx+1] |= value >> (64 - shift);
+            bit += width;
+        }
+
+        // Note: order matters
+        size_t sz;
+        size_t value_bits;
+        WordArrayType blocks;
+        WordArrayType words;
+    };
+
+    //! Iterates over the entries [begin, end) of an uncompressed address array.
+    template <class ArrayType>
+    class addr_cursor {
+    public:
+        typedef typename ArrayType::value_type value_type;
+
+        addr_cursor() : ptr(nullptr), end(nullptr) {
+        }
+
+        addr_cursor(const ArrayType &array, size_t begin, size_t end) :
+            ptr(array.data() + begin), end(array.data() + end)
+        {
+        }
+
+        //! Start loading the entry at begin.
+        static void prefetch(const ArrayType &array, size_t begin) {
+            touch_stream(array.data() + begin);
+        }
+
+        value_type operator*() const {
+            return *ptr;
+        }
+
+        size_t size() const {
+            return (size_t)(end - ptr);
+        }
+
+        addr_cursor &operator++() {
+            ++ptr;
+            return *this;
+        }
+
+        void seek(value_type target) {
+            while (ptr != end && *ptr < target) {
+                ++ptr;
+            }
+        }
+    private:
+        const value_type *ptr;
+        const value_type *end;
+    };
+
+    template <class WordArrayType>
+    class addr_cursor<basic_compressed_addr_array<WordArrayType> > :
+        public basic_compressed_addr_array<WordArrayType>::cursor
+    {
+    public:
+        typedef typename basic_compressed_addr_array<WordArrayType>::cursor cursor;
+
+        addr_cursor() {
+        }
+
+        addr_cursor(const basic_compressed_addr_array<WordArrayType> &array, size_t begin, size_t end) :
+            cursor(array, begin, end)
+        {
+        }
+
+        static void prefetch(const basic_compressed_addr_array<WordArrayType> &array, size_t begin) {
+            array.prefetch(begin);
+        }
+    };
+
     struct chromosome {
         char name[80]; /// Note: these need to be fixed length strings for binary mapping.
         char info[80];
@@ -483,6 +1174,25 @@ namespace boost { namespace genetics {
     struct search_stats {
         size_t merges_done = 0;
         size_t compares_done = 0;
+        size_t seed_shifts_done = 0;
+    };
+
+    //! How a two_stage_index search combines the hits from its seeds.
+    enum merge_engine {
+        //! merge the seed buckets with a heap, one address at a time.
+        heap_merge,
+
+        //! sort the hits from all seeds together and count equal starts.
+        sort_merge
+    };
+
+    //! Which index a reference is searched with.
+    enum index_engine {
+        //! a two_stage_index of k-mers, searched with seeds.
+        two_stage_engine,
+
+        //! an fm_index of the whole reference, searched by backtracking.
+        fm_engine
     };
 
     //! Parameters for inexact searches.
@@ -490,7 +1200,9 @@ namespace boost { namespace genetics {
         //! max allowable errors
         size_t max_distance = 0;
 
-        //! maximum gaps allowed (introns)
+        //! maximum number of bases inserted or deleted in a match.
+        //! Matches with gaps are checked by edit distance and need max_distance
+        //! to include the gaps. Brute force searches do not find gaps.
         size_t max_gap = 0;
 
         //! always do a linear scan of the indexed string
@@ -504,9 +1216,86 @@ namespace boost { namespace genetics {
 
         //! Search reverse complement strand also.
         bool search_rev_comp = true;
+
+        //! Prefetch the index and reference during the search.
+        bool prefetch = true;
+
+        //! How to combine seed hits (the results are the same).
+        merge_engine merge = heap_merge;
+
+        //! Vector instructions to use for brute force scans (the results are the same).
+        simd_level simd = simd_best;
+
+        //! Seeds with more hits than this are too repetitive to use.
+        size_t max_bucket_size = 100;
+
+        //! If too many seeds are repetitive, try seeds shifted this far along the read.
+        size_t max_seed_shifts = 0;
+
+        //! Distance between seeds in the read. Zero places seeds end to end,
+        //! smaller strides overlap seeds so that fewer are lost to each error.
+        size_t seed_stride = 0;
+
+        //! Index to search. The reference must have been indexed with the same engine.
+        index_engine engine = two_stage_engine;
     };
 
-    
+    //! How two_stage_index stores addresses in their buckets.
+    enum index_build_strategy {
+        //! write each address straight to its bucket.
+        direct_scatter,
+
+        //! partition addresses by their top bits, then fill the buckets
+        //! of each partition while they fit in cache.
+        radix_partition
+    };
+
+    //! Parameters for index construction.
+    struct index_params {
+        //! number of threads to use when building the index.
+        size_t num_threads = 1;
+
+        //! how to store addresses (the result is the same).
+        index_build_strategy strategy = direct_scatter;
+
+        //! if non-zero, the maximum number of bytes of working memory to use
+        //! when streaming an index to a writer. Sorted runs are spilled
+        //! to temporary files when this is exceeded.
+        //! The BWT of an fm_index is built from parts of about this size.
+        //! A parallel direct_scatter build partitions instead if its per-thread
+        //! histograms would exceed this, or the size of the addresses if it is zero.
+        size_t max_memory = 0;
+
+        //! directory for temporary files. Uses tmpfile() if empty.
+        std::string temp_directory;
+
+        //! if non-zero, index spaced seeds made of the chars at the set bits
+        //! of this mask (see parse_seed_mask). It must have num_indexed_chars bits set.
+        uint32_t seed_mask = 0;
+
+        //! index to build for a reference.
+        index_engine engine = two_stage_engine;
+
+        //! keep the fm_index suffix array entry for every sa_sample_rate bases.
+        size_t sa_sample_rate = 32;
+    };
+
+    //! Call fn(thread_index) on num_threads threads and wait for them all to finish.
+    template <class Fn>
+    void run_threads(size_t num_threads, Fn fn) {
+        if (num_threads <= 1) {
+            fn((size_t)0);
+            return;
+        }
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i != num_threads; ++i) {
+            threads.emplace_back(fn, i);
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+
     struct common_traits {
         typedef uint64_t DnaWordType;
     };
@@ -534,6 +1323,41 @@ namespace boost { namespace genetics {
         typedef mapped_vector<chromosome> FastaChromosomeType;
         typedef bool mapped;
     };
+
+    //! \brief traits for references of more than 4G bases (std::vector)
+    //! Index and suffix addresses are 64 bits, doubling their cache footprint.
+    struct large_unmapped_traits : common_traits {
+        typedef std::vector<DnaWordType> DnaArrayType; 
+        typedef std::vector<uint64_t> IndexArrayType;
+        typedef std::vector<uint32_t> RleArrayType;
+        typedef std::vector<uint64_t> TsiIndexArrayType;
+        typedef std::vector<uint64_t> TsiAddrArrayType;
+        typedef std::vector<uint64_t> SuffixArrayType;
+        typedef std::vector<chromosome> FastaChromosomeType;
+        typedef bool unmapped;
+    };
+
+    //! \brief traits for file mapped references of more than 4G bases (mapped_vector)
+    struct large_mapped_traits : common_traits {
+        typedef mapped_vector<DnaWordType> DnaArrayType; 
+        typedef mapped_vector<uint64_t> IndexArrayType;
+        typedef mapped_vector<uint32_t> RleArrayType;
+        typedef mapped_vector<uint64_t> TsiIndexArrayType;
+        typedef mapped_vector<uint64_t> TsiAddrArrayType;
+        typedef mapped_vector<uint64_t> SuffixArrayType;
+        typedef mapped_vector<chromosome> FastaChromosomeType;
+        typedef bool mapped;
+    };
+
+    //! \brief traits for classes with a compressed two_stage_index (std::vector)
+    struct compressed_traits : unmapped_traits {
+        typedef basic_compressed_addr_array<std::vector<uint64_t> > TsiAddrArrayType;
+    };
+
+    //! \brief traits for file mapped classes with a compressed two_stage_index (mapped_vector)
+    struct compressed_mapped_traits : mapped_traits {
+        typedef basic_compressed_addr_array<mapped_vector<uint64_t> > TsiAddrArrayType;
+    };
 } }
 
 
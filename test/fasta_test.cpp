@@ -4,6 +4,11 @@
 // http://www.boost.org/LICENSE_1_0.txt)
 
 #include<string.h>
+#include <fstream>
+#include <sstream>
+
+// Test compressed input. This needs zlib.
+#define BOOST_GENETICS_HAS_ZLIB 1
 #include <boost/genetics/fasta.hpp>
 
 #define BOOST_TEST_MODULE genetics
@@ -45,3 +50,337 @@ BOOST_AUTO_TEST_CASE( fasta_test )
     }
 }
 
+
+BOOST_AUTO_TEST_CASE( fasta_batch_test )
+{
+    using namespace boost::genetics;
+
+    fasta_file f("ensembl_chr21.fa");
+    f.make_index(8);
+
+    // Reads from the reference with a couple of changes.
+    const fasta_file::string_type &str = f.get_string();
+    std::vector<std::string> reads;
+    for (size_t pos = 0; pos + 100 < str.size(); pos += 397) {
+        std::string read = str.substr(pos, 100);
+        read[pos % 100] = 'A';
+        read[pos % 77] = 'C';
+        reads.push_back(read);
+    }
+
+    search_params params;
+    params.max_distance = 3;
+    search_stats stats;
+    std::vector<std::vector<fasta_result> > expected(reads.size());
+    for (size_t i = 0; i != reads.size(); ++i) {
+        f.find_inexact(expected[i], reads[i], params, stats);
+    }
+
+    // Batched searches give the same results in the same order, with or without prefetch.
+    for (size_t batch_size = 1; batch_size <= 64; batch_size *= 4) {
+        params.prefetch = batch_size != 16;
+        std::vector<std::vector<fasta_result> > results;
+        f.find_inexact_batch(results, reads, params, stats, batch_size);
+        BOOST_CHECK(results.size() == reads.size());
+        for (size_t i = 0; i != reads.size(); ++i) {
+            BOOST_CHECK(results[i].size() == expected[i].size());
+            for (size_t j = 0; j != results[i].size() && j != expected[i].size(); ++j) {
+                BOOST_CHECK(results[i][j].location == expected[i][j].location);
+                BOOST_CHECK(results[i][j].reverse_complement == expected[i][j].reverse_complement);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( fasta_multi_scan_test )
+{
+    using namespace boost::genetics;
+
+    fasta_file f("ensembl_chr21.fa");
+    f.make_index(8);
+
+    const fasta_file::string_type &str = f.get_string();
+    std::vector<std::string> reads;
+    for (size_t pos = 0; pos + 60 < str.size() && reads.size() != 20; pos += 149) {
+        std::string read = str.substr(pos, 60);
+        read[pos % 60] = 'G';
+        reads.push_back(read);
+    }
+
+    // Scanning for many reads at once finds the same matches as one at a time.
+    for (size_t max_distance = 0; max_distance != 3; ++max_distance) {
+        std::vector<std::vector<size_t> > hits;
+        str.find_inexact_multi(hits, reads, max_distance);
+        BOOST_CHECK(hits.size() == reads.size());
+        for (size_t i = 0; i != reads.size(); ++i) {
+            std::vector<size_t> expected;
+            for (size_t pos = str.find_inexact(reads[i], 0, ~(size_t)0, max_distance); pos != dna_string::npos; pos = str.find_inexact(reads[i], pos + 1, ~(size_t)0, max_distance)) {
+                expected.push_back(pos);
+            }
+            BOOST_CHECK(hits[i] == expected);
+        }
+    }
+
+    // Brute force batches use the multiple string scan.
+    search_params params;
+    params.max_distance = 2;
+    params.always_brute_force = true;
+    params.never_brute_force = false;
+    search_stats stats;
+    std::vector<std::vector<fasta_result> > results;
+    f.find_inexact_batch(results, reads, params, stats, 8);
+    for (size_t i = 0; i != reads.size(); ++i) {
+        std::vector<fasta_result> expected;
+        f.find_inexact(expected, reads[i], params, stats);
+        BOOST_CHECK(results[i].size() == expected.size());
+        for (size_t j = 0; j != results[i].size() && j != expected.size(); ++j) {
+            BOOST_CHECK(results[i][j].location == expected[j].location);
+            BOOST_CHECK(results[i][j].reverse_complement == expected[j].reverse_complement);
+            BOOST_CHECK(results[i][j].distance <= params.max_distance);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( fasta_fm_test )
+{
+    using namespace boost::genetics;
+
+    fasta_file f("ensembl_chr21.fa");
+    index_params iparams;
+    iparams.engine = fm_engine;
+    iparams.sa_sample_rate = 8;
+    f.make_index(0, iparams);
+
+    const fasta_file::string_type &str = f.get_string();
+    std::vector<std::string> reads;
+    for (size_t pos = 0; pos + 60 < str.size() && reads.size() != 20; pos += 149) {
+        std::string read = str.substr(pos, 60);
+        read[pos % 60] = 'G';
+        read[(pos + 29) % 60] = 'C';
+        reads.push_back(read);
+    }
+
+    // The fm engine finds the same matches as a brute force scan, mapped or unmapped.
+    fasta_file g("ensembl_chr21.fa");
+    g.make_index(8);
+    writer sizer(nullptr, nullptr);
+    f.write_binary(sizer);
+    std::vector<boost::genetics::uint64_t> buf(sizer.get_size() / 8 + 1);
+    writer wr((char*)buf.data(), (char*)buf.data() + sizer.get_size());
+    f.write_binary(wr);
+    BOOST_CHECK(wr.is_end());
+    mapper map((const char*)buf.data(), (const char*)buf.data() + sizer.get_size());
+    mapped_fasta_file mf(map);
+    BOOST_CHECK(!mf.get_fm_index().empty());
+
+    search_params fm_params;
+    fm_params.engine = fm_engine;
+    search_params brute_params;
+    brute_params.always_brute_force = true;
+    brute_params.never_brute_force = false;
+    search_stats stats;
+    for (size_t max_distance = 0; max_distance != 4; ++max_distance) {
+        fm_params.max_distance = brute_params.max_distance = max_distance;
+        std::vector<std::vector<fasta_result> > results;
+        f.find_inexact_batch(results, reads, fm_params, stats);
+        for (size_t i = 0; i != reads.size(); ++i) {
+            std::vector<fasta_result> expected, mapped;
+            g.find_inexact(expected, reads[i], brute_params, stats);
+            mf.find_inexact(mapped, reads[i], fm_params, stats);
+            BOOST_CHECK(results[i].size() == expected.size());
+            BOOST_CHECK(mapped.size() == expected.size());
+            for (size_t j = 0; j != results[i].size() && j != expected.size(); ++j) {
+                BOOST_CHECK(results[i][j].location == expected[j].location);
+                BOOST_CHECK(results[i][j].reverse_complement == expected[j].reverse_complement);
+                BOOST_CHECK(results[i][j].distance <= max_distance);
+                BOOST_CHECK(mapped[j].location == expected[j].location);
+            }
+        }
+    }
+
+    // A reference indexed with the two stage index has no fm_index.
+    std::vector<fasta_result> result;
+    BOOST_CHECK_THROW(g.find_inexact(result, reads[0], fm_params, stats), std::runtime_error);
+
+    // A file indexed with only the fm engine is searched with it by default.
+    search_params default_params;
+    default_params.max_distance = 2;
+    fm_params.max_distance = 2;
+    std::vector<fasta_result> expected, mapped;
+    f.find_inexact(expected, reads[0], fm_params, stats);
+    f.find_inexact(result, reads[0], default_params, stats);
+    mf.find_inexact(mapped, reads[0], default_params, stats);
+    BOOST_CHECK(!expected.empty());
+    BOOST_CHECK(result.size() == expected.size() && mapped.size() == expected.size());
+    std::vector<std::vector<fasta_result> > results;
+    f.find_inexact_batch(results, reads, default_params, stats);
+    BOOST_CHECK(results.size() == reads.size() && results[0].size() == expected.size());
+
+    // An unindexed file can not be searched.
+    fasta_file unindexed("ensembl_chr21.fa");
+    BOOST_CHECK_THROW(unindexed.find_inexact(result, reads[0], default_params, stats), std::runtime_error);
+    BOOST_CHECK_THROW(unindexed.find_inexact_batch(results, reads, default_params, stats), std::runtime_error);
+}
+
+static std::vector<char> fasta_image(const boost::genetics::fasta_file &f) {
+    using namespace boost::genetics;
+    writer sizer(nullptr, nullptr);
+    f.write_binary(sizer);
+    std::vector<char> buf(sizer.get_size());
+    writer wr(buf.data(), buf.data() + buf.size());
+    f.write_binary(wr);
+    return buf;
+}
+
+BOOST_AUTO_TEST_CASE( fasta_parallel_append_test )
+{
+    using namespace boost::genetics;
+
+    // Chromosomes of odd lengths, with N runs at the ends and across 64k blocks.
+    std::string text;
+    for (size_t chr = 0; chr != 7; ++chr) {
+        text += ">chr" + std::to_string(chr) + " test chromosome\n";
+        text.append(chr * 37 % 100, 'N');
+        for (size_t i = 0; i != chr * 31001 % 150000 + 5; ++i) {
+            text.push_back("ACGTacgtNnRY"[(i * i + chr) / 61 % (i % 5000 < 300 ? 12 : 4)]);
+            if (i % 60 == 59) text.push_back('\n');
+        }
+        text.append(chr % 3 * 5, 'N');
+        text.push_back('\n');
+    }
+
+    // Packing each chromosome on its own thread gives the same image as serial ingest.
+    fasta_file serial, parallel;
+    serial.append(text.data(), text.data() + text.size());
+    parallel.append(text.data(), text.data() + text.size(), 3);
+    BOOST_CHECK(parallel.get_string().size() == serial.get_string().size());
+    BOOST_CHECK(std::string(parallel.get_string()) == std::string(serial.get_string()));
+    BOOST_CHECK(fasta_image(parallel) == fasta_image(serial));
+
+    // As do several files.
+    fasta_file serial_files, parallel_files;
+    serial_files.append("ensembl_chr21.fa");
+    serial_files.append("ensembl_chr21.fa");
+    parallel_files.append(std::vector<std::string>(2, "ensembl_chr21.fa"), 2);
+    BOOST_CHECK(fasta_image(parallel_files) == fasta_image(serial_files));
+}
+
+// Compress text as one gzip member, or as BGZF members of up to 64k with an empty one at the end.
+static std::string gzip_text(const std::string &text, bool bgzf) {
+    std::string result;
+    size_t block_size = bgzf ? 0xff00 : text.size();
+    for (size_t pos = 0, size = 1; size != 0 && (bgzf || pos == 0); pos += size) {
+        size = std::min(block_size, text.size() - pos);
+        z_stream zs = {};
+        deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, bgzf ? -MAX_WBITS : MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY);
+        std::vector<char> out(deflateBound(&zs, size) + 26);
+        size_t header = bgzf ? 18 : 0;
+        zs.next_in = (Bytef *)text.data() + pos;
+        zs.avail_in = (uInt)size;
+        zs.next_out = (Bytef *)out.data() + header;
+        zs.avail_out = (uInt)(out.size() - header - 8);
+        deflate(&zs, Z_FINISH);
+        size_t total = header + zs.total_out;
+        deflateEnd(&zs);
+        if (bgzf) {
+            static const unsigned char bgzf_header[] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0 };
+            uLong crc = crc32(crc32(0, Z_NULL, 0), (const Bytef *)text.data() + pos, (uInt)size);
+            memcpy(out.data(), bgzf_header, 16);
+            for (int i = 0; i != 4; ++i) {
+                out[total + i] = (char)(crc >> (i * 8));
+                out[total + 4 + i] = (char)(size >> (i * 8));
+            }
+            total += 8;
+            out[16] = (char)(total - 1);
+            out[17] = (char)((total - 1) >> 8);
+        }
+        result.append(out.data(), total);
+    }
+    return result;
+}
+
+BOOST_AUTO_TEST_CASE( fasta_gzip_test )
+{
+    using namespace boost::genetics;
+
+    std::ifstream file("ensembl_chr21.fa", std::ios_base::binary);
+    std::stringstream ss;
+    ss << file.rdbuf();
+    std::string text = ss.str();
+
+    fasta_file plain;
+    plain.append(text.data(), text.data() + text.size());
+
+    // Compressed text decodes to the original on any number of threads
+    // and gives the same reference.
+    for (int bgzf = 0; bgzf != 2; ++bgzf) {
+        std::string gz = gzip_text(text, bgzf != 0);
+        BOOST_CHECK(gzip_reader::is_gzip(gz.data(), gz.data() + gz.size()));
+        for (size_t num_threads = 1; num_threads <= 3; num_threads += 2) {
+            gzip_reader reader(gz.data(), gz.data() + gz.size(), num_threads);
+            std::string decoded;
+            char buf[10000];
+            while (size_t bytes = reader.read(buf, sizeof(buf))) {
+                decoded.append(buf, bytes);
+            }
+            BOOST_CHECK(decoded == text);
+
+            gzip_reader fasta_reader(gz.data(), gz.data() + gz.size(), num_threads);
+            fasta_file f;
+            f.append(fasta_reader, num_threads);
+            BOOST_CHECK(fasta_image(f) == fasta_image(plain));
+        }
+
+        // Corrupt data is reported to the reader.
+        gz[gz.size() / 2] ^= 0x55;
+        gz[gz.size() / 2 + 1] ^= 0x55;
+        gzip_reader reader(gz.data(), gz.data() + gz.size(), 2);
+        const char *b, *e;
+        BOOST_CHECK_THROW(while (reader.next_chunk(b, e)) {}, std::runtime_error);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( fasta_gzip_chunks_test )
+{
+    using namespace boost::genetics;
+
+    // Text decoded in 1MB chunks splits a header, a run of N inside a
+    // chromosome and a chromosome of only N.
+    std::string text;
+    uint32_t r = 1;
+    auto bases = [&](size_t end) {
+        while (text.size() < end) {
+            r = r * 1103515245 + 12345;
+            text.push_back(text.size() % 61 == 60 ? '\n' : "ACGTACGTacgtRN"[(r >> 16) % 14]);
+        }
+    };
+    auto run = [&](char chr, size_t end) {
+        while (text.size() < end) text.push_back(text.size() % 61 == 60 ? '\n' : chr);
+    };
+    text = ">first chromosome\n";
+    bases(0xffff8);
+    text += "\n>second chromosome\n";
+    run('N', 0x100400);
+    bases(0x1fff00);
+    run('N', 0x200100);
+    bases(0x280000);
+    text += "\n>only N\n";
+    run('N', 0x300100);
+    text += "\r\n>last\r\n";
+    bases(0x380000);
+    run('N', 0x380100);
+
+    fasta_file plain;
+    plain.append(text.data(), text.data() + text.size());
+    BOOST_CHECK(plain.get_num_chromosomes() == 4);
+
+    for (int bgzf = 0; bgzf != 2; ++bgzf) {
+        std::string gz = gzip_text(text, bgzf != 0);
+        for (size_t num_threads = 1; num_threads <= 3; num_threads += 2) {
+            gzip_reader reader(gz.data(), gz.data() + gz.size(), num_threads);
+            fasta_file f;
+            f.append(reader, num_threads);
+            BOOST_CHECK(fasta_image(f) == fasta_image(plain));
+        }
+    }
+}
@@ -5,6 +5,7 @@
 
 #include <fstream>
 #include <sstream>
+#include <numeric>
 #include <utility>
 
 #define BOOST_TEST_MODULE Genetics
@@ -60,6 +61,27 @@ BOOST_AUTO_TEST_CASE( dna_string_window )
     }
 }
 
+BOOST_AUTO_TEST_CASE( kmer_iterator_test )
+{
+    using namespace boost::genetics;
+
+    dna_string str(chr1);
+    for (size_t num_chars = 1; num_chars <= 32; num_chars += 5) {
+        for (size_t start = 0; start < 70; start += 23) {
+            dna_string::kmer_iterator i(str, start, num_chars);
+            bool ok = true;
+            for (size_t pos = start; pos + num_chars <= str.size(); ++pos, ++i) {
+                dna_string::word_type expected = 0;
+                for (size_t j = 0; j != num_chars; ++j) {
+                    expected = expected * 4 + str.get_code(pos + j);
+                }
+                ok = ok && *i == expected && i.position() == pos;
+            }
+            BOOST_CHECK(ok);
+        }
+    }
+}
+
 template <class Type>
 void acgt_container_tests() {
     {
@@ -195,6 +217,132 @@ BOOST_AUTO_TEST_CASE( find_inexact )
         BOOST_CHECK( a.find_inexact(key2, 0, 34) == dna_string::npos);
         BOOST_CHECK( a.find_inexact(key2, 0, 35) == (size_t)32);
     }
+    {
+        // scanning for many strings at once finds every match of each one.
+        dna_string a(chr1);
+        std::string str(chr1);
+        std::vector<std::string> keys;
+        for (size_t key_pos = 0; key_pos + 50 < str.size(); key_pos += 97) {
+            keys.push_back(str.substr(key_pos, 20 + key_pos % 30));
+            keys.back()[key_pos % 13] = 'T';
+        }
+        // Seeds of every length, ending at the end of the scan.
+        keys.push_back(str.substr(1094, 6));
+        keys.push_back(str.substr(1000, 100));
+        keys.push_back(str.substr(400, 200));
+        for (size_t max_distance = 0; max_distance != 4; ++max_distance) {
+            std::vector<std::vector<size_t> > hits;
+            a.find_inexact_multi(hits, keys, max_distance, 100, 1000);
+            for (size_t i = 0; i != keys.size(); ++i) {
+                std::vector<size_t> expected;
+                for (size_t pos = a.find_inexact(keys[i], 100, 1000, max_distance); pos != dna_string::npos; pos = a.find_inexact(keys[i], pos + 1, 1099 - pos, max_distance)) {
+                    expected.push_back(pos);
+                }
+                BOOST_CHECK(hits[i] == expected);
+            }
+        }
+    }
+    {
+        // parallel scans find every match, including those across chunk boundaries.
+        std::string str;
+        while (str.size() < 300000) str += std::string(chr1);
+        dna_string a(str);
+        for (size_t max_distance = 0; max_distance != 3; ++max_distance) {
+            for (size_t key_pos = 0; key_pos < 1000; key_pos += 331) {
+                std::string key = str.substr(key_pos, 20 + key_pos % 30);
+                key[key_pos % 7] = 'C';
+                std::vector<size_t> expected;
+                for (size_t pos = a.find_inexact(key, 10, ~(size_t)0, max_distance); pos != dna_string::npos; pos = a.find_inexact(key, pos + 1, ~(size_t)0, max_distance)) {
+                    expected.push_back(pos);
+                }
+                // Zero threads, as from hardware_concurrency(), is one thread.
+                for (size_t num_threads = 0; num_threads != 5; ++num_threads) {
+                    std::vector<size_t> hits;
+                    a.find_inexact_all(hits, key, max_distance, num_threads, 10);
+                    BOOST_CHECK(hits == expected);
+                }
+            }
+        }
+    }
+    {
+        // vector scans find the same matches as the scalar scan.
+        dna_string a(chr1);
+        std::string str(chr1);
+        for (size_t max_distance = 0; max_distance != 4; ++max_distance) {
+            for (size_t key_pos = 0; key_pos + 50 < str.size(); key_pos += 149) {
+                std::string key = str.substr(key_pos, 20 + key_pos % 30);
+                key[key_pos % 11] = 'G';
+                for (size_t pos = 0; pos < str.size(); pos += 300) {
+                    size_t expected = a.find_inexact(key, pos, ~(size_t)0, max_distance, simd_none);
+                    BOOST_CHECK(a.find_inexact(key, pos, ~(size_t)0, max_distance, simd_avx2) == expected);
+                    BOOST_CHECK(a.find_inexact(key, pos, ~(size_t)0, max_distance, simd_avx512) == expected);
+                }
+            }
+        }
+    }
+}
+
+typedef boost::genetics::uint64_t scan_word;
+
+// Scalar versions of scan_windows and scan_prefix4: the first word in [begin, end) with a hit.
+static size_t scalar_scan_windows(const scan_word *words, size_t begin, size_t end, scan_word s0, scan_word s0mask, size_t max_distance) {
+    for (size_t i = begin; i != end; ++i) {
+        for (int j = 0; j != 32; ++j) {
+            scan_word w = j ? words[i] << (j*2) | words[i+1] >> (64-j*2) : words[i];
+            scan_word x = (w ^ s0) & s0mask;
+            x = (x | x >> 1) & 0x5555555555555555ull;
+            if ((size_t)boost::genetics::soft_popcnt(x) <= max_distance) return i;
+        }
+    }
+    return end;
+}
+
+static size_t scalar_scan_prefix4(const scan_word *words, size_t begin, size_t end, scan_word rep0, scan_word rep1, scan_word rep2, scan_word rep3) {
+    for (size_t i = begin; i != end; ++i) {
+        scan_word v0 = words[i], v1 = words[i+1];
+        scan_word mask = (v0 ^ rep0) & ((v0 << 2 | v1 >> 62) ^ rep1) & ((v0 << 4 | v1 >> 60) ^ rep2) & ((v0 << 6 | v1 >> 58) ^ rep3);
+        if (mask & mask << 1 & 0xaaaaaaaaaaaaaaaaull) return i;
+    }
+    return end;
+}
+
+BOOST_AUTO_TEST_CASE( simd_scan_test )
+{
+    using namespace boost::genetics;
+
+    std::vector<scan_word> words(1001);
+    scan_word seed = 0x9e3779b97f4a7c15ull;
+    for (auto &w : words) {
+        seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+        w = seed ^ seed >> 29;
+    }
+
+    // Each vector level the host supports stops at the scalar result, or
+    // at the first word it left unchecked.
+    for (int l = simd_avx2; l <= cpu_simd_level(); ++l) {
+        simd_level level = (simd_level)l;
+        size_t width = level == simd_avx512 ? 8 : 4;
+        BOOST_TEST_MESSAGE("simd level " << l);
+        for (size_t begin = 0; begin < 20; begin += 3) {
+            for (size_t end = begin; end < 1000; end += 97) {
+                size_t full_end = begin + (end - begin) / width * width;
+                for (size_t t = 0; t != 12; ++t) {
+                    scan_word s0 = words[(begin * 7 + t * 131) % 1000];
+                    scan_word s0mask = ~0ull << (t * 4);
+                    size_t max_distance = t % 4 * 3;
+                    size_t expected = std::min(scalar_scan_windows(words.data(), begin, end, s0, s0mask, max_distance), full_end);
+                    BOOST_CHECK(scan_windows(level, words.data(), begin, end, s0, s0mask, max_distance) == expected);
+
+                    scan_word rep[4];
+                    for (size_t k = 0; k != 4; ++k) {
+                        rep[k] = ~((t + k * 5) % 4) * 0x5555555555555555ull;
+                    }
+                    expected = std::min(scalar_scan_prefix4(words.data(), begin, end, rep[0], rep[1], rep[2], rep[3]), full_end);
+                    BOOST_CHECK(scan_prefix4(level, words.data(), begin, end, rep[0], rep[1], rep[2], rep[3]) == expected);
+                }
+            }
+        }
+    }
 }
 
 BOOST_AUTO_TEST_CASE( bandl_tests )
@@ -227,6 +375,54 @@ BOOST_AUTO_TEST_CASE( bandl_tests )
         BOOST_CHECK(std::string(b) == test_string);
     }
 
+    {
+        // Appending from memory decodes sixteen bases at a time but gives
+        // the same string as appending from iterators.
+        std::string text;
+        for (size_t i = 0; text.size() < 150000; ++i) {
+            text.append(std::string(chr1).substr(i % 50, i * 37 % 200));
+            text.append(i % 3 ? "\n" : "\r\n");
+            if (i % 7 == 0) text.append(i % 1000 + 1, i % 2 ? 'N' : 'n');
+            if (i % 11 == 0) text.append("acgtRY");
+            if (i % 13 == 0) text.append(40, i % 2 ? 'R' : ' ');
+        }
+        augmented_string from_iter(text);
+        augmented_string from_memory;
+        from_memory.append(text.data(), text.data() + text.size());
+        BOOST_CHECK(from_memory.get_values() == from_iter.get_values());
+        BOOST_CHECK(std::string(from_memory) == std::string(from_iter));
+
+        dna_string dna_iter, dna_memory;
+        dna_iter.append(text.begin(), text.end(), false);
+        dna_memory.append(text.data(), text.data() + text.size(), false);
+        BOOST_CHECK(dna_memory == dna_iter);
+    }
+
+    {
+        // Joining strings packed separately gives the same words and runs
+        // as appending the text of both.
+        std::string text;
+        for (size_t i = 0; text.size() < 200000; ++i) {
+            text.push_back("ACGTNRacgtnY"[i * 7919 / 13 % (i % 70000 < 1000 ? 12 : 4)]);
+        }
+        for (size_t split = 0; split < text.size(); split += 65539) {
+            augmented_string whole, lhs, rhs;
+            whole.append(text.data(), text.data() + split);
+            whole.append(text.data() + split, text.data() + text.size());
+            lhs.append(text.data(), text.data() + split);
+            rhs.append(text.data() + split, text.data() + text.size());
+            lhs.append(rhs);
+            BOOST_CHECK(lhs.get_values() == whole.get_values());
+            BOOST_CHECK(std::string(lhs) == std::string(whole));
+
+            dna_string dna_whole, dna_lhs, dna_rhs;
+            dna_whole.append(text.begin(), text.end(), false);
+            dna_lhs.append(text.begin(), text.begin() + split, false);
+            dna_rhs.append(text.begin() + split, text.end(), false);
+            dna_lhs.append(dna_rhs);
+            BOOST_CHECK(dna_lhs == dna_whole);
+        }
+    }
 }
 
 BOOST_AUTO_TEST_CASE( rev_comp_test )
@@ -291,6 +487,23 @@ BOOST_AUTO_TEST_CASE( substr )
         BOOST_CHECK( c == test_string + 8);
     }
 
+    {
+        // Runs of N and other letters, some crossing the 64k RLE blocks.
+        std::string str;
+        for (size_t i = 0; str.size() < 200000; ++i) {
+            str.append(std::string(chr1).substr(i % 97, 5000 + i * 331 % 9000));
+            str.append(i * 7 % 5 + 1, "NNRNY"[i % 5]);
+        }
+        str.replace(0x10000 - 10, 20, 20, 'N');
+        augmented_string b(str);
+        BOOST_CHECK(std::string(b) == str);
+        for (size_t offset = 0; offset < str.size(); offset += 997) {
+            size_t length = offset * 13 % 300;
+            BOOST_CHECK(b.substr(offset, length) == str.substr(offset, length));
+            BOOST_CHECK(b.substr(offset, length, true) == rev_comp(str.substr(offset, length)));
+        }
+        BOOST_CHECK(b.substr(0x10000 - 15, 30) == str.substr(0x10000 - 15, 30));
+    }
 }
 
 BOOST_AUTO_TEST_CASE( two_stage_index_test )
@@ -334,6 +547,420 @@ BOOST_AUTO_TEST_CASE( two_stage_index_test )
     }
 }
 
+BOOST_AUTO_TEST_CASE( two_stage_index_build_test )
+{
+    using namespace boost::genetics;
+
+    augmented_string as(chr1);
+
+    auto image = [](const two_stage_index &tsi) {
+        writer sizer(nullptr, nullptr);
+        tsi.write_binary(sizer);
+        std::vector<char> buf(sizer.get_size());
+        writer wr(buf.data(), buf.data() + buf.size());
+        tsi.write_binary(wr);
+        return buf;
+    };
+
+    for (size_t num_indexed_chars = 2; num_indexed_chars <= 6; num_indexed_chars += 2) {
+        two_stage_index serial(as, num_indexed_chars);
+        // Zero threads means one.
+        for (size_t num_threads = 0; num_threads <= 7; num_threads += num_threads ? 3 : 1) {
+            index_params params;
+            params.num_threads = num_threads;
+            two_stage_index parallel(as, num_indexed_chars, params);
+            BOOST_CHECK(image(serial) == image(parallel));
+            params.strategy = radix_partition;
+            two_stage_index radix(as, num_indexed_chars, params);
+            BOOST_CHECK(image(serial) == image(radix));
+
+            // Threads whose histograms do not fit in max_memory partition instead.
+            params.strategy = direct_scatter;
+            params.max_memory = 1;
+            two_stage_index limited(as, num_indexed_chars, params);
+            BOOST_CHECK(image(serial) == image(limited));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( two_stage_index_stream_test )
+{
+    using namespace boost::genetics;
+
+    augmented_string as(chr1);
+
+    auto image = [&as](size_t num_indexed_chars, const index_params *params) {
+        two_stage_index tsi;
+        if (!params) tsi = two_stage_index(as, num_indexed_chars);
+        writer sizer(nullptr, nullptr);
+        if (params) {
+            two_stage_index::write_binary(sizer, as, num_indexed_chars, *params);
+        } else {
+            tsi.write_binary(sizer);
+        }
+        std::vector<char> buf(sizer.get_size(), 1);
+        writer wr(buf.data(), buf.data() + buf.size());
+        if (params) {
+            two_stage_index::write_binary(wr, as, num_indexed_chars, *params);
+        } else {
+            tsi.write_binary(wr);
+        }
+        BOOST_CHECK(wr.is_end());
+        return buf;
+    };
+
+    // A small memory limit forces the addresses to be merged from several runs.
+    // Runs sorted on several threads give the same result.
+    for (size_t num_indexed_chars = 2; num_indexed_chars <= 6; num_indexed_chars += 2) {
+        auto expected = image(num_indexed_chars, nullptr);
+        for (size_t num_threads = 1; num_threads <= 3; num_threads += 2) {
+            index_params counted, in_memory, spilled;
+            counted.num_threads = in_memory.num_threads = spilled.num_threads = num_threads;
+            in_memory.max_memory = 1 << 30;
+            spilled.max_memory = 8192;
+            BOOST_CHECK(image(num_indexed_chars, &counted) == expected);
+            BOOST_CHECK(image(num_indexed_chars, &in_memory) == expected);
+            BOOST_CHECK(image(num_indexed_chars, &spilled) == expected);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( compressed_two_stage_index_test )
+{
+    using namespace boost::genetics;
+
+    {
+        // Two buckets of increasing values with a few large gaps.
+        std::vector<uint32_t> index = { 0, 300, 1000 };
+        std::vector<uint32_t> values(1000);
+        for (size_t j = 0; j != values.size(); ++j) {
+            values[j] = (uint32_t)(j * 7 + (j % 100 == 0 ? j * 1000 : 0) + (j < 300 ? 0 : 100));
+            if (j != 0 && j != 300 && values[j] <= values[j-1]) values[j] = values[j-1] + 1;
+        }
+        basic_compressed_addr_array<std::vector<boost::genetics::uint64_t> > compressed;
+        compressed.assign(index, 2, values);
+        for (size_t j = 0; j != values.size(); ++j) {
+            BOOST_CHECK(compressed[j] == values[j]);
+        }
+        for (uint32_t target = 0; target < 1200000; target += 997) {
+            for (size_t b = 0; b != 2; ++b) {
+                addr_cursor<std::vector<uint32_t> > expected(values, index[b], index[b+1]);
+                addr_cursor<basic_compressed_addr_array<std::vector<boost::genetics::uint64_t> > > actual(compressed, index[b], index[b+1]);
+                expected.seek(target);
+                actual.seek(target);
+                BOOST_CHECK(expected.size() == actual.size());
+                if (expected.size()) BOOST_CHECK(*expected == *actual);
+            }
+        }
+    }
+
+    basic_augmented_string<compressed_traits> cas(chr1);
+    augmented_string as(chr1);
+
+    for (size_t num_indexed_chars = 2; num_indexed_chars <= 6; num_indexed_chars += 2) {
+        two_stage_index tsi(as, num_indexed_chars);
+        compressed_two_stage_index ctsi(cas, num_indexed_chars);
+
+        // Every address decodes to the same value.
+        std::ostringstream expected, actual;
+        expected << tsi;
+        actual << ctsi;
+        BOOST_CHECK(expected.str() == actual.str());
+
+        // Write and map the compressed index.
+        writer sizer(nullptr, nullptr);
+        cas.write_binary(sizer);
+        ctsi.write_binary(sizer);
+        std::vector<boost::genetics::uint64_t> buf(sizer.get_size() / 8 + 1);
+        writer wr((char*)buf.data(), (char*)buf.data() + sizer.get_size());
+        cas.write_binary(wr);
+        ctsi.write_binary(wr);
+        BOOST_CHECK(wr.is_end());
+
+        mapper map((const char*)buf.data(), (const char*)buf.data() + sizer.get_size());
+        basic_augmented_string<compressed_mapped_traits> mas(map);
+        compressed_mapped_two_stage_index mtsi(mas, map);
+        BOOST_CHECK(map.is_end());
+
+        // Searches give the same results, including seeking to min_pos.
+        search_stats stats;
+        for (size_t max_distance = 0; max_distance <= 2; ++max_distance) {
+            search_params params;
+            params.max_distance = max_distance;
+            for (size_t key_pos = 0; key_pos < 1800; key_pos += 97) {
+                std::string key = as.substr(key_pos, 60);
+                for (size_t min_pos = 0; min_pos < 1500; min_pos += 700) {
+                    std::vector<size_t> a, b, c;
+                    for (auto i = tsi.find_inexact(key, min_pos, params, stats); i != tsi.end(); ++i) a.push_back(i);
+                    for (auto i = ctsi.find_inexact(key, min_pos, params, stats); i != ctsi.end(); ++i) b.push_back(i);
+                    for (auto i = mtsi.find_inexact(key, min_pos, params, stats); i != mtsi.end(); ++i) c.push_back(i);
+                    BOOST_CHECK(a == b);
+                    BOOST_CHECK(a == c);
+                }
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( large_traits_test )
+{
+    using namespace boost::genetics;
+
+    // 64 bit addresses give the same BWT and index as 32 bit ones.
+    {
+        dna_string dna(chr1);
+        large_dna_string large_dna(chr1);
+        dna_string bwt;
+        large_dna_string large_bwt;
+        size_t inverse_sa0 = 0, large_inverse_sa0 = 0;
+        dna.bwt(bwt, inverse_sa0);
+        large_dna.bwt(large_bwt, large_inverse_sa0);
+        BOOST_CHECK(std::string(bwt) == std::string(large_bwt));
+        BOOST_CHECK(inverse_sa0 == large_inverse_sa0);
+
+        large_fm_index fm(large_dna);
+        BOOST_CHECK(fm.verify());
+    }
+
+    augmented_string as(chr1);
+    large_augmented_string las(chr1);
+    two_stage_index tsi(as, 4);
+    large_two_stage_index ltsi(las, 4);
+
+    std::ostringstream expected, actual;
+    expected << tsi;
+    actual << ltsi;
+    BOOST_CHECK(expected.str() == actual.str());
+
+    writer sizer(nullptr, nullptr);
+    las.write_binary(sizer);
+    ltsi.write_binary(sizer);
+    std::vector<boost::genetics::uint64_t> buf(sizer.get_size() / 8 + 1);
+    writer wr((char*)buf.data(), (char*)buf.data() + sizer.get_size());
+    las.write_binary(wr);
+    ltsi.write_binary(wr);
+    BOOST_CHECK(wr.is_end());
+
+    mapper map((const char*)buf.data(), (const char*)buf.data() + sizer.get_size());
+    large_mapped_augmented_string mas(map);
+    large_mapped_two_stage_index mtsi(mas, map);
+    BOOST_CHECK(map.is_end());
+
+    search_params params;
+    search_stats stats;
+    params.max_distance = 2;
+    for (size_t key_pos = 0; key_pos < 1800; key_pos += 97) {
+        std::string key = as.substr(key_pos, 60);
+        std::vector<size_t> a, b;
+        for (auto i = tsi.find_inexact(key, 0, params, stats); i != tsi.end(); ++i) a.push_back(i);
+        for (auto i = mtsi.find_inexact(key, 0, params, stats); i != mtsi.end(); ++i) b.push_back(i);
+        BOOST_CHECK(a == b);
+    }
+}
+
+BOOST_AUTO_TEST_CASE( merge_engine_test )
+{
+    using namespace boost::genetics;
+
+    augmented_string as(chr1);
+    two_stage_index tsi(as, 4);
+
+    // The sort merge must find the same hits as the heap merge.
+    search_params heap_params, sort_params;
+    search_stats stats;
+    sort_params.merge = sort_merge;
+    for (size_t max_distance = 0; max_distance != 4; ++max_distance) {
+        heap_params.max_distance = sort_params.max_distance = max_distance;
+        for (size_t key_pos = 0; key_pos < 1800; key_pos += 89) {
+            std::string key = as.substr(key_pos, 40);
+            key[key_pos % 40] = 'A';
+            for (size_t min_pos = 0; min_pos < 2000; min_pos += 500) {
+                std::vector<size_t> a, b;
+                for (auto i = tsi.find_inexact(key, min_pos, heap_params, stats); i != tsi.end(); ++i) a.push_back(i);
+                for (auto i = tsi.find_inexact(key, min_pos, sort_params, stats); i != tsi.end(); ++i) b.push_back(i);
+                BOOST_CHECK(a == b);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( repetitive_seed_test )
+{
+    using namespace boost::genetics;
+
+    augmented_string as(chr1);
+    two_stage_index tsi(as, 4);
+
+    // The histogram covers every bucket and address.
+    std::vector<size_t> hist;
+    tsi.occupancy_histogram(hist);
+    BOOST_CHECK(std::accumulate(hist.begin(), hist.end(), (size_t)0) == 256);
+    BOOST_CHECK(hist.size() >= 2 && hist.back() != 0);
+
+    // With a low cutoff, shifted seeds find reads the primary seeds miss.
+    search_params params;
+    search_stats stats;
+    params.max_distance = 1;
+    params.max_bucket_size = 8;
+    size_t found = 0, found_shifted = 0;
+    for (size_t key_pos = 0; key_pos < 1800; key_pos += 31) {
+        std::string key = as.substr(key_pos, 24);
+        for (size_t shifts = 0; shifts <= 3; shifts += 3) {
+            params.max_seed_shifts = shifts;
+            bool is_found = false;
+            for (auto i = tsi.find_inexact(key, 0, params, stats); i != tsi.end(); ++i) {
+                is_found = is_found || i == key_pos;
+            }
+            (shifts ? found_shifted : found) += is_found;
+        }
+    }
+    BOOST_CHECK(found_shifted > found);
+    BOOST_CHECK(stats.seed_shifts_done != 0);
+}
+
+BOOST_AUTO_TEST_CASE( spaced_seed_test )
+{
+    using namespace boost::genetics;
+
+    augmented_string as(chr1);
+    BOOST_CHECK(parse_seed_mask("11011") == 0x1b);
+    BOOST_CHECK(seed_mask_span(0x1b) == 5 && seed_mask_chars(0x1b) == 4);
+
+    // A mask with every bit set is the same as contiguous seeds.
+    {
+        index_params params;
+        params.seed_mask = 0xf;
+        std::ostringstream expected, actual;
+        expected << two_stage_index(as, 4);
+        actual << two_stage_index(as, 4, params);
+        BOOST_CHECK(expected.str() == actual.str());
+    }
+
+    // Every build strategy gives the same spaced seed index.
+    index_params params;
+    params.seed_mask = 0x1b;
+    two_stage_index tsi(as, 4, params);
+    std::ostringstream expected;
+    expected << tsi;
+    for (size_t i = 0; i != 3; ++i) {
+        index_params build = params;
+        build.num_threads = i == 1 ? 3 : 1;
+        build.strategy = i == 2 ? radix_partition : direct_scatter;
+        std::ostringstream actual;
+        actual << two_stage_index(as, 4, build);
+        BOOST_CHECK(expected.str() == actual.str());
+    }
+
+    // The mask is kept in the image and streaming gives the same image.
+    writer sizer(nullptr, nullptr);
+    as.write_binary(sizer);
+    tsi.write_binary(sizer);
+    std::vector<boost::genetics::uint64_t> buf(sizer.get_size() / 8 + 1), streamed(buf.size());
+    writer wr((char*)buf.data(), (char*)buf.data() + sizer.get_size());
+    as.write_binary(wr);
+    tsi.write_binary(wr);
+    index_params spilled = params;
+    spilled.max_memory = 1;
+    writer swr((char*)streamed.data(), (char*)streamed.data() + sizer.get_size());
+    as.write_binary(swr);
+    two_stage_index::write_binary(swr, as, 4, spilled);
+    BOOST_CHECK(buf == streamed);
+
+    mapper map((const char*)buf.data(), (const char*)buf.data() + sizer.get_size());
+    mapped_augmented_string mas(map);
+    mapped_two_stage_index mtsi(mas, map);
+    std::ostringstream mapped;
+    mapped << mtsi;
+    BOOST_CHECK(expected.str() == mapped.str());
+
+    // Keys with errors are always found unless a seed is all A or T, as those are not indexed.
+    auto has_poly_seed = [](const std::string &key, uint32_t mask) {
+        size_t span = seed_mask_span(mask);
+        for (size_t pos = 0; pos + span <= key.size(); ++pos) {
+            std::string seed;
+            for (size_t i = 0; i != span; ++i) {
+                if ((mask >> i) & 1) seed.push_back(key[pos + i]);
+            }
+            if (seed.find_first_not_of('A') == std::string::npos || seed.find_first_not_of('T') == std::string::npos) return true;
+        }
+        return false;
+    };
+
+    two_stage_index contiguous(as, 4);
+    search_params sparams;
+    search_stats stats;
+    sparams.max_distance = 2;
+    sparams.max_bucket_size = 1000;
+    for (size_t stride = 0; stride != 3; ++stride) {
+        sparams.seed_stride = stride;
+        for (size_t key_pos = 0; key_pos < 1800; key_pos += 41) {
+            std::string key = as.substr(key_pos, 24);
+            if (key.find('N') != std::string::npos) continue;
+            key[key_pos % 7] = key[key_pos % 7] == 'A' ? 'C' : 'A';
+            key[key_pos % 11 + 12] = key[key_pos % 11 + 12] == 'A' ? 'C' : 'A';
+            if (!has_poly_seed(key, 0xf)) {
+                bool found = false;
+                for (auto i = contiguous.find_inexact(key, 0, sparams, stats); i != contiguous.end(); ++i) found = found || i == key_pos;
+                BOOST_CHECK(found);
+            }
+            if (!has_poly_seed(key, 0x1b)) {
+                bool found = false;
+                for (auto i = tsi.find_inexact(key, 0, sparams, stats); i != tsi.end(); ++i) found = found || i == key_pos;
+                BOOST_CHECK(found);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE( gapped_search_test )
+{
+    using namespace boost::genetics;
+
+    std::string ref = std::string(chr1).substr(0, 600);
+    std::string read = ref.substr(200, 80);
+
+    // Edit distance finds the gaps and where the match starts.
+    {
+        dna_string str(ref);
+        size_t match_pos = 0;
+        std::string cigar;
+        BOOST_CHECK(str.edit_distance(203, dna_string(read), 3, 0, match_pos, cigar) == 0);
+        BOOST_CHECK(match_pos == 200 && cigar == "80M");
+
+        std::string deleted = read.substr(0, 40) + read.substr(43);
+        BOOST_CHECK(str.edit_distance(200, dna_string(deleted), 3, 3, match_pos, cigar) == 3);
+        BOOST_CHECK(match_pos == 200 && cigar.find("M3D") != std::string::npos);
+        BOOST_CHECK(str.edit_distance(200, dna_string(deleted), 3, 2, match_pos, cigar) == dna_string::npos);
+
+        std::string long_read = ref.substr(100, 150) + "T" + ref.substr(250, 100);
+        BOOST_CHECK(str.edit_distance(100, dna_string(long_read), 2, 2, match_pos, cigar) == 1);
+        BOOST_CHECK(match_pos == 100 && cigar == "150M1I100M");
+    }
+
+    // Searches with max_gap find reads with insertions and deletions.
+    augmented_string as(ref);
+    two_stage_index tsi(as, 4);
+    search_params params;
+    search_stats stats;
+    params.max_distance = 2;
+    params.max_gap = 2;
+    for (size_t gap = 1; gap <= 2; ++gap) {
+        std::string inserted = read.substr(0, 50) + std::string(gap, 'T') + read.substr(50);
+        std::string deleted = read.substr(0, 50) + read.substr(50 + gap);
+        for (size_t k = 0; k != 2; ++k) {
+            const std::string &key = k == 0 ? inserted : deleted;
+            std::vector<size_t> hits;
+            std::string cigar;
+            for (auto i = tsi.find_inexact(key, 0, params, stats); i != tsi.end(); ++i) {
+                hits.push_back(i);
+                cigar = i.cigar();
+            }
+            BOOST_CHECK(hits.size() == 1 && hits[0] == 200);
+            BOOST_CHECK(cigar.find(k == 0 ? 'I' : 'D') != std::string::npos);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_CASE( mapped_container_test )
 {
     using namespace boost::genetics;
@@ -406,6 +1033,112 @@ BOOST_AUTO_TEST_CASE( fm_index_test )
         dna_string dna(chr1);
         fm_index fm(dna);
         BOOST_CHECK(fm.verify());
+
+        // The BWT is read back from the occurrence table.
+        dna_string bwt;
+        size_t inverse_sa0 = 0;
+        dna.bwt(bwt, inverse_sa0);
+        BOOST_CHECK(fm.bwt() == bwt);
+        BOOST_CHECK(fm.inverse_sa0() == inverse_sa0);
+        dna_string ibwt;
+        fm.ibwt(ibwt, 3);
+        BOOST_CHECK(ibwt == dna);
+    }
+    {
+        // backward search counts every occurrence, mapped or unmapped.
+        dna_string dna(chr1);
+        std::string str(dna);
+        fm_index fm(dna);
+
+        writer sizer(nullptr, nullptr);
+        dna.write_binary(sizer);
+        fm.write_binary(sizer);
+        std::vector<boost::genetics::uint64_t> buf(sizer.get_size() / 8 + 1);
+        writer wr((char*)buf.data(), (char*)buf.data() + sizer.get_size());
+        dna.write_binary(wr);
+        fm.write_binary(wr);
+        BOOST_CHECK(wr.is_end());
+
+        mapper map((const char*)buf.data(), (const char*)buf.data() + sizer.get_size());
+        mapped_dna_string mdna(map);
+        mapped_fm_index mfm(mdna, map);
+        BOOST_CHECK(map.is_end());
+        BOOST_CHECK(mfm.cumulative_index() == fm.cumulative_index());
+
+        for (size_t pos = 0; pos < str.size(); pos += 37) {
+            for (size_t length = 1; length <= 25 && pos + length <= str.size(); length += 6) {
+                std::string key = str.substr(pos, length);
+                if (pos % 2) key[length / 2] = 'G';
+                std::vector<size_t> expected;
+                for (size_t i = str.find(key); i != std::string::npos; i = str.find(key, i + 1)) {
+                    expected.push_back(i);
+                }
+                BOOST_CHECK(fm.count(key) == expected.size());
+                BOOST_CHECK(mfm.count(key) == expected.size());
+
+                std::vector<size_t> positions, mapped_positions;
+                fm.locate(positions, fm.backward_search(key));
+                mfm.locate(mapped_positions, mfm.backward_search(key));
+                BOOST_CHECK(positions == expected);
+                BOOST_CHECK(mapped_positions == expected);
+            }
+        }
+        BOOST_CHECK(fm.count("") == str.size() + 1);
+        BOOST_CHECK(fm.count("ACGTN") == 0);
+    }
+    {
+        // any sample rate locates every position of the suffix array.
+        dna_string dna(chr1);
+        for (size_t sa_sample_rate : { 1, 3, 64, 5000 }) {
+            fm_index fm(dna, sa_sample_rate);
+            BOOST_CHECK(fm.sa_sample_rate() == sa_sample_rate);
+            BOOST_CHECK(fm.verify());
+        }
+        BOOST_CHECK_THROW(fm_index(dna, 0), std::invalid_argument);
+    }
+    {
+        // seeds and backtracking find the same matches as a brute force search.
+        dna_string dna(chr1);
+        std::string str(dna);
+        fm_index fm(dna);
+        for (size_t max_distance = 0; max_distance != 4; ++max_distance) {
+            for (size_t key_pos = 0; key_pos + 50 < str.size(); key_pos += 113) {
+                std::string key = str.substr(key_pos, 12 + key_pos % 30);
+                key[key_pos % 5] = 'T';
+                key[key.size() - 1 - key_pos % 7] = 'A';
+                std::vector<size_t> expected;
+                for (size_t pos = dna.find_inexact(key, 0, ~(size_t)0, max_distance); pos != dna_string::npos; pos = dna.find_inexact(key, pos + 1, ~(size_t)0, max_distance)) {
+                    expected.push_back(pos);
+                }
+                std::vector<size_t> positions;
+                fm.find_inexact(positions, key, max_distance);
+                BOOST_CHECK(positions == expected);
+                fm.find_inexact(positions, key, max_distance, ~(size_t)0, 0);
+                BOOST_CHECK(positions == expected);
+
+                // The lowest positions are kept, whether found by seeds or backtracking.
+                expected.resize(std::min(expected.size(), (size_t)2));
+                fm.find_inexact(positions, key, max_distance, 2);
+                BOOST_CHECK(positions == expected);
+                fm.find_inexact(positions, key, max_distance, 2, 0);
+                BOOST_CHECK(positions == expected);
+            }
+        }
+
+        // 'N' is always an error.
+        std::vector<size_t> positions;
+        std::string key = str.substr(500, 30);
+        key[10] = 'N';
+        fm.find_inexact(positions, key, 0);
+        BOOST_CHECK(positions.empty());
+        fm.find_inexact(positions, key, 1);
+        BOOST_CHECK(std::find(positions.begin(), positions.end(), (size_t)500) != positions.end());
+        fm.find_inexact(positions, key, 1, ~(size_t)0, 0);
+        BOOST_CHECK(std::find(positions.begin(), positions.end(), (size_t)500) != positions.end());
+
+        fm_index empty_fm;
+        empty_fm.find_inexact(positions, "ACGT", 2);
+        BOOST_CHECK(empty_fm.empty() && positions.empty());
     }
 }
 
@@ -473,6 +1206,64 @@ BOOST_AUTO_TEST_CASE( bwt_test )
         //std::cout << std::chrono::duration_cast<std::chrono::microseconds>(t2 - t1).count() << "us\n";
         BOOST_CHECK(ibwt == dna);
     }
+
+    {
+        // the suffix array is in order and threads give the same BWT.
+        dna_string dna(chr1);
+        std::string str = std::string(dna) + "$";
+        std::vector<dna_string::addr_type> sa;
+        dna.suffix_array(sa);
+        BOOST_CHECK(sa.size() == str.size() && sa[0] == dna.size());
+        for (size_t i = 1; i < sa.size(); ++i) {
+            BOOST_CHECK(str.compare(sa[i-1], std::string::npos, str, sa[i], std::string::npos) < 0);
+        }
+
+        std::string big;
+        while (big.size() < 300000) big += std::string(chr1).substr(big.size() % 97);
+        dna_string big_dna(big);
+        dna_string bwt4;
+        size_t inverse_sa04 = 0;
+        big_dna.bwt(bwt, inverse_sa0);
+        big_dna.bwt(bwt4, inverse_sa04, 4);
+        BOOST_CHECK(bwt == bwt4);
+        BOOST_CHECK(inverse_sa0 == inverse_sa04);
+        bwt4.ibwt(ibwt, inverse_sa04);
+        BOOST_CHECK(ibwt == big_dna);
+
+        // Checkpoints let segments of the inverse be found on several threads.
+        std::vector<dna_string::addr_type> checkpoints;
+        big_dna.checkpointed_bwt(bwt4, inverse_sa04, checkpoints, 50, 2);
+        BOOST_CHECK(bwt == bwt4);
+        for (size_t num_threads : { 1, 3 }) {
+            dna_string expanded;
+            bwt4.ibwt(expanded, inverse_sa04, checkpoints, 50, num_threads);
+            BOOST_CHECK(expanded == big_dna);
+        }
+        checkpoints.pop_back();
+        BOOST_CHECK_THROW(bwt4.ibwt(ibwt, inverse_sa04, checkpoints, 50), std::invalid_argument);
+    }
+
+    {
+        // Merging the BWTs of parts gives the same result and a contig
+        // can be added to the front of an existing BWT.
+        std::string str;
+        while (str.size() < 20000) str += std::string(chr1).substr(str.size() % 89, 1000);
+        dna_string dna(str);
+        dna_string merged, whole;
+        size_t merged_sa0 = 0, whole_sa0 = 0;
+        dna.bwt(whole, whole_sa0);
+        std::vector<size_t> part_starts = { 5000, 123, 15000, 19999 };
+        dna.bwt(merged, merged_sa0, part_starts, 2);
+        BOOST_CHECK(merged == whole);
+        BOOST_CHECK(merged_sa0 == whole_sa0);
+
+        dna_string tail(str.substr(7000));
+        tail.bwt(merged, merged_sa0);
+        dna.prepend_bwt(merged, merged_sa0, 0, 7000);
+        BOOST_CHECK(merged == whole);
+        BOOST_CHECK(merged_sa0 == whole_sa0);
+        BOOST_CHECK_THROW(dna.prepend_bwt(merged, merged_sa0, 19000, 2000), std::invalid_argument);
+    }
 }
 
 BOOST_AUTO_TEST_CASE( occurance_test )